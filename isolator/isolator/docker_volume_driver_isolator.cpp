@@ -17,10 +17,22 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <mesos/mesos.hpp>
 #include <mesos/module.hpp>
 #include <mesos/module/isolator.hpp>
@@ -30,6 +42,11 @@
 #include <glog/logging.h>
 #include <mesos/type_utils.hpp>
 
+#include <process/clock.hpp>
+#include <process/collect.hpp>
+#include <process/delay.hpp>
+#include <process/dispatch.hpp>
+#include <process/metrics/metrics.hpp>
 #include <process/process.hpp>
 #include <process/subprocess.hpp>
 
@@ -40,6 +57,8 @@ using namespace mesos::internal;
 #include <stout/nothing.hpp>
 #include <stout/os.hpp>
 #include <stout/format.hpp>
+#include <stout/hashset.hpp>
+#include <stout/json.hpp>
 #include <stout/strings.hpp>
 
 using namespace process;
@@ -56,6 +75,9 @@ using namespace mesos::slave;
 using mesos::slave::ExecutorRunState;
 using mesos::slave::IsolatorProcess;
 using mesos::slave::Limitation;
+#else
+using mesos::internal::slave::MesosIsolator;
+using mesos::internal::slave::MesosIsolatorProcess;
 #endif
 using mesos::slave::Isolator;
 
@@ -68,28 +90,127 @@ using namespace mesos::internal::slave::state;
 //TODO temporary code until checkpoints are public by mesosphere dev
 
 
-const char DockerVolumeDriverIsolator::prohibitedchars[NUM_PROHIBITED]  =
-{
-  '%', '/', ':', ';', '\0',
-  '<', '>', '|', '`', '$', '\'',
-  '?', '^', '&', ' ', '{', '\"',
-  '}', '[', ']', '\n', '\t', '\v', '\b', '\r', '\\'
-};
-
+string DockerVolumeDriverIsolator::stateDir;
 string DockerVolumeDriverIsolator::mountPbFilename;
 string DockerVolumeDriverIsolator::mesosWorkingDir;
+Duration DockerVolumeDriverIsolator::reconcileInterval;
+Duration DockerVolumeDriverIsolator::reconcileGracePeriod;
+hashmap<string, string> DockerVolumeDriverIsolator::reconcileMountRoots;
+bool DockerVolumeDriverIsolator::verifyInvariants;
+size_t DockerVolumeDriverIsolator::volumeShards;
+size_t DockerVolumeDriverIsolator::fsWorkerCount;
+Duration DockerVolumeDriverIsolator::fsTimeout;
+string DockerVolumeDriverIsolator::inventoryFile;
+string DockerVolumeDriverIsolator::traceFile;
+Duration DockerVolumeDriverIsolator::probeInterval;
+Duration DockerVolumeDriverIsolator::probeTimeout;
+std::vector<string> DockerVolumeDriverIsolator::probeDriverNames;
+string DockerVolumeDriverIsolator::probeVolume;
+hashmap<string, string> DockerVolumeDriverIsolator::probeDvdclis;
+hashmap<string, string> DockerVolumeDriverIsolator::catalogCommands;
+Duration DockerVolumeDriverIsolator::catalogInterval;
+Duration DockerVolumeDriverIsolator::catalogTtl;
+bool DockerVolumeDriverIsolator::deferAttach;
+bool DockerVolumeDriverIsolator::drainEndpoint;
+size_t DockerVolumeDriverIsolator::attachSlots;
+Duration DockerVolumeDriverIsolator::detachRetryInterval;
+Duration DockerVolumeDriverIsolator::orphanDetachDelay;
+hashmap<string, DockerVolumeDriverIsolator::TuningProfile>
+  DockerVolumeDriverIsolator::tuningProfiles;
+string DockerVolumeDriverIsolator::snapshotVolumeOption;
+string DockerVolumeDriverIsolator::cscPath;
+string DockerVolumeDriverIsolator::csiFsType;
+string DockerVolumeDriverIsolator::localPool;
+string DockerVolumeDriverIsolator::cachePool;
+Bytes DockerVolumeDriverIsolator::cacheSize;
+
+// The trace is shared by the isolator and its shards, and written from
+// whichever thread runs them.
+static std::mutex traceMutex;
+static std::ofstream traceStream;
 
 DockerVolumeDriverIsolator::DockerVolumeDriverIsolator(
   const Parameters& _parameters)
-  : parameters(_parameters)
+  : parameters(_parameters),
+    hostMountsFd(-1),
+    draining(false),
+    inventoryGeneration(0)
   {
     // Verify that the version of the library that we linked against is
     // compatible with the version of the headers we compiled against.
     GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    for (size_t i = 0; i < fsWorkerCount; i++) {
+      fsWorkers.push_back(process::Owned<DockerVolumeDriverFsWorker>(
+          new DockerVolumeDriverFsWorker(fsTimeout)));
+    }
+  }
+
+// The helpers dispatch to the isolator as soon as they run, so they
+// are spawned with it rather than when it is constructed.
+void DockerVolumeDriverIsolator::initialize()
+{
+  for (size_t i = 0; i < volumeShards; i++) {
+    shards.push_back(process::Owned<DockerVolumeDriverShard>(
+        new DockerVolumeDriverShard(this)));
+    spawn(shards.back().get());
+  }
+
+  detacher = process::Owned<DockerVolumeDriverDetacher>(
+      new DockerVolumeDriverDetacher(this, detachRetryInterval));
+  spawn(detacher.get());
+
+  endpoints = process::Owned<DockerVolumeDriverEndpoints>(
+      new DockerVolumeDriverEndpoints(this, drainEndpoint));
+  spawn(endpoints.get());
+
+  if (probeInterval > Seconds(0)) {
+    prober = process::Owned<DockerVolumeDriverProber>(
+        new DockerVolumeDriverProber(this, probeInterval));
+    spawn(prober.get());
+  }
+
+  if (!catalogCommands.empty()) {
+    cataloger = process::Owned<DockerVolumeDriverCataloger>(
+        new DockerVolumeDriverCataloger(this, catalogInterval));
+    spawn(cataloger.get());
   }
 
+  if (reconcileInterval > Seconds(0)) {
+    reconciler = process::Owned<DockerVolumeDriverReconciler>(
+        new DockerVolumeDriverReconciler(this, reconcileInterval));
+    spawn(reconciler.get());
+  }
+
+  if (attachSlots > 0) {
+    attachSlotsFree = process::metrics::Gauge(
+        ATTACH_SLOTS_FREE_METRIC,
+        defer(PID<DockerVolumeDriverIsolator>(this),
+              &DockerVolumeDriverIsolator::freeAttachSlots));
+    process::metrics::add(attachSlotsFree.get());
+  }
+}
+
 Try<Isolator*> DockerVolumeDriverIsolator::create(
     const Parameters& parameters)
+{
+  Try<DockerVolumeDriverIsolator*> created = createProcess(parameters);
+  if (created.isError()) {
+    return Error(created.error());
+  }
+
+  // The wrapper spawns the actor, dispatches every call of the agent to
+  // it, and terminates it before deleting it.
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
+  return new Isolator(process::Owned<IsolatorProcess>(created.get()));
+#else
+  return new MesosIsolator(
+      process::Owned<MesosIsolatorProcess>(created.get()));
+#endif
+}
+
+Try<DockerVolumeDriverIsolator*> DockerVolumeDriverIsolator::createProcess(
+    const Parameters& parameters)
 {
   Result<string> user = os::user();
   if (!user.isSome()) {
@@ -103,6 +224,37 @@ Try<Isolator*> DockerVolumeDriverIsolator::create(
 
   LOG(INFO) << "DockerVolumeDriverIsolator::create() called";
   mesosWorkingDir = DEFAULT_WORKING_DIR;
+  stateDir = DVDI_MOUNTLIST_PATH;
+  reconcileInterval = Seconds(0);
+  reconcileGracePeriod = Duration::parse(DEFAULT_RECONCILE_GRACE).get();
+  reconcileMountRoots.clear();
+  reconcileMountRoots.put(VOL_DRIVER_DEFAULT, REXRAY_MOUNT_PREFIX);
+  verifyInvariants = false;
+  volumeShards = DEFAULT_VOLUME_SHARDS;
+  fsWorkerCount = DEFAULT_FS_WORKERS;
+  fsTimeout = Duration::parse(DEFAULT_FS_TIMEOUT).get();
+  inventoryFile.clear();
+  traceFile.clear();
+  probeInterval = Seconds(0);
+  probeTimeout = Duration::parse(DEFAULT_PROBE_TIMEOUT).get();
+  probeDriverNames = {VOL_DRIVER_DEFAULT};
+  probeVolume = DEFAULT_PROBE_VOLUME;
+  probeDvdclis.clear();
+  catalogCommands.clear();
+  catalogInterval = Duration::parse(DEFAULT_CATALOG_INTERVAL).get();
+  catalogTtl = Duration::parse(DEFAULT_CATALOG_TTL).get();
+  deferAttach = false;
+  drainEndpoint = false;
+  attachSlots = 0;
+  detachRetryInterval = Duration::parse(DEFAULT_DETACH_RETRY).get();
+  orphanDetachDelay = Duration::parse(DEFAULT_ORPHAN_DETACH_DELAY).get();
+  tuningProfiles.clear();
+  snapshotVolumeOption = DEFAULT_SNAPSHOT_OPTION;
+  cscPath = DEFAULT_CSC_BIN;
+  csiFsType = DEFAULT_CSI_FS_TYPE;
+  localPool.clear();
+  cachePool.clear();
+  cacheSize = Bytes::parse(DEFAULT_CACHE_SIZE).get();
 
   foreach (const Parameter& parameter, parameters.parameter()) {
     if (parameter.key() == DVDI_WORKDIR_PARAM_NAME) {
@@ -117,24 +269,338 @@ Try<Isolator*> DockerVolumeDriverIsolator::create(
            << " parameter is invalid, must start with /";
         return Error(ss.str());
       }
+    } else if (parameter.key() == STATE_DIR_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      if (parameter.value().length() <= 1 ||
+          !strings::startsWith(parameter.value(), "/")) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(STATE_DIR_PARAM_NAME) +
+                     " parameter is invalid, must start with /");
+      }
+      stateDir = path::join(parameter.value(), "");
+    } else if (parameter.key() == RECONCILE_INTERVAL_PARAM_NAME ||
+               parameter.key() == RECONCILE_GRACE_PARAM_NAME ||
+               parameter.key() == DETACH_RETRY_PARAM_NAME ||
+               parameter.key() == ORPHAN_DETACH_DELAY_PARAM_NAME ||
+               parameter.key() == PROBE_INTERVAL_PARAM_NAME ||
+               parameter.key() == PROBE_TIMEOUT_PARAM_NAME ||
+               parameter.key() == CATALOG_INTERVAL_PARAM_NAME ||
+               parameter.key() == CATALOG_TTL_PARAM_NAME ||
+               parameter.key() == FS_TIMEOUT_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      Try<Duration> duration = Duration::parse(parameter.value());
+      if (duration.isError()) {
+        return Error("DockerVolumeDriverIsolator " + parameter.key() +
+                     " parameter is invalid: " + duration.error());
+      }
+
+      if (parameter.key() == RECONCILE_INTERVAL_PARAM_NAME) {
+        reconcileInterval = duration.get();
+      } else if (parameter.key() == DETACH_RETRY_PARAM_NAME) {
+        if (duration.get() <= Seconds(0)) {
+          return Error("DockerVolumeDriverIsolator " +
+                       string(DETACH_RETRY_PARAM_NAME) +
+                       " parameter is invalid, must be positive");
+        }
+        detachRetryInterval = duration.get();
+      } else if (parameter.key() == ORPHAN_DETACH_DELAY_PARAM_NAME) {
+        if (duration.get() < Seconds(0)) {
+          return Error("DockerVolumeDriverIsolator " +
+                       string(ORPHAN_DETACH_DELAY_PARAM_NAME) +
+                       " parameter is invalid, must not be negative");
+        }
+        orphanDetachDelay = duration.get();
+      } else if (parameter.key() == PROBE_INTERVAL_PARAM_NAME) {
+        probeInterval = duration.get();
+      } else if (parameter.key() == PROBE_TIMEOUT_PARAM_NAME) {
+        if (duration.get() < Seconds(1)) {
+          return Error("DockerVolumeDriverIsolator " +
+                       string(PROBE_TIMEOUT_PARAM_NAME) +
+                       " parameter is invalid, must be at least 1secs");
+        }
+        probeTimeout = duration.get();
+      } else if (parameter.key() == CATALOG_INTERVAL_PARAM_NAME ||
+                 parameter.key() == CATALOG_TTL_PARAM_NAME) {
+        if (duration.get() < Seconds(1)) {
+          return Error("DockerVolumeDriverIsolator " + parameter.key() +
+                       " parameter is invalid, must be at least 1secs");
+        }
+
+        if (parameter.key() == CATALOG_INTERVAL_PARAM_NAME) {
+          catalogInterval = duration.get();
+        } else {
+          catalogTtl = duration.get();
+        }
+      } else if (parameter.key() == FS_TIMEOUT_PARAM_NAME) {
+        if (duration.get() < Seconds(1)) {
+          return Error("DockerVolumeDriverIsolator " +
+                       string(FS_TIMEOUT_PARAM_NAME) +
+                       " parameter is invalid, must be at least 1secs");
+        }
+        fsTimeout = duration.get();
+      } else {
+        reconcileGracePeriod = duration.get();
+      }
+    } else if (parameter.key() == VERIFY_INVARIANTS_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      verifyInvariants =
+        strings::lower(strings::trim(parameter.value())) == "true";
+    } else if (parameter.key() == PROBE_DRIVERS_PARAM_NAME ||
+               parameter.key() == PROBE_VOLUME_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      // Both end up on the dvdcli command line.
+      if (parameter.value().find_first_of(" '\"`$;&|<>\\") != string::npos) {
+        return Error("DockerVolumeDriverIsolator " + parameter.key() +
+                     " parameter is invalid, contains shell characters");
+      }
+
+      if (parameter.key() == PROBE_VOLUME_PARAM_NAME) {
+        if (parameter.value().empty()) {
+          return Error("DockerVolumeDriverIsolator " +
+                       string(PROBE_VOLUME_PARAM_NAME) +
+                       " parameter is invalid, must not be empty");
+        }
+        probeVolume = parameter.value();
+      } else {
+        // Comma separated list of volume drivers.
+        probeDriverNames.clear();
+        foreach (const string& driver,
+                 strings::tokenize(parameter.value(), ",")) {
+          probeDriverNames.push_back(strings::lower(strings::trim(driver)));
+        }
+      }
+    } else if (strings::startsWith(
+                   parameter.key(), PROBE_DVDCLI_PARAM_PREFIX)) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      const string driver = strings::lower(
+          parameter.key().substr(strlen(PROBE_DVDCLI_PARAM_PREFIX)));
+      if (driver.empty() || containsShellChars(driver) ||
+          !strings::startsWith(parameter.value(), "/") ||
+          containsShellChars(parameter.value())) {
+        return Error("DockerVolumeDriverIsolator " + parameter.key() +
+                     " parameter is invalid, must name a volume driver" +
+                     " and an absolute path without shell characters");
+      }
+      probeDvdclis.put(driver, parameter.value());
+    } else if (parameter.key() == INVENTORY_FILE_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      if (!strings::startsWith(parameter.value(), "/")) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(INVENTORY_FILE_PARAM_NAME) +
+                     " parameter is invalid, must start with /");
+      }
+      inventoryFile = parameter.value();
+    } else if (parameter.key() == TRACE_FILE_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      if (!strings::startsWith(parameter.value(), "/")) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(TRACE_FILE_PARAM_NAME) +
+                     " parameter is invalid, must start with /");
+      }
+      traceFile = parameter.value();
+    } else if (parameter.key() == DRAIN_ENDPOINT_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      drainEndpoint =
+        strings::lower(strings::trim(parameter.value())) == "true";
+    } else if (parameter.key() == DEFER_ATTACH_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      deferAttach =
+        strings::lower(strings::trim(parameter.value())) == "true";
+    } else if (strings::startsWith(
+                   parameter.key(), TUNING_PROFILE_PARAM_PREFIX)) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      const string name =
+        parameter.key().substr(strlen(TUNING_PROFILE_PARAM_PREFIX));
+      Try<TuningProfile> profile = parseTuningProfile(parameter.value());
+      if (name.empty() || profile.isError()) {
+        return Error("DockerVolumeDriverIsolator " + parameter.key() +
+                     " parameter is invalid" +
+                     (profile.isError() ? ": " + profile.error() : ""));
+      }
+      tuningProfiles.put(name, profile.get());
+    } else if (strings::startsWith(parameter.key(), CATALOG_PARAM_PREFIX)) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      const string driver = strings::lower(
+          parameter.key().substr(strlen(CATALOG_PARAM_PREFIX)));
+      if (driver.empty() || driver == LOCAL_VOLUME_DRIVER ||
+          strings::trim(parameter.value()).empty()) {
+        return Error("DockerVolumeDriverIsolator " + parameter.key() +
+                     " parameter is invalid, must name a volume driver" +
+                     " and a command");
+      }
+      catalogCommands.put(driver, parameter.value());
+    } else if (parameter.key() == SNAPSHOT_OPTION_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      if (parameter.value().empty() ||
+          parameter.value().find_first_of("=, '\"") != string::npos) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(SNAPSHOT_OPTION_PARAM_NAME) +
+                     " parameter is invalid, must be an option name");
+      }
+      snapshotVolumeOption = parameter.value();
+    } else if (parameter.key() == CSC_PATH_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      if (!strings::startsWith(parameter.value(), "/")) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(CSC_PATH_PARAM_NAME) +
+                     " parameter is invalid, must start with /");
+      }
+      cscPath = parameter.value();
+    } else if (parameter.key() == CSI_FS_TYPE_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      if (parameter.value().empty() ||
+          parameter.value().find_first_not_of(
+              "abcdefghijklmnopqrstuvwxyz0123456789") != string::npos) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(CSI_FS_TYPE_PARAM_NAME) +
+                     " parameter is invalid, must be a filesystem name");
+      }
+      csiFsType = parameter.value();
+    } else if (parameter.key() == LOCAL_POOL_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      if (!strings::startsWith(parameter.value(), "/") ||
+          !os::exists(parameter.value())) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(LOCAL_POOL_PARAM_NAME) +
+                     " parameter is invalid, must be an existing directory");
+      }
+      localPool = parameter.value();
+    } else if (parameter.key() == CACHE_POOL_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      if (!strings::startsWith(parameter.value(), "/") ||
+          !os::exists(parameter.value())) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(CACHE_POOL_PARAM_NAME) +
+                     " parameter is invalid, must be an existing directory");
+      }
+      cachePool = parameter.value();
+    } else if (parameter.key() == CACHE_SIZE_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      Try<Bytes> size = Bytes::parse(parameter.value());
+      if (size.isError() || size.get() < Megabytes(64)) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(CACHE_SIZE_PARAM_NAME) +
+                     " parameter is invalid, must be at least 64MB");
+      }
+      cacheSize = size.get();
+    } else if (parameter.key() == VOLUME_SHARDS_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      Try<size_t> count = numify<size_t>(parameter.value());
+      if (count.isError() || count.get() == 0) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(VOLUME_SHARDS_PARAM_NAME) +
+                     " parameter is invalid, must be a positive integer");
+      }
+      volumeShards = count.get();
+    } else if (parameter.key() == FS_WORKERS_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      Try<size_t> count = numify<size_t>(parameter.value());
+      if (count.isError() || count.get() == 0) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(FS_WORKERS_PARAM_NAME) +
+                     " parameter is invalid, must be a positive integer");
+      }
+      fsWorkerCount = count.get();
+    } else if (parameter.key() == ATTACH_SLOTS_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      Try<size_t> count = numify<size_t>(parameter.value());
+      if (count.isError()) {
+        return Error("DockerVolumeDriverIsolator " +
+                     string(ATTACH_SLOTS_PARAM_NAME) +
+                     " parameter is invalid, must be a non-negative integer");
+      }
+      attachSlots = count.get();
+    } else if (parameter.key() == RECONCILE_ROOTS_PARAM_NAME) {
+      LOG(INFO) << "parameter " << parameter.key() << ":" << parameter.value();
+
+      // Comma separated list of <volumedriver>=<absolute path>.
+      reconcileMountRoots.clear();
+      foreach (const string& root,
+               strings::tokenize(parameter.value(), ",")) {
+        std::vector<string> pair = strings::split(root, "=");
+        if (pair.size() != 2 ||
+            pair[0].empty() ||
+            !strings::startsWith(pair[1], "/")) {
+          return Error("DockerVolumeDriverIsolator " +
+                       string(RECONCILE_ROOTS_PARAM_NAME) +
+                       " parameter is invalid, expected driver=/path: " + root);
+        }
+        reconcileMountRoots.put(
+            strings::trim(pair[0]), path::join(pair[1], ""));
+      }
     }
   }
 
-  mountPbFilename = path::join(DVDI_MOUNTLIST_PATH, DVDI_MOUNTLIST_FILENAME);
+  mountPbFilename = path::join(stateDir, DVDI_MOUNTLIST_FILENAME);
   LOG(INFO) << "using " << mountPbFilename;
 
-#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
-  process::Owned<IsolatorProcess> process(
-      new DockerVolumeDriverIsolator(parameters));
-
-  return new Isolator(process);
-#else
   return new DockerVolumeDriverIsolator(parameters);
-#endif
 }
 
 DockerVolumeDriverIsolator::~DockerVolumeDriverIsolator()
 {
+  if (attachSlotsFree.isSome()) {
+    process::metrics::remove(attachSlotsFree.get());
+  }
+
+  if (reconciler.get() != NULL) {
+    terminate(reconciler.get());
+    wait(reconciler.get());
+  }
+
+  if (detacher.get() != NULL) {
+    terminate(detacher.get());
+    wait(detacher.get());
+  }
+
+  if (prober.get() != NULL) {
+    terminate(prober.get());
+    wait(prober.get());
+  }
+
+  if (cataloger.get() != NULL) {
+    terminate(cataloger.get());
+    wait(cataloger.get());
+  }
+
+  if (endpoints.get() != NULL) {
+    terminate(endpoints.get());
+    wait(endpoints.get());
+  }
+
+  foreach (const process::Owned<DockerVolumeDriverShard>& shard, shards) {
+    terminate(shard.get());
+    wait(shard.get());
+  }
+
+  // Waits for the calls still queued on the filesystem workers, for at
+  // most fsTimeout each.
+  fsWorkers.clear();
+
+  if (hostMountsFd >= 0) {
+    ::close(hostMountsFd);
+  }
+
   // Delete all global objects allocated by libprotobuf.
   google::protobuf::ShutdownProtobufLibrary();
 }
@@ -151,6 +617,13 @@ Future<Nothing> DockerVolumeDriverIsolator::recover(
 {
   LOG(INFO) << "DockerVolumeDriverIsolator recover() was called";
 
+  {
+    JSON::Object event;
+    event.values["containers"] = JSON::Number(states.size());
+    event.values["orphans"] = JSON::Number(orphans.size());
+    trace("recover", event);
+  }
+
   // Slave recovery is a feature of Mesos that allows task/executors
   // to keep running if a slave process goes down, AND
   // allows the slave process to reconnect with already running
@@ -191,9 +664,8 @@ Future<Nothing> DockerVolumeDriverIsolator::recover(
   }
 
   // read container mounts from filesystem
-  std::ifstream ifs(mountPbFilename);
-
-  if (!os::exists(mountPbFilename)) {
+  Result<ExternalMountList> read = readMountList(mountPbFilename);
+  if (read.isNone()) {
     LOG(INFO) << "No mount protobuf file exists at " << mountPbFilename
               << " so there are no mounts to recover";
     return Nothing();
@@ -202,13 +674,12 @@ Future<Nothing> DockerVolumeDriverIsolator::recover(
   LOG(INFO) << "Parsing mount protobuf file(" << mountPbFilename
             << ") in recover()";
 
-  ExternalMountList mountlist;
-  if( !mountlist.ParseFromIstream(&ifs) )
-  {
-    LOG(INFO) << "Invalid protobuf data contained within " << mountPbFilename;
+  if (read.isError()) {
+    LOG(INFO) << read.error();
     return Nothing();
   }
 
+  const ExternalMountList& mountlist = read.get();
   for (int i = 0; i < mountlist.mount_size(); i++)
   {
     ExternalMount mount = mountlist.mount(i);
@@ -236,14 +707,65 @@ Future<Nothing> DockerVolumeDriverIsolator::recover(
         LOG(INFO) << mount.SerializeAsString();
 
         originalContainerMounts.put(mount.containerid(),
-          process::Owned<ExternalMount>(&mount));
+          process::Owned<ExternalMount>(new ExternalMount(mount)));
       }
     }
   }
 
+  // Volumes that were still being detached when the agent stopped.
+  hashmap<ExternalMountID, process::Owned<ExternalMount>> legacyDetaching;
+  for (int i = 0; i < mountlist.detaching_size(); i++) {
+    const ExternalMount& mount = mountlist.detaching(i);
+
+    if (containsProhibitedChars(mount.volumedriver()) ||
+        containsProhibitedChars(mount.volumename()) ||
+        mount.volumename().empty()) {
+      LOG(ERROR) << "Detaching element in protobuf contains an illegal "
+                 << "character, mount will be ignored";
+      continue;
+    }
+
+    legacyDetaching.put(getExternalMountId(mount),
+      process::Owned<ExternalMount>(new ExternalMount(mount)));
+  }
+
+  // Volumes the agent mounted, adopted or held before it stopped.
+  for (int i = 0; i < mountlist.claimed_size(); i++) {
+    const ExternalMount& mount = mountlist.claimed(i);
+
+    if (containsProhibitedChars(mount.volumedriver()) ||
+        containsProhibitedChars(mount.volumename()) ||
+        mount.volumename().empty()) {
+      LOG(ERROR) << "Claimed element in protobuf contains an illegal "
+                 << "character, mount will be ignored";
+      continue;
+    }
+
+    claimed.put(getExternalMountId(mount),
+      process::Owned<ExternalMount>(new ExternalMount(mount)));
+  }
+
+  // Original queue attributes of the disks of volumes tuned before.
+  hashmap<ExternalMountID, TunedDevice> legacyTuned;
+  for (int i = 0; i < mountlist.tuned_size(); i++) {
+    ExternalMount mount;
+    mount.set_volumedriver(mountlist.tuned(i).volumedriver());
+    mount.set_volumename(mountlist.tuned(i).volumename());
+    legacyTuned.put(getExternalMountId(mount), mountlist.tuned(i));
+  }
+
+  // A drain in progress when the agent stopped goes on.
+  if (mountlist.draining()) {
+    LOG(INFO) << "The agent was draining its volumes, prepare() stays "
+              << "disabled until the drain is ended";
+    draining = true;
+  }
+
   LOG(INFO) << "Parsed " << mountPbFilename
             << " and found evidence of " << originalContainerMounts.size()
-            << " previous active external mounts in recover()";
+            << " previous active external mounts and "
+            << legacyDetaching.size()
+            << " detaching external mounts in recover()";
 
   // Both maps start empty, we will iterate to populate.
   using externalmountmap =
@@ -259,6 +781,11 @@ Future<Nothing> DockerVolumeDriverIsolator::recover(
                 originalContainerMounts) {
     legacyMounts.put(getExternalMountId(*(mount.get())), mount);
   }
+  foreachpair (const ExternalMountID& id,
+               const process::Owned<ExternalMount>& mount,
+               legacyDetaching) {
+    legacyMounts.put(id, mount);
+  }
 
 #if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
   foreach (const ExecutorRunState& state, states) {
@@ -276,6 +803,7 @@ Future<Nothing> DockerVolumeDriverIsolator::recover(
 
         // Copy task element to rebuild infos.
         infos.put(state.id, mount);
+        pids.put(state.id, state.pid);
         ExternalMountID id = getExternalMountId(*mount);
         LOG(INFO) << "Re-identified a preserved mount, id is " << id;
         inUseMounts.put(id, mount);
@@ -298,6 +826,8 @@ Future<Nothing> DockerVolumeDriverIsolator::recover(
       foreach (const process::Owned<ExternalMount> &mount, mountsForContainer) {
         // Copy task element to rebuild infos.
         infos.put(state.container_id(), mount);
+        pids.put(state.container_id(), state.pid());
+        allocated.put(state.container_id(), state.executor_info().resources());
         ExternalMountID id = getExternalMountId(*mount);
         LOG(INFO) << "Re-identified a preserved mount, id is " << id;
         inUseMounts.put(id, mount);
@@ -306,17 +836,6 @@ Future<Nothing> DockerVolumeDriverIsolator::recover(
   }
 #endif
 
-  // Create ExternalMountList protobuf message to checkpoint
-  ExternalMountList inUseMountsProtobuf;
-  foreachvalue( const process::Owned<ExternalMount> &mount, inUseMounts) {
-    ExternalMount* mptr = inUseMountsProtobuf.add_mount();
-    mptr->CopyFrom(*(mount.get()));
-  }
-
-  //checkpoint the dvdi mounts for persistence
-  mesos::internal::slave::state::checkpoint(mountPbFilename,
-      inUseMountsProtobuf);
-
   // We will now reduce legacyMounts to only the mounts that should be removed.
   // We will do this by deleting the mounts still in use.
   foreachkey( const ExternalMountID &id, inUseMounts) {
@@ -324,250 +843,2365 @@ Future<Nothing> DockerVolumeDriverIsolator::recover(
   }
 
   // legacyMounts now contains only "orphan" mounts whose task is gone.
-  // We will attempt to unmount these.
-  foreachvalue (const process::Owned<ExternalMount> &mount, legacyMounts) {
-    if (!unmount(*(mount.get()), "recover()")) {
-      return Failure("recover() failed during unmount attempt");
+  // They are checkpointed as detaching, but their unmounts only start
+  // orphanDetachDelay from now: the agent is back as soon as recover()
+  // returns, the shards are free for the first prepare() calls, and a
+  // relaunched task reclaims its volumes without a detach and re-attach.
+  // Tuned volumes that are still held, or about to be detached, keep
+  // their original queue attributes for the final unmount.
+  foreachpair (const ExternalMountID& id,
+               const TunedDevice& tuned,
+               legacyTuned) {
+    if (inUseMounts.contains(id) || legacyMounts.contains(id)) {
+      tunedDevices.put(id, tuned);
     }
   }
 
-  return Nothing();
-}
+  foreachpair (const ExternalMountID& id,
+               const process::Owned<ExternalMount>& mount,
+               legacyMounts) {
+    LOG(INFO) << mount->volumedriver() << "/" << mount->volumename()
+              << " is orphaned, detaching it in " << orphanDetachDelay;
 
-// Attempts to unmount specified external mount, returns true on success.
-// Also returns true so long as DVDCLI is successfully invoked,
-// even if a non-zero return code occurs.
-bool DockerVolumeDriverIsolator::unmount(
-    const ExternalMount& em,
-    const string&   callerLabelForLogging ) const
-{
-  LOG(INFO) << em.volumedriver() << "/" << em.volumename()
-            << " is being unmounted on "
-            << callerLabelForLogging;
+    detaching.put(id, mount);
+    orphaned.insert(id);
+  }
 
-  if (!os::exists(em.dvdcli_path())) {
-    LOG(ERROR) << "The DVDCLI binary doesn't exist at the specified path "
-               << em.dvdcli_path();
-    return false;
+  // Checkpoints written before claimed volumes were recorded only name
+  // them as held or detaching.
+  foreachvalue (const process::Owned<ExternalMount>& mount, infos) {
+    if (!claimed.contains(getExternalMountId(*mount))) {
+      claimed.put(getExternalMountId(*mount), mount);
+    }
+  }
+  foreachpair (const ExternalMountID& id,
+               const process::Owned<ExternalMount>& mount,
+               detaching) {
+    if (!claimed.contains(id)) {
+      claimed.put(id, mount);
+    }
   }
 
-  if (system(NULL)) { // Is a command processor available?
+  // Checkpoint every container's mounts, not just one entry per volume,
+  // so the refcounts survive another restart.
+  checkpointInfos();
 
-    LOG(INFO) << "Invoking " << em.dvdcli_path()
-              << " " << DVDCLI_UNMOUNT_CMD << " "
-              << VOL_DRIVER_CMD_OPTION << em.volumedriver() << " "
-              << VOL_NAME_CMD_OPTION << em.volumename();
+  if (!orphaned.empty()) {
+    delay(orphanDetachDelay,
+          detacher->self(),
+          &DockerVolumeDriverDetacher::detachOrphans);
+  }
 
-#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
-    std::ostringstream cmdOut;
-    Try<int> retcode = os::shell(&cmdOut, "%s %s %s%s %s%s",
-      em.dvdcli_path().c_str(),
-      DVDCLI_UNMOUNT_CMD,
-      VOL_DRIVER_CMD_OPTION,
-      em.volumedriver().c_str(),
-      VOL_NAME_CMD_OPTION,
-      em.volumename().c_str());
-#else
-    Try<string> retcode = os::shell("%s %s %s%s %s%s ",
-      em.dvdcli_path().c_str(),
-      DVDCLI_UNMOUNT_CMD,
-      VOL_DRIVER_CMD_OPTION,
-      em.volumedriver().c_str(),
-      VOL_NAME_CMD_OPTION,
-      em.volumename().c_str());
-#endif
+  checkInvariants("recover()");
 
-    if (retcode.isError()) {
-      LOG(WARNING) << em.dvdcli_path() << " " << DVDCLI_UNMOUNT_CMD
-                   << " failed to execute on " << callerLabelForLogging
-                   << ", continuing on the assumption this volume was "
-                   << "manually unmounted previously "
-                   << retcode.error();
-    } else {
-#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
-      LOG(INFO) << em.dvdcli_path() << " " << DVDCLI_UNMOUNT_CMD
-        << " returned " << retcode.get() << ", " << cmdOut.str();
-#else
-      LOG(INFO) << em.dvdcli_path() << " " << DVDCLI_UNMOUNT_CMD
-        << " returned " << retcode.get();
-#endif
+  return Nothing();
+}
+
+// Returns the sum of the scalar resources with the given name.
+static uint64_t scalarResource(const Resources& resources, const string& name)
+{
+  double value = 0;
+  foreach (const Resource& resource, resources) {
+    if (resource.name() == name && resource.type() == Value::SCALAR) {
+      value += resource.scalar().value();
     }
-  } else {
-    LOG(ERROR) << "failed to acquire a command processor for unmount on "
-               << callerLabelForLogging;
-    return false;
   }
-
-  return true;
+  return static_cast<uint64_t>(value);
 }
 
-string formatOptions(const string& options)
+// Returns the major:minor of the disk holding the filesystem mounted at
+// mountpoint. Throttling rules only apply to whole disks, so partitions
+// are mapped to their disk.
+static Try<string> blockDevice(const string& mountpoint)
 {
-  std::stringstream buf;
-  std::size_t i = 0, j = options.find(",");
+  struct stat stat;
+  if (::stat(mountpoint.c_str(), &stat) < 0) {
+    return ErrnoError("Failed to stat " + mountpoint);
+  }
 
-  while (j != std::string::npos) {
-    if (j > i) {
-      buf << " " << VOL_OPTS_CMD_OPTION << options.substr(i, j-i);
-    }
-    i = j+1;
-    j = options.find(",", i);
+  // Network and pseudo filesystems have anonymous devices.
+  if (major(stat.st_dev) == 0) {
+    return Error(mountpoint + " is not backed by a block device");
+  }
+
+  const string device =
+    stringify(major(stat.st_dev)) + ":" + stringify(minor(stat.st_dev));
+  const string sysfs = path::join("/sys/dev/block", device);
+
+  if (!os::exists(path::join(sysfs, "partition"))) {
+    return device;
   }
-  if (i < options.size()) {
-      buf << " " << VOL_OPTS_CMD_OPTION << options.substr(i);
+
+  Try<string> disk = os::read(path::join(sysfs, "..", "dev"));
+  if (disk.isError()) {
+    return Error("Failed to find the disk of partition " + device + ": " +
+                 disk.error());
   }
-  return buf.str();
+  return strings::trim(disk.get());
 }
 
-// Attempts to mount specified external mount,
-// returns non-empty string (mountpoint) on success.
-string DockerVolumeDriverIsolator::mount(
-    const ExternalMount& em,
-    const string&   callerLabelForLogging) const
+// Returns the directory of the cgroup holding pid in the io controller
+// (cgroup v2) or the blkio controller (cgroup v1).
+static Try<string> ioCgroup(pid_t pid)
 {
-  LOG(INFO) << em.volumedriver() << "/" << em.volumename()
-            << " is being mounted on "
-            << callerLabelForLogging;
-
-  if (!os::exists(em.dvdcli_path())) {
-    LOG(ERROR) << "The DVDCLI binary doesn't exist at the specified path "
-               << em.dvdcli_path();
-    return false;
+  Try<string> cgroups = os::read(path::join("/proc", stringify(pid), "cgroup"));
+  if (cgroups.isError()) {
+    return Error("Failed to read the cgroups of pid " + stringify(pid) +
+                 ": " + cgroups.error());
   }
 
-  string mountpoint; // Return value init'd to empty.
-  const string options = formatOptions(em.options());
+  const bool unified =
+    os::exists(path::join(CGROUP_ROOT, "cgroup.controllers"));
 
-  if (system(NULL)) { // Is a command processor available?
-    LOG(INFO) << "Invoking " << em.dvdcli_path()
-              << " " << DVDCLI_MOUNT_CMD << " "
-              << VOL_DRIVER_CMD_OPTION << em.volumedriver() << " "
-              << VOL_NAME_CMD_OPTION << em.volumename() << " "
-              << options;
-
-#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
-    std::ostringstream cmdOut;
-    Try<int> retcode = os::shell(&cmdOut, "%s %s %s%s %s%s %s %s",
-      em.dvdcli_path().c_str(),
-      DVDCLI_MOUNT_CMD,
-      VOL_DRIVER_CMD_OPTION,
-      em.volumedriver().c_str(),
-      VOL_NAME_CMD_OPTION,
-      em.volumename().c_str(),
-      options.c_str(),
-      (em.explicit_create() ? "--explicitCreate=true" : ""));
-#else
-    Try<string> retcode = os::shell("%s %s %s%s %s%s %s %s",
-      em.dvdcli_path().c_str(),
-      DVDCLI_MOUNT_CMD,
-      VOL_DRIVER_CMD_OPTION,
-      em.volumedriver().c_str(),
-      VOL_NAME_CMD_OPTION,
-      em.volumename().c_str(),
-      options.c_str(),
-      (em.explicit_create() ? "--explicitCreate=true" : ""));
-#endif
+  // Each line is <hierarchy-id>:<controllers>:<path>.
+  foreach (const string& line, strings::tokenize(cgroups.get(), "\n")) {
+    size_t first = line.find(':');
+    size_t second = line.find(':', first + 1);
+    if (first == string::npos || second == string::npos) {
+      continue;
+    }
 
-    if (retcode.isError()) {
-      LOG(ERROR) << em.dvdcli_path()<< " " << DVDCLI_MOUNT_CMD
-                 << " failed to execute on " << callerLabelForLogging
-                 << retcode.error();
+    std::vector<string> controllers =
+      strings::tokenize(line.substr(first + 1, second - first - 1), ",");
+    const string cgroup = line.substr(second + 1);
+
+    string dir;
+    if (unified && controllers.empty()) {
+      dir = path::join(CGROUP_ROOT, cgroup);
+    } else if (!unified &&
+               std::find(controllers.begin(), controllers.end(), "blkio") !=
+                 controllers.end()) {
+      dir = path::join(CGROUP_ROOT, "blkio", cgroup);
     } else {
-#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
-      if (retcode.get() != 0) {
-        LOG(ERROR) << em.dvdcli_path() << " " << DVDCLI_MOUNT_CMD
-                   << " returned errorcode " << retcode.get();
-      } else if (strings::trim(cmdOut.str()).empty()) {
-        LOG(ERROR) << em.dvdcli_path() << " " << DVDCLI_MOUNT_CMD
-                   << " returned an empty mountpoint name";
-      } else {
-        mountpoint = strings::trim(cmdOut.str());
-        LOG(INFO) << em.dvdcli_path() << " " << DVDCLI_MOUNT_CMD
-                  << " returned mountpoint:" << mountpoint;
-      }
-#else
-      if (strings::trim(retcode.get()).empty()) {
-        LOG(ERROR) << em.dvdcli_path() << " " << DVDCLI_MOUNT_CMD
-                   << " returned an empty mountpoint name";
-      } else {
-        mountpoint = strings::trim(retcode.get());
-        LOG(INFO) << em.dvdcli_path() << " " << DVDCLI_MOUNT_CMD
-                  << " returned mountpoint:" << mountpoint;
-      }
-#endif
+      continue;
     }
-  } else {
-    LOG(ERROR) << "Failed to acquire a command processor for unmount on "
-               << callerLabelForLogging;
+
+    // Limits on the root cgroup would throttle the whole agent.
+    if (cgroup == "/") {
+      return Error("pid " + stringify(pid) + " is in the root cgroup, " +
+                   "is the cgroups/blkio isolator enabled?");
+    }
+    return dir;
   }
-  return mountpoint;
-}
 
-bool DockerVolumeDriverIsolator::containsProhibitedChars(
-    const string& s) const
-{
-  return (string::npos != s.find_first_of(prohibitedchars, 0, NUM_PROHIBITED));
+  return Error("No io or blkio cgroup found for pid " + stringify(pid));
 }
 
-bool DockerVolumeDriverIsolator::parseEnvVar(
-  const Environment_Variable&  envvar,
-  const char*                  expectedName,
-  envvararray                  (&insertTarget),
-  bool                         limitCharset) const
+// Sets the read and write limits of the cgroup for device. A limit of 0
+// removes it.
+static Try<Nothing> writeIoLimit(
+    const string& cgroup,
+    const string& device,
+    uint64_t iops,
+    uint64_t bps)
 {
-  const size_t prefixLength = strlen(expectedName);
-  if (!strings::startsWith(envvar.name(), expectedName) ||
-      envvar.name().length() > (prefixLength+1) ) {
-    LOG(ERROR) << "Environment variable " << envvar.name()
-               << " rejected because it's name is invalid.";
-    return false;
-  }
-  if (limitCharset && containsProhibitedChars(envvar.value())) {
-    LOG(ERROR) << "Environment variable " << envvar.name()
-               << " rejected because it's value contains "
-               << "prohibited characters";
-    return false;
-  }
+  if (os::exists(path::join(cgroup, "io.max"))) {
+    const string riops = iops > 0 ? stringify(iops) : "max";
+    const string rbps = bps > 0 ? stringify(bps) : "max";
 
-  size_t index = 0;
-  if (envvar.name().length() == (prefixLength+1)) {
-    char digit = envvar.name().data()[prefixLength];
+    return os::write(path::join(cgroup, "io.max"),
+                     device + " riops=" + riops + " wiops=" + riops +
+                     " rbps=" + rbps + " wbps=" + rbps);
+  }
 
-    if (!isdigit(digit)) {
-      LOG(ERROR) << "Environment variable " << envvar.name()
-                 << " rejected because it doesn't end with a digit.";
-      return false;
+  const std::pair<string, uint64_t> limits[] = {
+    {"blkio.throttle.read_iops_device", iops},
+    {"blkio.throttle.write_iops_device", iops},
+    {"blkio.throttle.read_bps_device", bps},
+    {"blkio.throttle.write_bps_device", bps},
+  };
+
+  foreach (const auto& limit, limits) {
+    Try<Nothing> write = os::write(
+        path::join(cgroup, limit.first),
+        device + " " + stringify(limit.second));
+    if (write.isError()) {
+      return Error("Failed to write " + limit.first + ": " + write.error());
     }
-    index = std::atoi(envvar.name().substr(prefixLength).c_str());
   }
 
-  insertTarget[index] = envvar.value();
-  LOG(INFO) << envvar.name()  << "("
-            << envvar.value() << ") parsed from environment";
-  return true;
+  return Nothing();
 }
 
-Failure DockerVolumeDriverIsolator::revertMountlist(
-    const char*                                      operation,
-    const std::vector<process::Owned<ExternalMount>> mounts) const
+// Per-mount options a tuning profile may set.
+static Option<unsigned long> mountFlag(const string& option)
 {
-  // Once any mount attempt fails, give up on whole list
-  // and attempt to undo the mounts we already made.
-  LOG(ERROR) << operation << " failed during prepare()";
-
-  foreach (const process::Owned<ExternalMount> &unmountme, mounts) {
+  static const std::pair<const char*, unsigned long> flags[] = {
+    {"ro", MS_RDONLY},
+    {"nosuid", MS_NOSUID},
+    {"nodev", MS_NODEV},
+    {"noexec", MS_NOEXEC},
+    {"noatime", MS_NOATIME},
+    {"nodiratime", MS_NODIRATIME},
+    {"relatime", MS_RELATIME},
+    {"strictatime", MS_STRICTATIME},
+  };
+
+  foreach (const auto& flag, flags) {
+    if (option == flag.first) {
+      return flag.second;
+    }
+  }
+  return None();
+}
 
-    if (unmount(*unmountme, "prepare()-reverting mounts after failure")) {
-      LOG(ERROR) << "During prepare() of a container requesting multiple "
-                 << "mounts, a " << operation
-                 << " failure occurred after making "
-                 << "at least one mount and a second failure occurred "
-                 << "while attempting to remove the earlier mount(s)";
-      break;
+// Returns the per-mount flags set in a list of mount options.
+static unsigned long mountFlags(const string& options)
+{
+  unsigned long flags = 0;
+  foreach (const string& option, strings::tokenize(options, ",")) {
+    Option<unsigned long> flag = mountFlag(option);
+    if (flag.isSome()) {
+      flags |= flag.get();
     }
   }
+  return flags;
+}
 
-  return Failure(string("prepare() failed during ") + operation + " attempt");
+// Returns the filesystem options of a mount table entry as data to mount
+// the filesystem with again. Read only is passed as a flag instead.
+static string mountData(const fs::MountInfoTable::Entry& entry)
+{
+  std::vector<string> data;
+  foreach (const string& option, strings::tokenize(entry.fsOptions, ",")) {
+    if (option != "ro" && option != "rw") {
+      data.push_back(option);
+    }
+  }
+  return strings::join(",", data);
+}
+
+// Returns the flags to mount the filesystem of a mount table entry with
+// again, so that a new mount keeps the options of the old one.
+static unsigned long mountFlags(const fs::MountInfoTable::Entry& entry)
+{
+  return mountFlags(entry.vfsOptions) |
+    (mountFlags(entry.fsOptions) & MS_RDONLY);
+}
+
+// Makes the mount whose target is mountpoint read-only, or writable. The
+// mount above a directory that is not a mount target is never changed.
+// Returns false if there was nothing to change.
+static Try<bool> setReadOnly(const string& mountpoint, bool readOnly)
+{
+  Try<fs::MountInfoTable> table = fs::MountInfoTable::read();
+  if (table.isError()) {
+    return Error("Failed to read the host mount table: " + table.error());
+  }
+
+  Option<fs::MountInfoTable::Entry> target;
+  foreach (const fs::MountInfoTable::Entry& entry, table.get().entries) {
+    if (entry.target == mountpoint) {
+      target = entry;
+    }
+  }
+
+  if (target.isNone()) {
+    return false;
+  }
+
+  const unsigned long flags = mountFlags(target.get().vfsOptions);
+  if (((flags & MS_RDONLY) != 0) == readOnly) {
+    return false;
+  }
+
+  Try<Nothing> remounted = fs::mount(
+      None(),
+      mountpoint,
+      None(),
+      MS_REMOUNT | MS_BIND | (readOnly ? flags | MS_RDONLY
+                                       : flags & ~MS_RDONLY),
+      nullptr);
+  if (remounted.isError()) {
+    return Error(remounted.error());
+  }
+  return true;
+}
+
+// Returns the topmost mount holding mountpoint. The driver may return a
+// directory below the actual mount target.
+static Option<fs::MountInfoTable::Entry> mountEntry(
+    const fs::MountInfoTable& table,
+    const string& mountpoint)
+{
+  Option<fs::MountInfoTable::Entry> target;
+  foreach (const fs::MountInfoTable::Entry& entry, table.entries) {
+    if ((mountpoint == entry.target ||
+         strings::startsWith(mountpoint, entry.target + "/")) &&
+        (target.isNone() ||
+         entry.target.length() >= target.get().target.length())) {
+      target = entry;
+    }
+  }
+  return target;
+}
+
+// Changes the per-mount options of the mount holding mountpoint, keeping
+// its other per-mount options. The superblock is not touched.
+static Try<Nothing> remount(const string& mountpoint, const string& options)
+{
+  Try<fs::MountInfoTable> table = fs::MountInfoTable::read();
+  if (table.isError()) {
+    return Error("Failed to read the host mount table: " + table.error());
+  }
+
+  Option<fs::MountInfoTable::Entry> target =
+    mountEntry(table.get(), mountpoint);
+  if (target.isNone() || target.get().target == "/") {
+    return Error(mountpoint + " is not below a mount target");
+  }
+
+  unsigned long flags = mountFlags(target.get().vfsOptions);
+
+  unsigned long requested = 0;
+  foreach (const string& option, strings::tokenize(options, ",")) {
+    requested |= mountFlag(option).get();
+  }
+
+  // The atime options exclude each other.
+  const unsigned long atime = MS_NOATIME | MS_RELATIME | MS_STRICTATIME;
+  if ((requested & atime) != 0) {
+    flags &= ~atime;
+  }
+
+  return fs::mount(
+      None(),
+      target.get().target,
+      None(),
+      MS_REMOUNT | MS_BIND | flags | requested,
+      nullptr);
+}
+
+// sysfs lists the available schedulers with the active one in brackets.
+static string activeQueueAttribute(const string& value)
+{
+  size_t open = value.find('[');
+  size_t close = value.find(']', open);
+  if (open != string::npos && close != string::npos) {
+    return value.substr(open + 1, close - open - 1);
+  }
+  return strings::trim(value);
+}
+
+Try<DockerVolumeDriverIsolator::TuningProfile>
+DockerVolumeDriverIsolator::parseTuningProfile(const string& value)
+{
+  TuningProfile profile;
+
+  foreach (const string& attribute, strings::tokenize(value, ";")) {
+    size_t separator = attribute.find('=');
+    if (separator == string::npos) {
+      return Error("expected <attribute>=<value>, got " + attribute);
+    }
+
+    const string name = strings::trim(attribute.substr(0, separator));
+    const string setting = strings::trim(attribute.substr(separator + 1));
+
+    if (name == "read_ahead_kb" || name == "nr_requests") {
+      if (numify<uint64_t>(setting).isError()) {
+        return Error(name + " must be an integer");
+      }
+      if (name == "read_ahead_kb") {
+        profile.readAheadKb = setting;
+      } else {
+        profile.nrRequests = setting;
+      }
+    } else if (name == "scheduler") {
+      if (setting.empty() ||
+          setting.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789-_")
+            != string::npos) {
+        return Error("invalid scheduler " + setting);
+      }
+      profile.scheduler = setting;
+    } else if (name == "mount_options") {
+      foreach (const string& option, strings::tokenize(setting, ",")) {
+        if (mountFlag(option).isNone()) {
+          return Error("unsupported mount option " + option);
+        }
+      }
+      profile.mountOptions = setting;
+    } else {
+      return Error("unknown attribute " + name);
+    }
+  }
+
+  return profile;
+}
+
+Option<TunedDevice> DockerVolumeDriverIsolator::tune(
+    const ExternalMount& em,
+    const string&   mountpoint) const
+{
+  if (!tuningProfiles.contains(em.tuning())) {
+    LOG(ERROR) << "Unknown tuning profile " << em.tuning() << " for "
+               << em.volumedriver() << "/" << em.volumename();
+    return None();
+  }
+
+  const TuningProfile& profile = tuningProfiles.at(em.tuning());
+
+  if (profile.mountOptions.isSome()) {
+    Try<Nothing> remounted = remount(mountpoint, profile.mountOptions.get());
+    if (remounted.isError()) {
+      LOG(WARNING) << "Failed to remount " << mountpoint << " with "
+                   << profile.mountOptions.get() << ": " << remounted.error();
+    } else {
+      LOG(INFO) << "Remounted " << mountpoint << " with "
+                << profile.mountOptions.get();
+    }
+  }
+
+  if (profile.scheduler.isNone() &&
+      profile.nrRequests.isNone() &&
+      profile.readAheadKb.isNone()) {
+    return None();
+  }
+
+  // The scheduler resets nr_requests, so it is set first, and restored
+  // first, in the order saved below.
+  const std::pair<string, Option<string>> attributes[] = {
+    {"scheduler", profile.scheduler},
+    {"nr_requests", profile.nrRequests},
+    {"read_ahead_kb", profile.readAheadKb},
+  };
+
+  Try<string> device = blockDevice(mountpoint);
+  if (device.isError()) {
+    LOG(WARNING) << "Queue attributes of tuning profile " << em.tuning()
+                 << " are not applied to " << em.volumedriver() << "/"
+                 << em.volumename() << ": " << device.error();
+    return None();
+  }
+
+  TunedDevice tuned;
+  tuned.set_volumedriver(em.volumedriver());
+  tuned.set_volumename(em.volumename());
+  tuned.set_device(device.get());
+
+  const string queue = path::join("/sys/dev/block", device.get(), "queue");
+
+  foreach (const auto& attribute, attributes) {
+    if (attribute.second.isNone()) {
+      continue;
+    }
+
+    const string file = path::join(queue, attribute.first);
+
+    Try<string> original = os::read(file);
+    if (original.isError()) {
+      LOG(WARNING) << "Failed to read " << file << ": " << original.error();
+      continue;
+    }
+
+    Try<Nothing> write = os::write(file, attribute.second.get());
+    if (write.isError()) {
+      LOG(WARNING) << "Failed to set " << file << " to "
+                   << attribute.second.get() << ": " << write.error();
+      continue;
+    }
+
+    LOG(INFO) << "Set " << file << " to " << attribute.second.get()
+              << " for " << em.volumedriver() << "/" << em.volumename();
+
+    TunedDevice::QueueAttribute* saved = tuned.add_queue();
+    saved->set_name(attribute.first);
+    saved->set_value(activeQueueAttribute(original.get()));
+  }
+
+  if (tuned.queue_size() == 0) {
+    return None();
+  }
+  return tuned;
+}
+
+void DockerVolumeDriverIsolator::restoreTuning(const TunedDevice& tuned) const
+{
+  const string queue = path::join("/sys/dev/block", tuned.device(), "queue");
+
+  for (int i = 0; i < tuned.queue_size(); i++) {
+    const string file = path::join(queue, tuned.queue(i).name());
+
+    Try<Nothing> write = os::write(file, tuned.queue(i).value());
+    if (write.isError()) {
+      LOG(WARNING) << "Failed to restore " << file << " of "
+                   << tuned.volumedriver() << "/" << tuned.volumename()
+                   << " to " << tuned.queue(i).value() << ": "
+                   << write.error();
+    }
+  }
+}
+
+void DockerVolumeDriverIsolator::recordTuning(
+    const ExternalMount& em,
+    const TunedDevice& tuned)
+{
+  // A volume tuned again before it was detached, for instance because
+  // prepare() cancelled its detach, keeps its original attributes.
+  const ExternalMountID id = getExternalMountId(em);
+  if (!tunedDevices.contains(id) ||
+      tunedDevices.at(id).device() != tuned.device()) {
+    tunedDevices.put(id, tuned);
+  }
+}
+
+// Sets up a loop device over file, which is created with the given size
+// if it does not exist yet.
+static Try<string> attachLoopDevice(const string& file, const Bytes& size)
+{
+  if (!os::exists(file)) {
+    Try<Nothing> touch = os::touch(file);
+    if (touch.isError()) {
+      return Error("Failed to create " + file + ": " + touch.error());
+    }
+    if (::truncate(file.c_str(), size.bytes()) < 0) {
+      return ErrnoError("Failed to size " + file);
+    }
+  }
+
+  Try<string> device = runCommand("losetup -f --show " + file);
+  if (device.isError()) {
+    return Error(device.error());
+  }
+  return strings::trim(device.get());
+}
+
+// Reads one field of the dmsetup status or table line of a device.
+static Try<string> dmField(
+    const string& name,
+    const string& command,
+    size_t index)
+{
+  Try<string> line = runCommand("dmsetup " + command + " " + name);
+  if (line.isError()) {
+    return Error(line.error());
+  }
+
+  std::vector<string> fields = strings::tokenize(line.get(), " \n");
+  if (fields.size() <= index) {
+    return Error("Unexpected dmsetup " + command + " of " + name + ": " +
+                 line.get());
+  }
+  return fields[index];
+}
+
+Try<Nothing> DockerVolumeDriverIsolator::attachCache(
+    const ExternalMount& em,
+    const string&   mountpoint) const
+{
+  const string name = CACHE_DEVICE_PREFIX + stringify(getExternalMountId(em));
+  const string cached = path::join("/dev/mapper", name);
+
+  // dvdcli returns the mountpoint of a volume that is already mounted.
+  if (os::exists(cached)) {
+    return Nothing();
+  }
+
+  Try<fs::MountInfoTable> table = fs::MountInfoTable::read();
+  if (table.isError()) {
+    return Error("Failed to read the host mount table: " + table.error());
+  }
+
+  Option<fs::MountInfoTable::Entry> entry =
+    mountEntry(table.get(), mountpoint);
+  if (entry.isNone() || entry.get().root != "/" ||
+      !strings::startsWith(entry.get().source, "/dev/")) {
+    return Error(mountpoint + " is not a block device mount");
+  }
+
+  const string origin = entry.get().source;
+  const string target = entry.get().target;
+  const string type = entry.get().type;
+
+  // The cached filesystem is mounted with the options dvdcli used.
+  const unsigned long flags = mountFlags(entry.get());
+  const string options = mountData(entry.get());
+
+  Try<string> sectors = runCommand("blockdev --getsz " + origin);
+  if (sectors.isError()) {
+    return Error(sectors.error());
+  }
+
+  // dm-cache needs about 16 bytes of metadata per 256KiB cache block,
+  // plus room for its own structures.
+  const string dataFile = path::join(cachePool, name + ".data");
+  const string metaFile = path::join(cachePool, name + ".meta");
+  const Bytes metaSize = Megabytes(16) + Bytes(cacheSize.bytes() / 1024);
+
+  Try<string> meta = attachLoopDevice(metaFile, metaSize);
+  if (meta.isError()) {
+    return Error(meta.error());
+  }
+
+  Try<string> data = attachLoopDevice(dataFile, cacheSize);
+  if (data.isError()) {
+    runCommand("losetup -d " + meta.get());
+    return Error(data.error());
+  }
+
+  // A fresh cache starts from zeroed metadata.
+  runCommand("dd if=/dev/zero of=" + meta.get() + " bs=4k count=1");
+
+  Try<Nothing> unmount = fs::unmount(target);
+  if (unmount.isError()) {
+    runCommand("losetup -d " + data.get());
+    runCommand("losetup -d " + meta.get());
+    return Error("Failed to unmount " + target + ": " + unmount.error());
+  }
+
+  // <start> <length> cache <metadata> <cache> <origin> <block size>
+  // <#features> <features> <policy> <#policy args>
+  const string dmTable = "0 " + strings::trim(sectors.get()) + " cache " +
+    meta.get() + " " + data.get() + " " + origin +
+    " 512 1 writethrough default 0";
+
+  Try<string> created =
+    runCommand("dmsetup create " + name + " --table '" + dmTable + "'");
+
+  Try<Nothing> mounted = Error(created.isError() ? created.error() : "");
+  if (created.isSome()) {
+    mounted = fs::mount(cached, target, type, flags, options.c_str());
+  }
+
+  if (mounted.isError()) {
+    // Put the volume back the way dvdcli mounted it.
+    if (created.isSome()) {
+      runCommand("dmsetup remove " + name);
+    }
+    runCommand("losetup -d " + data.get());
+    runCommand("losetup -d " + meta.get());
+
+    Try<Nothing> restored =
+      fs::mount(origin, target, type, flags, options.c_str());
+    if (restored.isError()) {
+      LOG(ERROR) << "Failed to mount " << origin << " at " << target
+                 << " again: " << restored.error();
+    }
+    return Error("Failed to mount " + cached + ": " + mounted.error());
+  }
+
+  LOG(INFO) << "Mounted " << em.volumedriver() << "/" << em.volumename()
+            << " through cache " << cached << " at " << target;
+
+  return Nothing();
+}
+
+Try<Nothing> DockerVolumeDriverIsolator::detachCache(
+    const ExternalMount& em) const
+{
+  const string name = CACHE_DEVICE_PREFIX + stringify(getExternalMountId(em));
+  const string cached = path::join("/dev/mapper", name);
+
+  if (!os::exists(cached)) {
+    return Nothing();
+  }
+
+  // Device fields of the table are major:minor, the origin is field 5.
+  Try<string> origin = dmField(name, "table", 5);
+  Try<string> meta = dmField(name, "table", 3);
+  Try<string> data = dmField(name, "table", 4);
+  if (origin.isError() || meta.isError() || data.isError()) {
+    return Error("Failed to read the table of " + cached);
+  }
+
+  Try<fs::MountInfoTable> table = fs::MountInfoTable::read();
+  if (table.isError()) {
+    return Error("Failed to read the host mount table: " + table.error());
+  }
+
+  Option<fs::MountInfoTable::Entry> mounted;
+  foreach (const fs::MountInfoTable::Entry& entry, table.get().entries) {
+    if (entry.source == cached) {
+      mounted = entry;
+    }
+  }
+
+  // Unmounting flushes the filesystem into the cache, which writes it
+  // through to the origin.
+  if (mounted.isSome()) {
+    Try<Nothing> unmount = fs::unmount(mounted.get().target);
+    if (unmount.isError()) {
+      return Error("Failed to unmount " + mounted.get().target + ": " +
+                   unmount.error());
+    }
+  }
+
+  // A writethrough cache has no dirty blocks, but refuse to drop any.
+  Try<string> dirty = dmField(name, "status", 13);
+  if (dirty.isError() || dirty.get() != "0") {
+    return Error(cached + " still has dirty blocks");
+  }
+
+  Try<string> removed = runCommand("dmsetup remove " + name);
+  if (removed.isError()) {
+    return Error(removed.error());
+  }
+
+  runCommand("losetup -d /dev/block/" + data.get());
+  runCommand("losetup -d /dev/block/" + meta.get());
+  os::rm(path::join(cachePool, name + ".data"));
+  os::rm(path::join(cachePool, name + ".meta"));
+
+  // The origin is mounted back with the options of the cached mount,
+  // which are the ones dvdcli used.
+  if (mounted.isSome()) {
+    const string target = mounted.get().target;
+    const string data = mountData(mounted.get());
+    Try<Nothing> restored = fs::mount(
+        path::join("/dev/block", origin.get()),
+        target,
+        mounted.get().type,
+        mountFlags(mounted.get()),
+        data.c_str());
+    if (restored.isError()) {
+      return Error("Failed to mount the origin of " + cached + " at " +
+                   target + ": " + restored.error());
+    }
+  }
+
+  LOG(INFO) << "Removed cache " << cached << " of " << em.volumedriver()
+            << "/" << em.volumename();
+
+  return Nothing();
+}
+
+bool DockerVolumeDriverIsolator::applyIoLimits(const ContainerID& containerId)
+{
+  if (!pids.contains(containerId) || !infos.contains(containerId)) {
+    return true;
+  }
+
+  const Resources resources = allocated.contains(containerId)
+    ? allocated.at(containerId) : Resources();
+  const uint64_t defaultIops = scalarResource(resources, IOPS_RESOURCE_NAME);
+  const uint64_t defaultBps = scalarResource(resources, BPS_RESOURCE_NAME);
+
+  // Volumes on the same disk share one rule. Their limits add up, and
+  // an unlimited volume lifts the limit of the disk.
+  using IoLimit = std::pair<uint64_t, uint64_t>; // iops, bytes/s
+  hashmap<string, IoLimit> limits;
+  bool limited = false;
+
+  foreach (const process::Owned<ExternalMount> &mount,
+           infos.get(containerId)) {
+    const uint64_t iops = mount->iops() > 0 ? mount->iops() : defaultIops;
+    const uint64_t bps = mount->bps() > 0 ? mount->bps() : defaultBps;
+
+    const string& device = mount->device();
+    if (device.empty()) {
+      if (iops > 0 || bps > 0) {
+        LOG(WARNING) << "I/O limits of " << mount->volumedriver() << "/"
+                     << mount->volumename() << " are not enforced: "
+                     << "no block device was found for "
+                     << mount->mountpoint();
+      }
+      continue;
+    }
+
+    if (!limits.contains(device)) {
+      limits.put(device, std::make_pair(iops, bps));
+    } else {
+      IoLimit& limit = limits.at(device);
+      limit.first = (limit.first == 0 || iops == 0) ? 0 : limit.first + iops;
+      limit.second = (limit.second == 0 || bps == 0) ? 0 : limit.second + bps;
+    }
+
+    limited = limited || iops > 0 || bps > 0;
+  }
+
+  if (!limited && !throttled.contains(containerId)) {
+    return true;
+  }
+
+  Try<string> cgroup = ioCgroup(pids.at(containerId));
+  if (cgroup.isError()) {
+    LOG(ERROR) << "Failed to apply I/O limits to container " << containerId
+               << ": " << cgroup.error();
+    return false;
+  }
+
+  foreachpair (const string& device, const IoLimit& limit, limits) {
+    LOG(INFO) << "Limiting I/O of container " << containerId << " to device "
+              << device << " to " << limit.first << " iops and "
+              << limit.second << " bytes/s (0 is unlimited)";
+
+    Try<Nothing> write =
+      writeIoLimit(cgroup.get(), device, limit.first, limit.second);
+    if (write.isError()) {
+      LOG(ERROR) << "Failed to apply I/O limits to container " << containerId
+                 << " in " << cgroup.get() << ": " << write.error();
+      return false;
+    }
+  }
+
+  throttled.insert(containerId);
+  return true;
+}
+
+void DockerVolumeDriverIsolator::checkpointInfos()
+{
+  // Create ExternalMountList protobuf message to checkpoint
+  ExternalMountList inUseMountsProtobuf;
+  foreachvalue( const process::Owned<ExternalMount> &mount, infos) {
+    ExternalMount* mountptr = inUseMountsProtobuf.add_mount();
+    mountptr->CopyFrom(*(mount.get()));
+  }
+  foreachvalue( const process::Owned<ExternalMount> &mount, detaching) {
+    inUseMountsProtobuf.add_detaching()->CopyFrom(*(mount.get()));
+  }
+  foreachvalue( const TunedDevice &tuned, tunedDevices) {
+    inUseMountsProtobuf.add_tuned()->CopyFrom(tuned);
+  }
+  inUseMountsProtobuf.set_draining(draining);
+  foreachvalue( const process::Owned<ExternalMount> &mount, claimed) {
+    inUseMountsProtobuf.add_claimed()->CopyFrom(*(mount.get()));
+  }
+
+  Try<Nothing> checkpointed =
+    writeMountList(mountPbFilename, inUseMountsProtobuf);
+  if (checkpointed.isError()) {
+    LOG(ERROR) << "Failed to checkpoint mounts to " << mountPbFilename
+               << ": " << checkpointed.error();
+  }
+
+  updateInventory();
+}
+
+void DockerVolumeDriverIsolator::updateInventory()
+{
+  inventoryGeneration++;
+
+  if (!inventoryFile.empty()) {
+    // Written aside and renamed, so readers never see a partial file.
+    const string temporary = inventoryFile + ".tmp";
+    Try<Nothing> write = os::write(temporary, stringify(volumesJson()));
+    if (write.isSome()) {
+      write = os::rename(temporary, inventoryFile);
+    }
+    if (write.isError()) {
+      LOG(ERROR) << "Failed to write the volume inventory to "
+                 << inventoryFile << ": " << write.error();
+    }
+  }
+}
+
+void DockerVolumeDriverIsolator::trace(
+    const string& event,
+    JSON::Object fields)
+{
+  if (traceFile.empty()) {
+    return;
+  }
+
+  fields.values["ts"] = JSON::Number(Clock::now().secs());
+  fields.values["event"] = JSON::String(event);
+
+  std::lock_guard<std::mutex> lock(traceMutex);
+
+  // Appended to, so a restarted agent continues the same trace.
+  if (!traceStream.is_open()) {
+    traceStream.open(traceFile, std::ios::out | std::ios::app);
+  }
+
+  traceStream << stringify(fields) << std::endl;
+
+  if (!traceStream) {
+    LOG(WARNING) << "Failed to append to the trace file " << traceFile;
+    traceStream.close();
+    traceStream.clear();
+  }
+}
+
+JSON::Object DockerVolumeDriverIsolator::volumesJson() const
+{
+  // Volumes held by several containers are listed once.
+  hashmap<ExternalMountID, process::Owned<ExternalMount>> volumes;
+  hashset<ExternalMountID> mounted;
+  foreachvalue (const process::Owned<ExternalMount>& mount, infos) {
+    volumes.put(getExternalMountId(*mount), mount);
+    mounted.insert(getExternalMountId(*mount));
+  }
+  foreachvalue (const process::Owned<ExternalMount>& mount, pending) {
+    if (!volumes.contains(getExternalMountId(*mount))) {
+      volumes.put(getExternalMountId(*mount), mount);
+    }
+  }
+  foreachpair (const ExternalMountID& id,
+               const process::Owned<ExternalMount>& mount,
+               detaching) {
+    volumes.put(id, mount);
+  }
+
+  JSON::Array array;
+  foreachpair (const ExternalMountID& id,
+               const process::Owned<ExternalMount>& mount,
+               volumes) {
+    JSON::Object volume;
+    volume.values["driver"] = JSON::String(mount->volumedriver());
+    volume.values["name"] = JSON::String(mount->volumename());
+    volume.values["refcount"] = JSON::Number(holders(*mount));
+
+    // A released volume is warm until its unmount starts: a container
+    // asking for it again gets it without an attach.
+    if (detaching.contains(id)) {
+      volume.values["state"] =
+        JSON::String(unmounting.contains(id) ? "detaching" : "warm");
+    } else {
+      volume.values["state"] =
+        JSON::String(mounted.contains(id) ? "mounted" : "mounting");
+    }
+
+    if (lastUsed.contains(id)) {
+      volume.values["last_used"] = JSON::Number(lastUsed.at(id).secs());
+    }
+
+    if (mount->adopted()) {
+      volume.values["adopted"] = JSON::Boolean(true);
+    }
+
+    array.values.push_back(volume);
+  }
+
+  JSON::Object object;
+  object.values["generation"] = JSON::Number(inventoryGeneration);
+  object.values["volumes"] = array;
+  return object;
+}
+
+JSON::Object DockerVolumeDriverIsolator::drain()
+{
+  if (!draining) {
+    LOG(INFO) << "Draining the agent's volumes";
+    draining = true;
+    checkpointInfos();
+  }
+
+  // Warm volumes, orphans, and those whose unmount failed, are detached
+  // now rather than at the next retry. The detaches run on the shards,
+  // so at most volume_shards of them run at a time.
+  detachOrphans();
+  retryDetaches();
+
+  // Hands leaked mounts over to the detaches as well.
+  reconcile();
+
+  return drainStatus();
+}
+
+JSON::Object DockerVolumeDriverIsolator::resume()
+{
+  if (draining) {
+    LOG(INFO) << "Ending the drain of the agent's volumes";
+    draining = false;
+    checkpointInfos();
+  }
+
+  return drainStatus();
+}
+
+JSON::Object DockerVolumeDriverIsolator::drainStatus()
+{
+  hashset<ExternalMountID> held;
+  foreachvalue (const process::Owned<ExternalMount>& mount, infos) {
+    held.insert(getExternalMountId(*mount));
+  }
+  foreachvalue (const process::Owned<ExternalMount>& mount, pending) {
+    held.insert(getExternalMountId(*mount));
+  }
+
+  size_t retrying = 0;
+  foreachkey (const ExternalMountID& id, detaching) {
+    if (!unmounting.contains(id)) {
+      retrying++;
+    }
+  }
+
+  const size_t attached = attachedVolumes().size();
+
+  JSON::Object object;
+  object.values["draining"] = JSON::Boolean(draining);
+  object.values["attached"] = JSON::Number(attached);
+  object.values["held"] = JSON::Number(held.size());
+  object.values["detaching"] = JSON::Number(detaching.size() - retrying);
+  object.values["retrying"] = JSON::Number(retrying);
+  object.values["leaked"] = JSON::Number(unreferencedSince.size());
+  object.values["drained"] = JSON::Boolean(draining && attached == 0);
+  return object;
+}
+
+JSON::Object DockerVolumeDriverIsolator::inventory(
+    const Option<string>& since)
+{
+  if (since.isSome() && since.get() == stringify(inventoryGeneration)) {
+    JSON::Object object;
+    object.values["generation"] = JSON::Number(inventoryGeneration);
+    return object;
+  }
+
+  return volumesJson();
+}
+
+// Returns true if mountpoint, or one of its parents, is a mount target.
+// The driver may return a directory below the actual mount target.
+static bool isHostMounted(
+    const hashset<string>& hostMountpoints,
+    const string& mountpoint)
+{
+  for (string dir = mountpoint; dir.length() > 1; dir = Path(dir).dirname()) {
+    if (hostMountpoints.contains(dir)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t DockerVolumeDriverIsolator::checkInvariants(
+    const string& callerLabelForLogging)
+{
+  if (!verifyInvariants) {
+    return 0;
+  }
+
+  size_t violations = 0;
+
+  // Every user of a volume must agree on its mountpoint, and a container
+  // may hold a volume only once or cleanup() would never see it as the
+  // last user.
+  hashmap<ExternalMountID, string> mountpoints;
+  hashset<string> holders;
+  foreachpair (const ContainerID& containerId,
+               const process::Owned<ExternalMount>& mount,
+               infos) {
+    ExternalMountID id = getExternalMountId(*mount);
+
+    if (mount->mountpoint().empty()) {
+      LOG(ERROR) << "Invariant violated after " << callerLabelForLogging
+                 << ": " << mount->volumedriver() << "/"
+                 << mount->volumename() << " held by " << containerId
+                 << " has no mountpoint";
+      violations++;
+    } else if (!mountpoints.contains(id)) {
+      mountpoints.put(id, mount->mountpoint());
+    } else if (mountpoints.at(id) != mount->mountpoint()) {
+      LOG(ERROR) << "Invariant violated after " << callerLabelForLogging
+                 << ": " << mount->volumedriver() << "/"
+                 << mount->volumename() << " is recorded at both "
+                 << mountpoints.at(id) << " and " << mount->mountpoint();
+      violations++;
+    }
+
+    const string holder = stringify(containerId) + "/" + stringify(id);
+    if (holders.contains(holder)) {
+      LOG(ERROR) << "Invariant violated after " << callerLabelForLogging
+                 << ": container " << containerId << " holds "
+                 << mount->volumedriver() << "/" << mount->volumename()
+                 << " more than once";
+      violations++;
+    }
+    holders.insert(holder);
+
+    if (detaching.contains(id)) {
+      LOG(ERROR) << "Invariant violated after " << callerLabelForLogging
+                 << ": " << mount->volumedriver() << "/"
+                 << mount->volumename() << " is held by " << containerId
+                 << " while it is being detached";
+      violations++;
+    }
+  }
+
+  // The checkpoint must hold exactly what infos holds.
+  Result<ExternalMountList> read = readMountList(mountPbFilename);
+  if (!read.isSome()) {
+    LOG(ERROR) << "Invariant violated after " << callerLabelForLogging
+               << ": " << mountPbFilename << " cannot be parsed";
+    violations++;
+  } else {
+    const ExternalMountList& mountlist = read.get();
+    hashset<string> checkpointed;
+    for (int i = 0; i < mountlist.mount_size(); i++) {
+      checkpointed.insert(mountlist.mount(i).containerid() + "/" +
+                          stringify(getExternalMountId(mountlist.mount(i))));
+    }
+
+    if (checkpointed.size() != holders.size() ||
+        static_cast<size_t>(mountlist.mount_size()) != infos.size()) {
+      LOG(ERROR) << "Invariant violated after " << callerLabelForLogging
+                 << ": checkpoint holds " << mountlist.mount_size()
+                 << " mounts but infos holds " << infos.size();
+      violations++;
+    } else if (static_cast<size_t>(mountlist.detaching_size()) !=
+               detaching.size()) {
+      LOG(ERROR) << "Invariant violated after " << callerLabelForLogging
+                 << ": checkpoint holds " << mountlist.detaching_size()
+                 << " detaching mounts but " << detaching.size()
+                 << " are detaching";
+      violations++;
+    } else {
+      foreach (const string& holder, holders) {
+        if (!checkpointed.contains(holder)) {
+          LOG(ERROR) << "Invariant violated after " << callerLabelForLogging
+                     << ": mount " << holder << " is missing from "
+                     << mountPbFilename;
+          violations++;
+        }
+      }
+    }
+  }
+
+  // Every volume held by a container must still be mounted on the host.
+  Try<fs::MountInfoTable> table = fs::MountInfoTable::read();
+  if (table.isError()) {
+    LOG(WARNING) << "Failed to read the host mount table after "
+                 << callerLabelForLogging << ": " << table.error();
+  } else {
+    hashset<string> hostMountpoints;
+    foreach (const fs::MountInfoTable::Entry& entry, table.get().entries) {
+      hostMountpoints.insert(entry.target);
+    }
+
+    foreachvalue (const string& mountpoint, mountpoints) {
+      if (!isHostMounted(hostMountpoints, mountpoint)) {
+        LOG(ERROR) << "Invariant violated after " << callerLabelForLogging
+                   << ": " << mountpoint << " is held by a container but "
+                   << "is not mounted on the host";
+        violations++;
+      }
+    }
+  }
+
+  if (violations > 0) {
+    LOG(ERROR) << violations << " isolator invariant violation(s) found after "
+               << callerLabelForLogging;
+  }
+
+  return violations;
+}
+
+// Attempts to unmount specified external mount, returns true on success.
+// Also returns true so long as DVDCLI is successfully invoked,
+// even if a non-zero return code occurs.
+bool DockerVolumeDriverIsolator::unmount(
+    const ExternalMount& em,
+    const string&   callerLabelForLogging ) const
+{
+  LOG(INFO) << em.volumedriver() << "/" << em.volumename()
+            << " is being unmounted on "
+            << callerLabelForLogging;
+
+  if (em.volumedriver() == LOCAL_VOLUME_DRIVER) {
+    return unmountLocal(em);
+  }
+
+  if (!em.csi_endpoint().empty()) {
+    return unstageCsi(em);
+  }
+
+  if (!os::exists(em.dvdcli_path())) {
+    LOG(ERROR) << "The DVDCLI binary doesn't exist at the specified path "
+               << em.dvdcli_path();
+    return false;
+  }
+
+  Try<Nothing> unmounted = dvdcliUnmount(em);
+  if (unmounted.isError()) {
+    LOG(WARNING) << em.dvdcli_path() << " " << DVDCLI_UNMOUNT_CMD
+                 << " failed to execute on " << callerLabelForLogging
+                 << ", continuing on the assumption this volume was "
+                 << "manually unmounted previously "
+                 << unmounted.error();
+  }
+
+  return true;
+}
+
+// Attempts to mount specified external mount,
+// returns non-empty string (mountpoint) on success.
+string DockerVolumeDriverIsolator::mount(
+    const ExternalMount& em,
+    const string&   callerLabelForLogging) const
+{
+  LOG(INFO) << em.volumedriver() << "/" << em.volumename()
+            << " is being mounted on "
+            << callerLabelForLogging;
+
+  if (em.volumedriver() == LOCAL_VOLUME_DRIVER) {
+    return mountLocal(em);
+  }
+
+  if (!em.csi_endpoint().empty()) {
+    return stageCsi(em);
+  }
+
+  if (!os::exists(em.dvdcli_path())) {
+    LOG(ERROR) << "The DVDCLI binary doesn't exist at the specified path "
+               << em.dvdcli_path();
+    return string();
+  }
+
+  Try<string> mountpoint = dvdcliMount(em, snapshotVolumeOption);
+  if (mountpoint.isError()) {
+    LOG(ERROR) << em.dvdcli_path() << " " << DVDCLI_MOUNT_CMD
+               << " failed on " << callerLabelForLogging << ": "
+               << mountpoint.error();
+    return string();
+  }
+
+  LOG(INFO) << em.dvdcli_path() << " " << DVDCLI_MOUNT_CMD
+            << " returned mountpoint:" << mountpoint.get();
+  return mountpoint.get();
+}
+
+// Sets an XFS project on the subpath directory and limits it to the
+// requested quota. The project id is derived from volume and subpath so
+// that every container reusing the same subpath lands in the same project.
+// Project id 0 is the default project, avoid it.
+static uint32_t projectId(size_t seed)
+{
+  return (seed & 0x7fffffff) | 1;
+}
+
+bool DockerVolumeDriverIsolator::applySubpathQuota(
+    const ExternalMount& em,
+    const string&   subpathDir) const
+{
+  size_t seed = 0;
+  boost::hash_combine(seed, boost::to_lower_copy(em.volumedriver()));
+  boost::hash_combine(seed, boost::to_lower_copy(em.volumename()));
+  boost::hash_combine(seed, em.subpath());
+
+  return applyProjectQuota(
+      em.subpath_quota(), subpathDir, em.mountpoint(), projectId(seed));
+}
+
+bool DockerVolumeDriverIsolator::applyProjectQuota(
+    const string&   quotaSpec,
+    const string&   dir,
+    const string&   filesystem,
+    uint32_t        projectId) const
+{
+  Try<Bytes> quota = Bytes::parse(quotaSpec);
+  if (quota.isError()) {
+    LOG(ERROR) << "Invalid quota " << quotaSpec << " for " << dir
+               << ": " << quota.error();
+    return false;
+  }
+
+  LOG(INFO) << "Invoking " << XFS_QUOTA_BIN << " to limit " << dir
+            << " to " << quota.get() << " as project " << projectId;
+
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
+  std::ostringstream cmdOut;
+  Try<int> retcode = os::shell(&cmdOut,
+    "%s -x -c 'project -s -p %s %u' %s && "
+    "%s -x -c 'limit -p bhard=%llu %u' %s",
+    XFS_QUOTA_BIN, dir.c_str(), projectId, filesystem.c_str(),
+    XFS_QUOTA_BIN, (unsigned long long) quota.get().bytes(), projectId,
+    filesystem.c_str());
+
+  if (retcode.isSome() && retcode.get() != 0) {
+    retcode = Error("returned errorcode " + stringify(retcode.get()));
+  }
+#else
+  Try<string> retcode = os::shell(
+    "%s -x -c 'project -s -p %s %u' %s && "
+    "%s -x -c 'limit -p bhard=%llu %u' %s",
+    XFS_QUOTA_BIN, dir.c_str(), projectId, filesystem.c_str(),
+    XFS_QUOTA_BIN, (unsigned long long) quota.get().bytes(), projectId,
+    filesystem.c_str());
+#endif
+
+  if (retcode.isError()) {
+    LOG(ERROR) << XFS_QUOTA_BIN << " failed to set quota on " << dir
+               << ": " << retcode.error();
+    return false;
+  }
+
+  return true;
+}
+
+Try<string> DockerVolumeDriverIsolator::localPoolDir(const string& name)
+{
+  if (name.empty() || name == "." || name == ".." ||
+      name.find('/') != string::npos) {
+    return Error("'" + name + "' does not name a directory of the pool");
+  }
+
+  Result<string> pool = os::realpath(localPool);
+  if (!pool.isSome()) {
+    return Error("Failed to resolve the local pool " + localPool + ": " +
+                 (pool.isError() ? pool.error() : "does not exist"));
+  }
+
+  const string dir = path::join(pool.get(), name);
+
+  // Not created yet, the name itself is known to be a single component.
+  Result<string> resolved = os::realpath(dir);
+  if (resolved.isError()) {
+    return Error("Failed to resolve " + dir + ": " + resolved.error());
+  }
+  if (resolved.isSome() && Path(resolved.get()).dirname() != pool.get()) {
+    return Error(dir + " resolves to " + resolved.get() +
+                 ", which is not directly below the local pool");
+  }
+
+  return dir;
+}
+
+string DockerVolumeDriverIsolator::mountLocal(const ExternalMount& em) const
+{
+  Try<string> localDir = localPoolDir(em.volumename());
+  if (localDir.isError()) {
+    LOG(ERROR) << "Refusing to mount local volume " << em.volumename()
+               << ": " << localDir.error();
+    return string();
+  }
+
+  const string dir = localDir.get();
+
+  if (!os::exists(dir) && !em.from_snapshot().empty()) {
+    Try<string> snapshot = localPoolDir(em.from_snapshot());
+    if (snapshot.isError()) {
+      LOG(ERROR) << "Refusing to create local volume " << dir << " from "
+                 << "snapshot " << em.from_snapshot() << ": "
+                 << snapshot.error();
+      return string();
+    }
+
+    const string source = snapshot.get();
+    if (!os::exists(source)) {
+      LOG(ERROR) << "Snapshot " << source << " of local volume " << dir
+                 << " does not exist";
+      return string();
+    }
+
+    // Copy into a temporary directory first, so that a failed copy is
+    // not mistaken for a created volume by a retry.
+    const string copy = dir + ".partial";
+    os::rmdir(copy);
+    Try<string> cp = runCommand("cp -a " + source + " " + copy);
+    if (cp.isError()) {
+      LOG(ERROR) << "Failed to create local volume " << dir << " from "
+                 << source << ": " << cp.error();
+      os::rmdir(copy);
+      return string();
+    }
+
+    Try<Nothing> rename = os::rename(copy, dir);
+    if (rename.isError()) {
+      LOG(ERROR) << "Failed to create local volume " << dir << " from "
+                 << source << ": " << rename.error();
+      return string();
+    }
+  }
+
+  if (!os::exists(dir)) {
+    Try<Nothing> mkdir = os::mkdir(dir);
+    if (mkdir.isError()) {
+      LOG(ERROR) << "Failed to create local volume " << dir
+                 << " mkdir returned " << mkdir.error();
+      return string();
+    }
+  }
+
+  foreach (const string& option, strings::tokenize(em.options(), ",")) {
+    if (!strings::startsWith(option, "size=")) {
+      continue;
+    }
+
+    // xfs_quota wants the mount target of the filesystem.
+    Try<fs::MountInfoTable> table = fs::MountInfoTable::read();
+    Option<fs::MountInfoTable::Entry> entry = table.isSome()
+      ? mountEntry(table.get(), dir) : None();
+    if (entry.isNone()) {
+      LOG(ERROR) << "Failed to find the filesystem of local volume " << dir;
+      return string();
+    }
+
+    size_t seed = 0;
+    boost::hash_combine(seed, string(LOCAL_VOLUME_DRIVER));
+    boost::hash_combine(seed, boost::to_lower_copy(em.volumename()));
+
+    if (!applyProjectQuota(option.substr(strlen("size=")),
+                           dir,
+                           entry.get().target,
+                           projectId(seed))) {
+      return string();
+    }
+  }
+
+  LOG(INFO) << "Local volume " << em.volumename() << " is at " << dir;
+
+  return dir;
+}
+
+bool DockerVolumeDriverIsolator::unmountLocal(const ExternalMount& em) const
+{
+  Try<string> localDir = localPoolDir(em.volumename());
+  if (localDir.isError()) {
+    // Retrying cannot help, the volume is forgotten instead.
+    LOG(ERROR) << "Refusing to remove local volume " << em.volumename()
+               << ": " << localDir.error();
+    return true;
+  }
+
+  const string dir = localDir.get();
+
+  if (!os::exists(dir)) {
+    return true;
+  }
+
+  Try<Nothing> rmdir = os::rmdir(dir);
+  if (rmdir.isError()) {
+    LOG(ERROR) << "Failed to remove local volume " << dir
+               << ": " << rmdir.error();
+    return false;
+  }
+
+  LOG(INFO) << "Local volume " << em.volumename() << " is removed";
+
+  return true;
+}
+
+// Returns an error unless the CSI endpoint of em is a Unix socket.
+static Try<Nothing> checkCsiEndpoint(const ExternalMount& em)
+{
+  struct stat stat;
+  if (::stat(em.csi_endpoint().c_str(), &stat) < 0) {
+    return ErrnoError("CSI endpoint " + em.csi_endpoint() + " is unusable");
+  }
+  if (!S_ISSOCK(stat.st_mode)) {
+    return Error("CSI endpoint " + em.csi_endpoint() + " is not a socket");
+  }
+  return Nothing();
+}
+
+// Returns the csc command line that sends the node RPC verb to the CSI
+// plugin of em, with the options shared by all of them. The endpoint is
+// also checked by parseVolumeSpecs(), this catches checkpointed ones.
+static Try<string> csiCommand(
+    const string& csc,
+    const string& verb,
+    const ExternalMount& em)
+{
+  if (containsShellChars(em.csi_endpoint())) {
+    return Error("CSI endpoint " + em.csi_endpoint() +
+                 " contains shell characters");
+  }
+
+  Try<Nothing> endpoint = checkCsiEndpoint(em);
+  if (endpoint.isError()) {
+    return Error(endpoint.error());
+  }
+
+  return csc + " node " + verb + " --endpoint unix://" + em.csi_endpoint();
+}
+
+// Names the plugin of a CSI volume in its paths, so plugins exposing the
+// same volume name do not share them. FNV-1a, as the paths have to stay
+// the same across builds of the agent.
+static string csiPluginKey(const ExternalMount& em)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  foreach (char c, em.csi_endpoint()) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ULL;
+  }
+
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", (unsigned long long) hash);
+  return key;
+}
+
+string DockerVolumeDriverIsolator::csiStagingPath(const ExternalMount& em)
+{
+  return path::join(stateDir, DVDI_CSI_DIRNAME, "staging",
+                    csiPluginKey(em), em.volumename());
+}
+
+string DockerVolumeDriverIsolator::csiTargetPath(const ExternalMount& em)
+{
+  return path::join(stateDir, DVDI_CSI_DIRNAME, "publish",
+                    em.containerid(), csiPluginKey(em), em.volumename());
+}
+
+string DockerVolumeDriverIsolator::stageCsi(const ExternalMount& em) const
+{
+  // The CO creates the staging path, the plugin mounts the volume there.
+  const string staging = csiStagingPath(em);
+  Try<Nothing> mkdir = os::mkdir(staging);
+  if (mkdir.isError()) {
+    LOG(ERROR) << "Failed to create " << staging << ": " << mkdir.error();
+    return string();
+  }
+
+  Try<string> command = csiCommand(cscPath, "stage", em);
+  if (command.isError()) {
+    LOG(ERROR) << "Failed to stage CSI volume " << em.volumename()
+               << ": " << command.error();
+    return string();
+  }
+
+  Try<string> stage = runCommand(
+      command.get() +
+      " --staging-target-path " + staging +
+      " --cap " + CSI_ACCESS_MODE + ",mount," + csiFsType +
+      " " + em.volumename());
+  if (stage.isError()) {
+    LOG(ERROR) << "Failed to stage CSI volume " << em.volumename()
+               << ": " << stage.error();
+    return string();
+  }
+
+  LOG(INFO) << "CSI volume " << em.volumename() << " is staged at " << staging;
+
+  return staging;
+}
+
+bool DockerVolumeDriverIsolator::unstageCsi(const ExternalMount& em) const
+{
+  // Targets left behind by containers that were destroyed while the
+  // agent was down would keep the volume busy.
+  const string publish =
+    path::join(stateDir, DVDI_CSI_DIRNAME, "publish");
+  if (os::exists(publish)) {
+    Try<list<string>> containers = os::ls(publish);
+    if (containers.isSome()) {
+      foreach (const string& container, containers.get()) {
+        ExternalMount target(em);
+        target.set_containerid(container);
+        if (os::exists(csiTargetPath(target)) && !unpublishCsi(target)) {
+          return false;
+        }
+      }
+    }
+  }
+
+  const string staging = csiStagingPath(em);
+  Try<string> command = csiCommand(cscPath, "unstage", em);
+  if (command.isError()) {
+    LOG(ERROR) << "Failed to unstage CSI volume " << em.volumename()
+               << ": " << command.error();
+    return false;
+  }
+
+  Try<string> unstage = runCommand(
+      command.get() +
+      " --staging-target-path " + staging +
+      " " + em.volumename());
+  if (unstage.isError()) {
+    LOG(ERROR) << "Failed to unstage CSI volume " << em.volumename()
+               << ": " << unstage.error();
+    return false;
+  }
+
+  // Not recursive, in case the plugin left the volume mounted there.
+  ::rmdir(staging.c_str());
+  ::rmdir(Path(staging).dirname().c_str());
+
+  LOG(INFO) << "CSI volume " << em.volumename() << " is unstaged";
+
+  return true;
+}
+
+Try<Nothing> DockerVolumeDriverIsolator::publishCsi(
+    const ExternalMount& em) const
+{
+  // The plugin creates the target path itself, below an existing parent.
+  const string target = csiTargetPath(em);
+  Try<Nothing> mkdir = os::mkdir(Path(target).dirname());
+  if (mkdir.isError()) {
+    return Error("Failed to create the parent of " + target + ": " +
+                 mkdir.error());
+  }
+
+  Try<string> command = csiCommand(cscPath, "publish", em);
+  if (command.isError()) {
+    return Error(command.error());
+  }
+
+  Try<string> publish = runCommand(
+      command.get() +
+      " --staging-target-path " + em.mountpoint() +
+      " --target-path " + target +
+      " --cap " + CSI_ACCESS_MODE + ",mount," + csiFsType +
+      " " + em.volumename());
+  if (publish.isError()) {
+    return Error(publish.error());
+  }
+
+  return Nothing();
+}
+
+bool DockerVolumeDriverIsolator::unpublishCsi(const ExternalMount& em) const
+{
+  const string target = csiTargetPath(em);
+
+  // Never published, e.g. prepare() failed before the bind mounts.
+  if (!os::exists(target)) {
+    return true;
+  }
+
+  Try<string> command = csiCommand(cscPath, "unpublish", em);
+  if (command.isError()) {
+    LOG(ERROR) << "Failed to unpublish CSI volume " << em.volumename()
+               << " from " << target << ": " << command.error();
+    return false;
+  }
+
+  Try<string> unpublish = runCommand(
+      command.get() +
+      " --target-path " + target +
+      " " + em.volumename());
+  if (unpublish.isError()) {
+    LOG(ERROR) << "Failed to unpublish CSI volume " << em.volumename()
+               << " from " << target << ": " << unpublish.error();
+    return false;
+  }
+
+  // The plugin's and the container's directories go once their last
+  // target is gone.
+  if (os::exists(target)) {
+    ::rmdir(target.c_str());
+  }
+  const string plugin = Path(target).dirname();
+  ::rmdir(plugin.c_str());
+  ::rmdir(Path(plugin).dirname().c_str());
+
+  return true;
+}
+
+void DockerVolumeDriverIsolator::unpublish(const ExternalMount& em)
+{
+  if (em.csi_endpoint().empty() || em.container_path().empty()) {
+    return;
+  }
+
+  dispatch(shard(em), &DockerVolumeDriverShard::unpublish, em);
+}
+
+void DockerVolumeDriverIsolator::discardOverlay(const ExternalMount& em)
+{
+  if (!em.overlay() || em.overlay_dir().empty()) {
+    return;
+  }
+
+  const string dir = em.overlay_dir();
+  fsWorkers[overlayWorker(em)]->post([=]() {
+    if (!os::exists(dir)) {
+      return;
+    }
+
+    Try<Nothing> rmdir = os::rmdir(dir);
+    if (rmdir.isError()) {
+      LOG(WARNING) << "Failed to discard overlay " << dir << ": "
+                   << rmdir.error();
+      return;
+    }
+
+    LOG(INFO) << "Discarded overlay " << dir;
+  });
+}
+
+Failure DockerVolumeDriverIsolator::revertMountlist(
+    const char*                                      operation,
+    const ContainerID&                               containerId)
+{
+  // Once any mount attempt fails, give up on whole list
+  // and attempt to undo the mounts we already made.
+  LOG(ERROR) << operation << " failed during prepare()";
+
+  list<process::Owned<ExternalMount>> mounts = pending.get(containerId);
+  pending.remove(containerId);
+  allocated.erase(containerId);
+
+  // Only volumes that were mounted and that no other container holds,
+  // or is about to hold, are unmounted.
+  foreach (const process::Owned<ExternalMount> &unmountme, mounts) {
+    if (!unmountme->mountpoint().empty()) {
+      unpublish(*unmountme);
+    }
+    discardOverlay(*unmountme);
+
+    if (unmountme->mountpoint().empty() ||
+        holders(*unmountme) > 0 ||
+        mounting.contains(getExternalMountId(*unmountme))) {
+      continue;
+    }
+
+    release(*unmountme, "prepare()-reverting mounts after failure");
+  }
+
+  checkpointInfos();
+  checkInvariants("prepare()-reverting mounts after failure");
+
+  return Failure(string("prepare() failed during ") + operation + " attempt");
+}
+
+void DockerVolumeDriverIsolator::release(
+    const ExternalMount& em,
+    const string&   callerLabelForLogging)
+{
+  LOG(INFO) << em.volumedriver() << "/" << em.volumename()
+            << " is no longer held by any container, detaching it";
+
+  detaching.put(getExternalMountId(em),
+                process::Owned<ExternalMount>(new ExternalMount(em)));
+
+  detach(em, callerLabelForLogging);
+}
+
+void DockerVolumeDriverIsolator::detach(
+    const ExternalMount& em,
+    const string&   callerLabelForLogging)
+{
+  const ExternalMountID id = getExternalMountId(em);
+  const string volume = em.volumedriver() + "/" + em.volumename();
+
+  Future<Nothing> unmounted = dispatch(
+      shard(em),
+      &DockerVolumeDriverShard::unmount,
+      em,
+      callerLabelForLogging,
+      tunedDevices.get(id));
+
+  unmounting.put(id, unmounted);
+
+  // The volume went from warm to detaching.
+  updateInventory();
+
+  unmounted.onAny(defer(self(), [=](const Future<Nothing>& future) {
+    if (unmounting.contains(id) && unmounting.at(id) == future) {
+      unmounting.erase(id);
+    }
+
+    // prepare() cancelled the detach while the unmount was running.
+    if (!detaching.contains(id)) {
+      return;
+    }
+
+    if (!future.isReady()) {
+      LOG(WARNING) << "Failed to detach " << volume << ", retrying in "
+                   << detachRetryInterval << ": "
+                   << (future.isFailed() ? future.failure() : "discarded");
+      return;
+    }
+
+    // A later release() queued another unmount behind this one.
+    if (unmounting.contains(id)) {
+      return;
+    }
+
+    LOG(INFO) << volume << " is detached";
+    detaching.erase(id);
+    tunedDevices.erase(id);
+    lastUsed.erase(id);
+    claimed.erase(id);
+
+    checkpointInfos();
+    checkInvariants(callerLabelForLogging);
+  }));
+}
+
+void DockerVolumeDriverIsolator::retryDetaches()
+{
+  // The ids are collected before any detach is started, as detach()
+  // records the volume in unmounting.
+  std::vector<ExternalMountID> ids;
+  foreachkey (const ExternalMountID& id, detaching) {
+    ids.push_back(id);
+  }
+
+  foreach (const ExternalMountID& id, ids) {
+    if (detaching.contains(id) && !unmounting.contains(id) &&
+        !orphaned.contains(id)) {
+      const ExternalMount em = *detaching.at(id);
+      detach(em, "retryDetaches()");
+    }
+  }
+}
+
+void DockerVolumeDriverIsolator::detachOrphans()
+{
+  // Iterated over a copy, as in retryDetaches().
+  std::vector<ExternalMountID> ids(orphaned.begin(), orphaned.end());
+  orphaned.clear();
+
+  // Orphans reclaimed by prepare() have left detaching.
+  foreach (const ExternalMountID& id, ids) {
+    if (detaching.contains(id) && !unmounting.contains(id)) {
+      const ExternalMount em = *detaching.at(id);
+      detach(em, "recover()-orphan");
+    }
+  }
+}
+
+void DockerVolumeDriverIsolator::probeDrivers()
+{
+  foreach (const string& driver, probeDriverNames) {
+    if (driver == LOCAL_VOLUME_DRIVER) {
+      continue;
+    }
+
+    const string dvdcli = probeDvdclis.contains(driver)
+      ? probeDvdclis.at(driver) : DEFAULT_DVDCLI_BIN;
+
+    // A driver that hangs is as unusable as one that fails.
+    Try<string> probe = runCommand(
+        "timeout " + stringify(probeTimeout.secs()) + " " +
+        dvdcli + " " + DVDCLI_PATH_CMD + " " +
+        VOL_DRIVER_CMD_OPTION + driver + " " +
+        VOL_NAME_CMD_OPTION + probeVolume);
+
+    dispatch(PID<DockerVolumeDriverIsolator>(this),
+             &DockerVolumeDriverIsolator::recordProbe,
+             driver,
+             probe.isError() ? Option<string>(probe.error()) : None());
+  }
+}
+
+void DockerVolumeDriverIsolator::recordProbe(
+    const string& driver,
+    const Option<string>& failure)
+{
+  if (failure.isSome()) {
+    if (!unhealthyDrivers.contains(driver)) {
+      LOG(WARNING) << "Volume driver " << driver
+                   << " failed its probe, volumes using it cannot be "
+                   << "mounted until it recovers: " << failure.get();
+    }
+    unhealthyDrivers.put(driver, failure.get());
+  } else if (unhealthyDrivers.contains(driver)) {
+    LOG(INFO) << "Volume driver " << driver << " is healthy again";
+    unhealthyDrivers.erase(driver);
+  }
+}
+
+void DockerVolumeDriverIsolator::refreshCatalogs()
+{
+  foreachpair (const string& driver, const string& command, catalogCommands) {
+    const process::Time started = Clock::now();
+
+    // A command that hangs must not hold up the next refresh.
+    Try<string> output = runCommand(
+        "timeout " + stringify(catalogInterval.secs()) + " " + command);
+
+    Try<hashmap<string, CatalogEntry>> volumes = output.isSome()
+      ? parseCatalog(output.get())
+      : Try<hashmap<string, CatalogEntry>>(Error(output.error()));
+
+    if (volumes.isError()) {
+      LOG(WARNING) << "Failed to refresh the volume catalog of " << driver
+                   << ": " << volumes.error();
+      continue;
+    }
+
+    dispatch(PID<DockerVolumeDriverIsolator>(this),
+             &DockerVolumeDriverIsolator::recordCatalog,
+             driver,
+             started,
+             volumes.get());
+  }
+}
+
+void DockerVolumeDriverIsolator::recordCatalog(
+    const string& driver,
+    const process::Time& started,
+    const hashmap<string, CatalogEntry>& volumes)
+{
+  VolumeCatalog& catalog = catalogs[driver];
+  catalog.refreshed = started;
+  catalog.volumes = volumes;
+
+  // Volumes changed after the command started may be listed either way.
+  foreach (const string& name, catalog.changed.keys()) {
+    if (catalog.changed.at(name) < started) {
+      catalog.changed.erase(name);
+    }
+  }
+}
+
+Try<hashmap<string, DockerVolumeDriverIsolator::CatalogEntry>>
+DockerVolumeDriverIsolator::parseCatalog(const string& output)
+{
+  Try<JSON::Array> array = JSON::parse<JSON::Array>(output);
+  if (array.isError()) {
+    return Error("Invalid catalog: " + array.error());
+  }
+
+  hashmap<string, CatalogEntry> volumes;
+  foreach (const JSON::Value& value, array.get().values) {
+    if (!value.is<JSON::Object>()) {
+      return Error("Invalid catalog, expecting an array of objects");
+    }
+    const JSON::Object& object = value.as<JSON::Object>();
+
+    Result<JSON::String> name = object.find<JSON::String>("name");
+    if (!name.isSome() || name.get().value.empty()) {
+      return Error("Invalid catalog, every volume needs a name");
+    }
+
+    CatalogEntry entry;
+
+    Result<JSON::String> size = object.find<JSON::String>("size");
+    if (size.isSome()) {
+      Try<Bytes> bytes = Bytes::parse(size.get().value);
+      if (bytes.isError()) {
+        return Error("Invalid size of " + name.get().value + ": " +
+                     bytes.error());
+      }
+      entry.size = bytes.get();
+    }
+
+    Result<JSON::String> attachment = object.find<JSON::String>("attachment");
+    if (attachment.isSome()) {
+      entry.attachment = attachment.get().value;
+    }
+
+    volumes.put(strings::lower(name.get().value), entry);
+  }
+
+  return volumes;
+}
+
+Option<string> DockerVolumeDriverIsolator::catalogRejection(
+    const ExternalMount& em) const
+{
+  const string driver = strings::lower(em.volumedriver());
+  const string name = strings::lower(em.volumename());
+
+  // Local and CSI volumes are not served by the driver's catalog, and
+  // volumes this agent has attached are reused without asking it.
+  if (driver == LOCAL_VOLUME_DRIVER || !em.csi_endpoint().empty() ||
+      !catalogs.contains(driver) ||
+      heldMountpoint(em).isSome() ||
+      mounting.contains(getExternalMountId(em)) ||
+      detaching.contains(getExternalMountId(em))) {
+    return None();
+  }
+
+  const VolumeCatalog& catalog = catalogs.at(driver);
+  if (Clock::now() - catalog.refreshed > catalogTtl ||
+      catalog.changed.contains(name)) {
+    return None();
+  }
+
+  if (!catalog.volumes.contains(name)) {
+    if (!em.explicit_create()) {
+      return "does not exist and DVDI_VOLUME_EXPLICITCREATE is not set";
+    }
+
+    LOG(INFO) << em.volumedriver() << "/" << em.volumename()
+              << " is not in the catalog, it will be created";
+    return None();
+  }
+
+  const CatalogEntry& entry = catalog.volumes.at(name);
+  if (entry.attachment == CATALOG_UNAVAILABLE) {
+    return "is attached to another node";
+  }
+
+  if (em.explicit_create()) {
+    LOG(INFO) << em.volumedriver() << "/" << em.volumename()
+              << " already exists"
+              << (entry.size.isSome() ? " with " + stringify(entry.size.get())
+                                      : string())
+              << ", it will not be created";
+  }
+
+  return None();
+}
+
+void DockerVolumeDriverIsolator::invalidateCatalog(const ExternalMount& em)
+{
+  const string driver = strings::lower(em.volumedriver());
+  if (catalogs.contains(driver)) {
+    catalogs[driver].changed[strings::lower(em.volumename())] = Clock::now();
+  }
+}
+
+size_t DockerVolumeDriverIsolator::holders(const ExternalMount& em) const
+{
+  const ExternalMountID id = getExternalMountId(em);
+
+  size_t count = 0;
+  foreachvalue (const process::Owned<ExternalMount> &mount, infos) {
+    if (getExternalMountId(*mount) == id) {
+      count++;
+    }
+  }
+  foreachvalue (const process::Owned<ExternalMount> &mount, pending) {
+    if (getExternalMountId(*mount) == id) {
+      count++;
+    }
+  }
+  return count;
+}
+
+bool DockerVolumeDriverIsolator::heldOutsidePod(
+    const ExternalMount& em,
+    const ContainerID&   containerId) const
+{
+  const ExternalMountID id = getExternalMountId(em);
+  const ContainerID pod = topLevel(containerId);
+
+  foreachpair (const ContainerID& holder,
+               const process::Owned<ExternalMount> &mount,
+               infos) {
+    if (getExternalMountId(*mount) == id && !(topLevel(holder) == pod)) {
+      return true;
+    }
+  }
+  foreachpair (const ContainerID& holder,
+               const process::Owned<ExternalMount> &mount,
+               pending) {
+    if (getExternalMountId(*mount) == id && !(topLevel(holder) == pod)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void DockerVolumeDriverIsolator::protectOverlayLower(const ExternalMount& em)
+{
+  if (!em.overlay()) {
+    return;
+  }
+
+  const ExternalMountID id = getExternalMountId(em);
+
+  bool overlaid = false;
+  foreachvalue (const process::Owned<ExternalMount> &mount, infos) {
+    if (getExternalMountId(*mount) == id && mount->overlay() &&
+        !mount->container_path().empty()) {
+      overlaid = true;
+    }
+  }
+
+  // The remount reads the mount table and may block on the volume, so
+  // it runs on a filesystem worker. Always the same one for a volume,
+  // so its remounts are made in the order they were decided in.
+  const string mountpoint = em.mountpoint();
+  fsWorkers[id % fsWorkers.size()]->post([=]() {
+    {
+      std::lock_guard<std::mutex> lock(readOnlyLowersMutex);
+      if (overlaid == readOnlyLowers.contains(id)) {
+        return;
+      }
+    }
+
+    // Only the flags of the mount change, the filesystem is not touched.
+    Try<bool> changed = setReadOnly(mountpoint, overlaid);
+    if (changed.isError()) {
+      LOG(WARNING) << "Failed to remount " << mountpoint
+                   << (overlaid ? " read-only" : " writable") << ": "
+                   << changed.error();
+    }
+
+    std::lock_guard<std::mutex> lock(readOnlyLowersMutex);
+    if (!overlaid) {
+      readOnlyLowers.erase(id);
+    } else if (changed.isSome() && changed.get()) {
+      LOG(INFO) << "Remounted " << mountpoint
+                << " read-only while it is the lower directory of overlays";
+      readOnlyLowers.insert(id);
+    }
+  });
+}
+
+bool DockerVolumeDriverIsolator::heldInOtherMode(
+    const ExternalMount& em) const
+{
+  const ExternalMountID id = getExternalMountId(em);
+
+  foreachvalue (const process::Owned<ExternalMount> &mount, infos) {
+    if (getExternalMountId(*mount) == id &&
+        !mount->container_path().empty() &&
+        mount->overlay() != em.overlay()) {
+      return true;
+    }
+  }
+  foreachvalue (const process::Owned<ExternalMount> &mount, pending) {
+    if (getExternalMountId(*mount) == id &&
+        !mount->container_path().empty() &&
+        mount->overlay() != em.overlay()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+ContainerID DockerVolumeDriverIsolator::topLevel(
+    const ContainerID& containerId)
+{
+#if MESOS_VERSION_INT >= 110 && MESOS_VERSION_INT < 200
+  if (containerId.has_parent()) {
+    return topLevel(containerId.parent());
+  }
+#endif
+  return containerId;
+}
+
+Option<string> DockerVolumeDriverIsolator::heldMountpoint(
+    const ExternalMount& em) const
+{
+  const ExternalMountID id = getExternalMountId(em);
+
+  foreachvalue (const process::Owned<ExternalMount> &mount, infos) {
+    if (getExternalMountId(*mount) == id) {
+      return mount->mountpoint();
+    }
+  }
+  foreachvalue (const process::Owned<ExternalMount> &mount, pending) {
+    if (getExternalMountId(*mount) == id && !mount->mountpoint().empty()) {
+      return mount->mountpoint();
+    }
+  }
+  return None();
+}
+
+hashset<DockerVolumeDriverIsolator::ExternalMountID>
+DockerVolumeDriverIsolator::attachedVolumes() const
+{
+  hashset<ExternalMountID> attached;
+
+  foreachvalue (const process::Owned<ExternalMount>& em, infos) {
+    if (em->volumedriver() != LOCAL_VOLUME_DRIVER) {
+      attached.insert(getExternalMountId(*em));
+    }
+  }
+
+  // Covers the volumes in mounting as well.
+  foreachvalue (const process::Owned<ExternalMount>& em, pending) {
+    if (em->volumedriver() != LOCAL_VOLUME_DRIVER) {
+      attached.insert(getExternalMountId(*em));
+    }
+  }
+
+  // Stay attached until their unmount succeeds.
+  foreachvalue (const process::Owned<ExternalMount>& em, detaching) {
+    if (em->volumedriver() != LOCAL_VOLUME_DRIVER) {
+      attached.insert(getExternalMountId(*em));
+    }
+  }
+
+  foreach (const ExternalMountID& id, unreferencedSince.keys()) {
+    attached.insert(id);
+  }
+
+  return attached;
+}
+
+double DockerVolumeDriverIsolator::freeAttachSlots()
+{
+  const size_t attached = attachedVolumes().size();
+  return attached < attachSlots ? attachSlots - attached : 0;
+}
+
+Option<string> DockerVolumeDriverIsolator::hostMountpoint(
+    const ExternalMount& em)
+{
+  // /proc/self/mounts polls with POLLPRI once the mount table changed
+  // after it was opened, so an unchanged table is never read again.
+  bool changed = hostMountsFd < 0;
+  if (!changed) {
+    struct pollfd pollfd;
+    pollfd.fd = hostMountsFd;
+    pollfd.events = POLLPRI;
+    pollfd.revents = 0;
+    changed = ::poll(&pollfd, 1, 0) != 0;
+  }
+
+  if (changed) {
+    if (hostMountsFd >= 0) {
+      ::close(hostMountsFd);
+    }
+    hostMountsFd = ::open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+    hostMounts.clear();
+
+    Try<fs::MountInfoTable> table = fs::MountInfoTable::read();
+    if (table.isError()) {
+      LOG(WARNING) << "Failed to read the host mount table: " << table.error();
+      if (hostMountsFd >= 0) {
+        ::close(hostMountsFd);
+        hostMountsFd = -1;
+      }
+      return None();
+    }
+
+    foreach (const fs::MountInfoTable::Entry& entry, table.get().entries) {
+      foreachpair (const string& driver, const string& root,
+                   reconcileMountRoots) {
+        if (!strings::startsWith(entry.target, root)) {
+          continue;
+        }
+
+        // Only the mount of the volume itself, not mounts below it.
+        std::vector<string> components =
+          strings::tokenize(entry.target.substr(root.length()), "/");
+        if (components.size() == 1) {
+          ExternalMount mount;
+          mount.set_volumedriver(driver);
+          mount.set_volumename(components.front());
+          hostMounts.put(getExternalMountId(mount), entry.target);
+        }
+        break;
+      }
+    }
+  }
+
+  return hostMounts.get(getExternalMountId(em));
+}
+
+PID<DockerVolumeDriverShard> DockerVolumeDriverIsolator::shard(
+    const ExternalMount& em) const
+{
+  return shards[getExternalMountId(em) % shards.size()]->self();
+}
+
+size_t DockerVolumeDriverIsolator::overlayWorker(
+    const ExternalMount& em) const
+{
+  return std::hash<string>()(em.overlay_dir()) % fsWorkers.size();
+}
+
+size_t DockerVolumeDriverIsolator::idleWorker() const
+{
+  size_t worker = 0;
+  for (size_t i = 1; i < fsWorkers.size(); i++) {
+    if (fsWorkers[i]->load() < fsWorkers[worker]->load()) {
+      worker = i;
+    }
+  }
+  return worker;
+}
+
+Future<string> DockerVolumeDriverIsolator::deviceOnWorker(
+    const ExternalMount& em)
+{
+  const string mountpoint = em.mountpoint();
+  Future<string> device = fsWorkers[idleWorker()]->run<string>([=]() {
+    Try<string> device = blockDevice(mountpoint);
+    if (device.isError()) {
+      LOG(INFO) << "I/O limits cannot apply to " << mountpoint << ": "
+                << device.error();
+      return string();
+    }
+    return device.get();
+  });
+
+  return device.after(fsTimeout, [=](const Future<string>&) {
+    LOG(WARNING) << "Looking up the block device of " << mountpoint
+                 << " did not finish within " << fsTimeout
+                 << ", I/O limits cannot apply to it";
+    return string();
+  });
+}
+
+Future<string> DockerVolumeDriverIsolator::containerizeOnWorker(
+    const ExternalMount& em)
+{
+  const size_t worker = em.overlay() ? overlayWorker(em) : idleWorker();
+
+  Future<string> bind = fsWorkers[worker]->run<string>([=]() {
+    return containerize(em);
+  });
+
+  const string volume = em.volumedriver() + "/" + em.volumename();
+  return bind.after(fsTimeout, [=](const Future<string>&) -> Future<string> {
+    LOG(ERROR) << "Preparing the bind mount of " << volume << " did not "
+               << "finish within " << fsTimeout
+               << ", its filesystem may be hung";
+    return Failure("prepare() timed out on the filesystem of " + volume);
+  });
+}
+
+Try<string> DockerVolumeDriverIsolator::containerize(
+    const ExternalMount& em) const
+{
+  const string containerPath = em.container_path();
+  const string hostPath = DockerVolumeDriverIsolator::hostPath(em);
+
+  // prepare() only accepts container paths that exist or are under /tmp.
+  if (!os::exists(containerPath)) {
+    Try<Nothing> mkdir = os::mkdir(containerPath);
+    if (mkdir.isError()) {
+      return Error(
+          "DockerVolumeDriverIsolator could not create container path dir: " +
+          containerPath);
+    }
+  }
+
+  if (!em.subpath().empty()) {
+    if (!os::exists(hostPath)) {
+      Try<Nothing> mkdir = os::mkdir(hostPath);
+      if (mkdir.isError()) {
+        LOG(ERROR) << "Failed to create subpath " << hostPath
+                   << " mkdir returned " << mkdir.error();
+        return Error("prepare() failed during mkdir attempt");
+      }
+    }
+
+    if (!em.subpath_quota().empty() &&
+        !applySubpathQuota(em, hostPath)) {
+      return Error("prepare() failed during quota attempt");
+    }
+  }
+
+  // The overlay root takes the owner and permissions of its upper
+  // directory, which is private to the container, so the volume is left
+  // untouched.
+  string owned = hostPath;
+  if (em.overlay()) {
+    owned = path::join(em.overlay_dir(), "upper");
+    const string dirs[] = {owned, path::join(em.overlay_dir(), "work")};
+    foreach (const string& dir, dirs) {
+      Try<Nothing> mkdir = os::mkdir(dir);
+      if (mkdir.isError()) {
+        LOG(ERROR) << "Failed to create overlay directory " << dir
+                   << " mkdir returned " << mkdir.error();
+        return Error("prepare() failed during mkdir attempt");
+      }
+    }
+  }
+
+  // An idmapped bind translates the owners of the whole volume, which is
+  // left untouched.
+  if (em.idmap()) {
+#ifdef SYS_mount_setattr
+    // With an invalid fd, kernels that support it fail with EBADF.
+    if (::syscall(SYS_mount_setattr, -1, "", 0, NULL, 0) < 0 &&
+        errno == ENOSYS) {
+      return Error("prepare() failed, idmapped mounts are not supported "
+                   "by the kernel");
+    }
+#endif
+    // Mounted by isolate(), see idmapMount().
+    return string();
+  }
+
+  // Set the ownership and permissions to match the container path
+  // as these are inherited from host path on bind mount.
+  struct stat stat;
+  if (::stat(containerPath.c_str(), &stat) < 0) {
+    LOG(ERROR) << "Failed to get permissions on " << containerPath
+               << " stat returned " << strerror(errno);
+    return Error("prepare() failed during stat attempt");
+  }
+
+  Try<Nothing> chmod = os::chmod(owned, stat.st_mode);
+  if (chmod.isError()) {
+    LOG(ERROR) << "Failed to get permissions on " << containerPath
+               << " chmod returned " << chmod.error();
+    return Error("prepare() failed during chmod attempt");
+  }
+
+  Try<Nothing> chown = os::chown(stat.st_uid, stat.st_gid, owned, false);
+  if (chown.isError()) {
+    LOG(ERROR) << "Failed to get permissions on " << containerPath
+               << " chown returned " << chown.error();
+    return Error("prepare() failed during chown attempt");
+  }
+
+  return bindCommand(em, hostPath);
 }
 
 // Prepare runs BEFORE a task is started
@@ -578,428 +3212,1348 @@ Failure DockerVolumeDriverIsolator::revertMountlist(
 // mount, we want to exit with an error and no new
 // mounted volumes. Goal: make all mounts or none.
 #if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
-Future<Option<CommandInfo>> DockerVolumeDriverIsolator::prepare(
-  const ContainerID& containerId,
-  const ExecutorInfo& executorInfo,
-  const string& directory,
-  const Option<string>& rootfs,
-  const Option<string>& user)
+Future<Option<CommandInfo>> DockerVolumeDriverIsolator::prepare(
+  const ContainerID& containerId,
+  const ExecutorInfo& executorInfo,
+  const string& directory,
+  const Option<string>& rootfs,
+  const Option<string>& user)
+#elif MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 270
+Future<Option<ContainerPrepareInfo>> DockerVolumeDriverIsolator::prepare(
+  const ContainerID& containerId,
+  const ExecutorInfo& executorInfo,
+  const string& directory,
+  const Option<string>& user)
+#else
+Future<Option<ContainerLaunchInfo>> DockerVolumeDriverIsolator::prepare(
+  const ContainerID& containerId,
+  const ContainerConfig& containerConfig)
+#endif
+{
+  LOG(INFO) << "Preparing external storage for container: "
+            << stringify(containerId);
+
+#if MESOS_VERSION_INT < 200 || MESOS_VERSION_INT >= 280
+  const ExecutorInfo& executorInfo = containerConfig.executor_info();
+#elif MESOS_VERSION_INT >= 270
+  const ExecutorInfo& executorInfo = containerConfig.executorinfo();
+#endif
+
+#if MESOS_VERSION_INT >= 110 && MESOS_VERSION_INT < 200
+  // A nested container, such as a task of a task group, has no executor
+  // of its own, its volumes are requested in the environment of its task.
+  const CommandInfo& commandInfo =
+    !containerId.has_parent() ? executorInfo.command()
+    : containerConfig.has_task_info() ? containerConfig.task_info().command()
+    : containerConfig.command_info();
+#else
+  const CommandInfo& commandInfo = executorInfo.command();
+#endif
+
+  // Get things we need from task's environment in ExecutoInfo.
+  if (!commandInfo.has_environment()) {
+    // No environment means no external volume specification.
+    // Not an error, just nothing to do, so return None.
+    LOG(INFO) << "No environment specified for container ";
+    return None();
+  }
+
+  const process::Time started = Clock::now();
+
+  if (!traceFile.empty()) {
+    JSON::Object environment;
+    foreach (const Environment_Variable &variable,
+             commandInfo.environment().variables()) {
+      if (strings::startsWith(variable.name(), "DVDI_")) {
+        environment.values[variable.name()] = JSON::String(variable.value());
+      }
+    }
+
+    JSON::Object event;
+    event.values["container"] = JSON::String(containerId.value());
+    event.values["environment"] = environment;
+    trace("prepare", event);
+  }
+
+  std::vector<std::pair<string, string>> environment;
+  foreach (const Environment_Variable &variable,
+           commandInfo.environment().variables()) {
+    environment.push_back(std::make_pair(variable.name(), variable.value()));
+  }
+
+  SpecPolicy policy;
+  foreachkey (const string& profile, tuningProfiles) {
+    policy.tuningProfiles.insert(profile);
+  }
+  policy.localVolumes = !localPool.empty();
+  policy.cacheTier = !cachePool.empty();
+
+  Try<std::vector<ExternalMount>> specs =
+    parseVolumeSpecs(stringify(containerId), environment, policy);
+  if (specs.isError()) {
+    return Failure("prepare() failed, " + specs.error());
+  }
+
+  // requestedExternalMounts is all mounts requested by container.
+  std::vector<process::Owned<ExternalMount>> requestedExternalMounts;
+  foreach (const ExternalMount& spec, specs.get()) {
+    // Checked on the agent's own filesystem, before anything is mounted.
+    // Missing paths under /tmp are created along with the bind mount.
+    if (!spec.container_path().empty() &&
+        !os::exists(spec.container_path()) &&
+        !strings::startsWith(spec.container_path(), "/tmp/")) {
+      return Failure(
+        "prepare() failed, containerpaths must pre-exist, or be under /tmp");
+    }
+
+    if (!spec.csi_endpoint().empty()) {
+      Try<Nothing> endpoint = checkCsiEndpoint(spec);
+      if (endpoint.isError()) {
+        return Failure("prepare() failed, " + endpoint.error());
+      }
+    }
+
+    requestedExternalMounts.push_back(
+      process::Owned<ExternalMount>(new ExternalMount(spec)));
+
+    // Overlays are written to the container's sandbox, and discarded
+    // with it in cleanup().
+    if (spec.overlay()) {
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 270
+      const string& sandbox = directory;
+#else
+      const string& sandbox = containerConfig.directory();
+#endif
+      // parseVolumeSpecs() lets a container use a volume only once.
+      requestedExternalMounts.back()->set_overlay_dir(
+          path::join(sandbox, DVDI_OVERLAYS_DIRNAME,
+                     spec.volumedriver() + "." + spec.volumename()));
+    }
+  }
+
+  // Each requested volume is either already mounted for another container,
+  // being mounted for another container, or mounted here on its shard.
+  // All of the container's mounts are held in pending until every one of
+  // them is set up, so a concurrent cleanup() never unmounts them.
+  list<Future<string>> mountpoints;
+  if (infos.contains(containerId) || pending.contains(containerId)) {
+    return Failure("Container has already been prepared");
+  }
+
+  if (draining) {
+    return Failure("prepare() failed, the agent is draining its volumes");
+  }
+
+  // Containers sharing a mount each get their own subpath, but only
+  // the first user may bind the mountpoint root. The containers of one
+  // pod may all bind the root, each at its own container path.
+  foreach (const process::Owned<ExternalMount> &requestedMount,
+           requestedExternalMounts) {
+    // The snapshot only matters when the volume is created, a volume
+    // created from another one cannot be what this container expects.
+    // Volumes still being mounted for another container are in pending.
+    const ExternalMountID id = getExternalMountId(*requestedMount);
+    std::vector<process::Owned<ExternalMount>> users;
+    foreachvalue (const process::Owned<ExternalMount> &held, infos) {
+      users.push_back(held);
+    }
+    foreachvalue (const process::Owned<ExternalMount> &held, pending) {
+      users.push_back(held);
+    }
+    foreach (const process::Owned<ExternalMount> &held, users) {
+      if (getExternalMountId(*held) == id &&
+          !requestedMount->from_snapshot().empty() &&
+          held->from_snapshot() != requestedMount->from_snapshot()) {
+        return Failure("prepare() failed, " +
+                       requestedMount->volumename() +
+                       " is in use from a different snapshot");
+      }
+    }
+
+    // Mounted volumes are reused without asking their driver.
+    const string driver =
+      strings::lower(requestedMount->volumedriver());
+    if (unhealthyDrivers.contains(driver) &&
+        heldMountpoint(*requestedMount).isNone() &&
+        !mounting.contains(id)) {
+      return Failure("prepare() failed, volume driver " + driver +
+                     " of " + requestedMount->volumename() +
+                     " is unhealthy: " + unhealthyDrivers.at(driver));
+    }
+
+    // Rejected in microseconds instead of after a dvdcli timeout.
+    Option<string> rejected = catalogRejection(*requestedMount);
+    if (rejected.isSome()) {
+      return Failure("prepare() failed, " + requestedMount->volumename() +
+                     " " + rejected.get());
+    }
+
+    // An overlay must not see its lower directory change under it.
+    if (!requestedMount->container_path().empty() &&
+        heldInOtherMode(*requestedMount)) {
+      return Failure("prepare() failed, " + requestedMount->volumename() +
+                     (requestedMount->overlay() ? " is in use without"
+                                                : " is in use with") +
+                     " an overlay");
+    }
+
+    // CSI volumes are published for each container separately, and
+    // overlays only read the volume.
+    if (heldOutsidePod(*requestedMount, containerId) &&
+        requestedMount->csi_endpoint().empty() &&
+        !requestedMount->overlay() &&
+        !requestedMount->container_path().empty() &&
+        requestedMount->subpath().empty()) {
+      return Failure(
+              "prepare() failed, containerpath request on existing mount");
+    }
+  }
+
+  // Reserve the slots of the volumes that are not attached yet up front,
+  // instead of letting dvdcli run into the node limit after a long cloud
+  // timeout and then unrolling the mounts that did succeed. The pending
+  // mounts hold the reservation until they are in infos or reverted.
+  if (attachSlots > 0) {
+    hashset<ExternalMountID> attached = attachedVolumes();
+    const size_t before = attached.size();
+
+    foreach (const process::Owned<ExternalMount> &requestedMount,
+             requestedExternalMounts) {
+      if (requestedMount->volumedriver() != LOCAL_VOLUME_DRIVER) {
+        attached.insert(getExternalMountId(*requestedMount));
+      }
+    }
+
+    if (attached.size() > attachSlots) {
+      const size_t free = before < attachSlots ? attachSlots - before : 0;
+      return Failure("prepare() failed, " +
+                     stringify(attached.size() - before) +
+                     " volumes to attach but only " + stringify(free) +
+                     " of " + stringify(attachSlots) +
+                     " attach slots are free");
+    }
+  }
+
+  // Replaced by update() once the containerizer knows the task resources.
+  allocated.put(containerId, executorInfo.resources());
+
+  foreach (const process::Owned<ExternalMount> &requestedMount,
+           requestedExternalMounts) {
+    const ExternalMountID id = getExternalMountId(*requestedMount);
+    Option<string> mountpoint = heldMountpoint(*requestedMount);
+
+    // Cancel the detach of a volume released by its last container.
+    // An unmount that is already running is waited for below.
+    // Such a warm volume is still mounted, and keeps its origin.
+    const bool warm = detaching.contains(id);
+    if (warm) {
+      requestedMount->set_adopted(detaching.at(id)->adopted());
+      LOG(INFO) << "Requested mount(" << requestedMount->volumedriver() << "/"
+                << requestedMount->volumename()
+                << ") was being detached, the detach is cancelled";
+      detaching.erase(id);
+      orphaned.erase(id);
+    }
+
+    if (mountpoint.isSome()) {
+      LOG(INFO) << "Requested mount(" << requestedMount->volumedriver() << "/"
+                << requestedMount->volumename()
+                << ") is already mounted by another container";
+      mountpoints.push_back(mountpoint.get());
+    } else if (mounting.contains(id)) {
+      LOG(INFO) << "Requested mount(" << requestedMount->volumedriver() << "/"
+                << requestedMount->volumename()
+                << ") is being mounted for another container";
+      mountpoints.push_back(mounting.at(id));
+    } else if (unmounting.contains(id)) {
+      // Let the unmount finish before mounting the volume again.
+      LOG(INFO) << "Requested mount(" << requestedMount->volumedriver() << "/"
+                << requestedMount->volumename()
+                << ") is being unmounted, it will be mounted afterwards";
+
+      const ExternalMount em = *requestedMount;
+      const PID<DockerVolumeDriverShard> pid = shard(em);
+      process::Owned<Promise<string>> promise(new Promise<string>());
+      unmounting.at(id).onAny([=](const Future<Nothing>&) {
+        promise->associate(
+            dispatch(pid, &DockerVolumeDriverShard::mount, em));
+      });
+
+      mounting.put(id, promise->future());
+      mountpoints.push_back(promise->future());
+    } else if (requestedMount->csi_endpoint().empty() &&
+               hostMountpoint(*requestedMount).isSome()) {
+      // Mounted by someone else, e.g. the Docker containerizer or an
+      // agent that lost its checkpoint. Calling dvdcli mount again would
+      // be slow at best. It is unmounted like any other volume once no
+      // container of ours holds it.
+      const string adopted = hostMountpoint(*requestedMount).get();
+      LOG(INFO) << "Requested mount(" << requestedMount->volumedriver() << "/"
+                << requestedMount->volumename()
+                << ") is already mounted on the host at " << adopted
+                << (warm ? ", reusing it" : ", adopting it");
+      if (!warm) {
+        requestedMount->set_adopted(true);
+      }
+      mountpoints.push_back(adopted);
+    } else {
+      Future<string> mounted = dispatch(
+          shard(*requestedMount),
+          &DockerVolumeDriverShard::mount,
+          *requestedMount);
+
+      mounting.put(id, mounted);
+      mountpoints.push_back(mounted);
+    }
+
+    pending.put(containerId, requestedMount);
+  }
+
+  Future<list<string>> prepared = await(mountpoints)
+    .then(defer(self(), [=](const list<Future<string>>& mounted) {
+      return _prepare(containerId, requestedExternalMounts, mounted);
+    }));
+
+  if (!traceFile.empty()) {
+    prepared.onAny([=](const Future<list<string>>& future) {
+      JSON::Object event;
+      event.values["container"] = JSON::String(containerId.value());
+      event.values["latency"] =
+        JSON::Number((Clock::now() - started).secs());
+      event.values["ok"] = JSON::Boolean(future.isReady());
+      trace("prepared", event);
+    });
+  }
+
+  if (!deferAttach) {
+    return prepared
+      .then([=](const list<string>& commands) -> Future<PrepareResult> {
+        return launchInfo(commands);
+      });
+  }
+
+  // The bind mount commands run after isolate(), by which time __prepare()
+  // has pointed each numbered link below bindsDir() at its host path.
+  list<string> commands;
+  size_t bind = 0;
+  foreach (const process::Owned<ExternalMount> &mount,
+           requestedExternalMounts) {
+    if (mount->container_path().empty()) {
+      continue;
+    }
+
+    const string link = path::join(bindsDir(containerId), stringify(bind++));
+    commands.push_back(mount->idmap() ? string() : bindCommand(*mount, link));
+  }
+
+  attaching.put(
+      containerId,
+      prepared.then([](const list<string>&) { return Nothing(); }));
+
+  return launchInfo(commands);
+}
+
+DockerVolumeDriverIsolator::PrepareResult
+DockerVolumeDriverIsolator::launchInfo(const list<string>& commands)
+{
+  if (commands.empty()) {
+    return None();
+  }
+
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
+  list<string> nonEmpty;
+  foreach (const string& command, commands) {
+    if (!command.empty()) {
+      nonEmpty.push_back(command);
+    }
+  }
+  if (nonEmpty.empty()) {
+    return None();
+  }
+
+  CommandInfo command;
+  command.set_value(strings::join(" && ", nonEmpty));
+
+  return command;
+#else
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 250
+  ContainerPrepareInfo prepareInfo;
 #elif MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 270
-Future<Option<ContainerPrepareInfo>> DockerVolumeDriverIsolator::prepare(
-  const ContainerID& containerId,
-  const ExecutorInfo& executorInfo,
-  const string& directory,
-  const Option<string>& user)
+  ContainerPrepareInfo prepareInfo;
+  prepareInfo.set_namespaces(CLONE_NEWNS);
+#elif MESOS_VERSION_INT >= 120 && MESOS_VERSION_INT < 130
+  // This makes this file compatible with the changes for Mesos v1.2.0
+  ContainerLaunchInfo prepareInfo;
+  prepareInfo.add_clone_namespaces(CLONE_NEWNS);
 #else
-Future<Option<ContainerLaunchInfo>> DockerVolumeDriverIsolator::prepare(
-  const ContainerID& containerId,
-  const ContainerConfig& containerConfig)
+  //yes, this should be called launchInfo, but it side step making a lot of
+  //code changes.
+  ContainerLaunchInfo prepareInfo;
+  prepareInfo.set_namespaces(CLONE_NEWNS);
+#endif
+
+  foreach (const string& command, commands) {
+    if (command.empty()) {
+      continue;
+    }
+
+#if MESOS_VERSION_INT <= 200
+    prepareInfo.add_pre_exec_commands()->set_value(command);
+#else
+    prepareInfo.add_commands()->set_value(command);
+#endif
+  }
+
+  return prepareInfo;
+#endif
+}
+
+string DockerVolumeDriverIsolator::bindsDir(const ContainerID& containerId)
+{
+  return path::join(stateDir, DVDI_BINDS_DIRNAME,
+                    stringify(containerId));
+}
+
+string DockerVolumeDriverIsolator::bindCommand(
+    const ExternalMount& em,
+    const string&   source)
+{
+  // The volume is the read-only lower directory of the overlay.
+  if (em.overlay()) {
+    const string command =
+      "mount -n -t overlay overlay -o lowerdir=" + source +
+      ",upperdir=" + path::join(em.overlay_dir(), "upper") +
+      ",workdir=" + path::join(em.overlay_dir(), "work") + " " +
+      em.container_path();
+
+    LOG(INFO) << "queueing " << command;
+    return command;
+  }
+
+  // -n means don't write to /etc/mtab
+  const string command =
+    "mount -n --rbind " + source + " " + em.container_path();
+
+  LOG(INFO) << "queueing " << command;
+  return command;
+}
+
+string DockerVolumeDriverIsolator::hostPath(const ExternalMount& em)
+{
+  const string root =
+    em.csi_endpoint().empty() ? em.mountpoint() : csiTargetPath(em);
+
+  if (em.subpath().empty()) {
+    return root;
+  }
+
+  return path::join(root, em.subpath());
+}
+
+Future<list<string>> DockerVolumeDriverIsolator::_prepare(
+    const ContainerID&                                 containerId,
+    const std::vector<process::Owned<ExternalMount>>&  requested,
+    const list<Future<string>>&                        mountpoints)
+{
+  list<Future<string>> binds;
+  list<Future<string>> devices;
+  bool failed = false;
+  list<Future<string>>::const_iterator mounted = mountpoints.begin();
+  foreach (const process::Owned<ExternalMount> &mount, requested) {
+    const ExternalMountID id = getExternalMountId(*mount);
+    if (mounting.contains(id) && mounting.at(id) == *mounted) {
+      mounting.erase(id);
+    }
+
+    if (mounted->isReady()) {
+      mount->set_mountpoint(mounted->get());
+    } else {
+      LOG(ERROR) << "Failed to mount " << mount->volumedriver() << "/"
+                 << mount->volumename() << ": "
+                 << (mounted->isFailed() ? mounted->failure() : "discarded");
+      failed = true;
+    }
+    ++mounted;
+  }
+
+  if (!pending.contains(containerId)) {
+    // cleanup() could not release the volumes that were still being
+    // mounted, do it now unless another container took them over.
+    foreach (const process::Owned<ExternalMount> &mount, requested) {
+      const ExternalMountID id = getExternalMountId(*mount);
+      if (mount->mountpoint().empty() || holders(*mount) > 0 ||
+          mounting.contains(id) || detaching.contains(id)) {
+        continue;
+      }
+
+      release(*mount, "prepare()-container destroyed");
+    }
+    checkpointInfos();
+
+    return Failure("Container was destroyed during prepare()");
+  }
+
+  // Once any mount attempt fails, give up on whole list
+  // and attempt to undo the mounts we already made.
+  if (failed) {
+    return revertMountlist("mount", containerId);
+  }
+
+  // The block device of each volume is looked up once, on a filesystem worker,
+  // by the first container to hold it.
+  foreach (const process::Owned<ExternalMount> &mount, requested) {
+    Option<string> device;
+    foreachvalue (const process::Owned<ExternalMount> &held, infos) {
+      if (getExternalMountId(*held) == getExternalMountId(*mount) &&
+          held->mountpoint() == mount->mountpoint()) {
+        device = held->device();
+        break;
+      }
+    }
+
+    devices.push_back(device.isSome() ? Future<string>(device.get())
+                                      : deviceOnWorker(*mount));
+  }
+
+  // Bind mounts are queued for every mount with a container path.
+  // A previously connected mount only has one if it asks for a subpath.
+  foreach (const process::Owned<ExternalMount> &mount, requested) {
+    if (mount->container_path().empty()) {
+      continue; // empty container path means skip containerization
+    }
+
+    // Each container gets its own publish target of a staged CSI
+    // volume. Publishing stays on the shard, ordered with unpublish().
+    if (mount->csi_endpoint().empty()) {
+      binds.push_back(containerizeOnWorker(*mount));
+    } else {
+      const ExternalMount em = *mount;
+      binds.push_back(dispatch(
+          shard(em),
+          &DockerVolumeDriverShard::publish,
+          em)
+        .then([=](const Nothing&) { return containerizeOnWorker(em); }));
+    }
+  }
+
+  return await(binds)
+    .then([=](const list<Future<string>>& prepared) {
+      return await(devices)
+        .then(defer(self(), [=](const list<Future<string>>& found) {
+          return __prepare(containerId, requested, prepared, found);
+        }));
+    });
+}
+
+Future<list<string>> DockerVolumeDriverIsolator::__prepare(
+    const ContainerID&                                 containerId,
+    const std::vector<process::Owned<ExternalMount>>&  requested,
+    const list<Future<string>>&                        binds,
+    const list<Future<string>>&                        devices)
+{
+  if (!pending.contains(containerId)) {
+    // The overlays may have been created after cleanup() discarded them.
+    foreach (const process::Owned<ExternalMount> &mount, requested) {
+      discardOverlay(*mount);
+    }
+    return Failure("Container was destroyed during prepare()");
+  }
+
+  list<string> commands;
+  foreach (const Future<string>& bind, binds) {
+    if (!bind.isReady()) {
+      LOG(ERROR) << "Failed to prepare a bind mount for container "
+                 << containerId << ": "
+                 << (bind.isFailed() ? bind.failure() : "discarded");
+      return revertMountlist("bind mount", containerId);
+    }
+    commands.push_back(bind.get());
+  }
+
+  if (deferAttach) {
+    const string dir = bindsDir(containerId);
+    Try<Nothing> mkdir = os::mkdir(dir);
+    if (mkdir.isError()) {
+      LOG(ERROR) << "Failed to create " << dir << ": " << mkdir.error();
+      return revertMountlist("bind mount", containerId);
+    }
+
+    size_t bind = 0;
+    foreach (const process::Owned<ExternalMount> &mount, requested) {
+      if (mount->container_path().empty()) {
+        continue;
+      }
+
+      const string link = path::join(dir, stringify(bind));
+      if (::symlink(hostPath(*mount).c_str(), link.c_str()) < 0) {
+        LOG(ERROR) << "Failed to link " << link << " to "
+                   << hostPath(*mount) << ": " << strerror(errno);
+
+        // Remove the links made so far, the directory is only removed
+        // once it is empty.
+        for (size_t made = 0; made < bind; made++) {
+          os::rm(path::join(dir, stringify(made)));
+        }
+        os::rmdir(dir, false);
+        return revertMountlist("bind mount", containerId);
+      }
+      bind++;
+    }
+  }
+
+  list<Future<string>>::const_iterator device = devices.begin();
+  foreach (const process::Owned<ExternalMount> &mount, requested) {
+    if (device->isReady()) {
+      mount->set_device(device->get());
+    }
+    ++device;
+  }
+
+  // Only record the mounts once every one of them is fully set up,
+  // so a failure above leaves infos untouched.
+  // Note: infos has a record for each mount associated with this container
+  // even if the mount is also used by another container.
+  foreach (const process::Owned<ExternalMount> &mount,
+           pending.get(containerId)) {
+    LOG(INFO) << "mount " << mount->mountpoint()
+              << " is now held by container " << containerId;
+    infos.put(containerId, mount);
+    lastUsed.put(getExternalMountId(*mount), process::Clock::now());
+    if (!claimed.contains(getExternalMountId(*mount))) {
+      claimed.put(getExternalMountId(*mount), mount);
+    }
+    protectOverlayLower(*mount);
+  }
+  pending.remove(containerId);
+
+  checkpointInfos();
+  checkInvariants("prepare()");
+
+  return commands;
+}
+
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
+Future<Limitation> DockerVolumeDriverIsolator::watch(
+    const ContainerID& containerId)
+{
+  // No-op, for now.
+
+  return Future<Limitation>();
+}
+#else
+Future<ContainerLimitation> DockerVolumeDriverIsolator::watch(
+    const ContainerID& containerId)
+{
+  // No-op, for now.
+
+  return Future<ContainerLimitation>();
+}
+#endif
+
+Future<Nothing> DockerVolumeDriverIsolator::update(
+    const ContainerID& containerId,
+    const Resources& resources)
+{
+  if (!infos.contains(containerId)) {
+    return Nothing();
+  }
+
+  allocated.put(containerId, resources);
+
+  if (!applyIoLimits(containerId)) {
+    return Failure("update() failed to apply I/O limits");
+  }
+
+  return Nothing();
+}
+
+
+Future<ResourceStatistics> DockerVolumeDriverIsolator::usage(
+    const ContainerID& containerId)
+{
+  // No-op, no usage gathered.
+
+  return ResourceStatistics();
+}
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
 #endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef MOUNT_ATTR_IDMAP
+#define MOUNT_ATTR_IDMAP 0x00100000
+#endif
+
+// struct mount_attr of mount_setattr(2), which older headers lack.
+struct IdmapAttr
+{
+  uint64_t attrSet;
+  uint64_t attrClr;
+  uint64_t propagation;
+  uint64_t usernsFd;
+};
+
+// Binds source at target in the mount namespace of pid, idmapped over the
+// user namespace of pid. The bind mount commands run before the launcher
+// enters the container's user namespace, so this is done from isolate().
+static Try<Nothing> idmapMount(
+    const string& source,
+    const string& target,
+    pid_t pid)
+{
+#if defined(SYS_open_tree) && defined(SYS_move_mount) && \
+    defined(SYS_mount_setattr)
+  const string userns = path::join("/proc", stringify(pid), "ns", "user");
+  const string mntns = path::join("/proc", stringify(pid), "ns", "mnt");
+
+  // The kernel refuses to idmap to the initial user namespace, and the
+  // mount must not land in the agent's mount namespace.
+  const std::pair<string, string> namespaces[] = {
+    {"/proc/self/ns/user", userns},
+    {"/proc/self/ns/mnt", mntns},
+  };
+  foreach (const auto& ns, namespaces) {
+    struct stat own;
+    struct stat container;
+    if (::stat(ns.first.c_str(), &own) < 0 ||
+        ::stat(ns.second.c_str(), &container) < 0) {
+      return ErrnoError("Failed to stat " + ns.second);
+    }
+    if (own.st_dev == container.st_dev && own.st_ino == container.st_ino) {
+      return Error(ns.second + " is the namespace of the agent");
+    }
+  }
+
+  int userFd = ::open(userns.c_str(), O_RDONLY | O_CLOEXEC);
+  if (userFd < 0) {
+    return ErrnoError("Failed to open " + userns);
+  }
+
+  int mntFd = ::open(mntns.c_str(), O_RDONLY | O_CLOEXEC);
+  if (mntFd < 0) {
+    ::close(userFd);
+    return ErrnoError("Failed to open " + mntns);
+  }
+
+  IdmapAttr attr = {};
+  attr.attrSet = MOUNT_ATTR_IDMAP;
+  attr.usernsFd = userFd;
+
+  // setns() into a mount namespace needs a single threaded process, so
+  // the mount is made by a child, which may only make system calls.
+  const char* from = source.c_str();
+  const char* to = target.c_str();
+
+  pid_t child = ::fork();
+  if (child == 0) {
+    int tree = ::syscall(
+        SYS_open_tree,
+        AT_FDCWD,
+        from,
+        OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+    if (tree < 0 ||
+        ::syscall(
+            SYS_mount_setattr, tree, "", AT_EMPTY_PATH | AT_RECURSIVE,
+            &attr, sizeof(attr)) < 0 ||
+        ::setns(mntFd, CLONE_NEWNS) < 0 ||
+        ::syscall(
+            SYS_move_mount, tree, "", AT_FDCWD, to,
+            MOVE_MOUNT_F_EMPTY_PATH) < 0) {
+      ::_exit(errno);
+    }
+    ::_exit(0);
+  }
+
+  const int forkErrno = errno;
+  ::close(userFd);
+  ::close(mntFd);
+
+  if (child < 0) {
+    return Error("Failed to fork: " + string(strerror(forkErrno)));
+  }
+
+  int status;
+  while (::waitpid(child, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return ErrnoError("Failed to wait for the idmapped mount");
+    }
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return Error("Failed to make an idmapped mount of " + source + " at " +
+                 target + ": " + (WIFEXITED(status)
+                   ? string(strerror(WEXITSTATUS(status)))
+                   : "killed"));
+  }
+
+  return Nothing();
+#else
+  return Error("idmapped mounts are not supported by this build");
+#endif
+}
+
+Future<Nothing> DockerVolumeDriverIsolator::isolate(
+    const ContainerID& containerId,
+    pid_t pid)
 {
-  LOG(INFO) << "Preparing external storage for container: "
-            << stringify(containerId);
+  Option<Future<Nothing>> attached;
+  if (attaching.contains(containerId)) {
+    attached = attaching.at(containerId);
+    attaching.erase(containerId);
+  }
 
-  if (infos.contains(containerId)) {
-    return Failure("Container has already been prepared");
+  // A failed mount has already been reverted by the prepare() chain,
+  // failing here keeps the task from running without its volumes.
+  if (attached.isSome()) {
+    return attached.get()
+      .then(defer(self(), [=](const Nothing&) {
+        return _isolate(containerId, pid);
+      }));
   }
 
-#if MESOS_VERSION_INT < 200 || MESOS_VERSION_INT >= 280
-  const ExecutorInfo& executorInfo = containerConfig.executor_info();
-#elif MESOS_VERSION_INT >= 270
-  const ExecutorInfo& executorInfo = containerConfig.executorinfo();
-#endif
+  return _isolate(containerId, pid);
+}
 
-  // Get things we need from task's environment in ExecutoInfo.
-  if (!executorInfo.command().has_environment()) {
-    // No environment means no external volume specification.
-    // Not an error, just nothing to do, so return None.
-    LOG(INFO) << "No environment specified for container ";
-    return None();
+Future<Nothing> DockerVolumeDriverIsolator::_isolate(
+    const ContainerID& containerId,
+    pid_t pid)
+{
+  // Mount isolation happens when mounting/unmounting in prepare/cleanup,
+  // only the I/O limits and idmapped mounts need the pid of the container.
+  std::vector<ExternalMount> idmapped;
+  if (!infos.contains(containerId)) {
+    return Nothing();
   }
 
-#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
-  list<string> commands;
-#elif MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 250
-  ContainerPrepareInfo prepareInfo;
-#elif MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 270
-  ContainerPrepareInfo prepareInfo;
-  prepareInfo.set_namespaces(CLONE_NEWNS);
-#elif MESOS_VERSION_INT >= 120 && MESOS_VERSION_INT < 130
-  // This makes this file compatible with the changes for Mesos v1.2.0
-  ContainerLaunchInfo prepareInfo;
-  prepareInfo.add_clone_namespaces(CLONE_NEWNS);
-#else
-  //yes, this should be called launchInfo, but it side step making a lot of
-  //code changes.
-  ContainerLaunchInfo prepareInfo;
-  prepareInfo.set_namespaces(CLONE_NEWNS);
-#endif
+  pids.put(containerId, pid);
 
-  // We accept <environment-var-name>#, where # can be 1-9, saved in array[#].
-  // We also accept <environment-var-name>, saved in array[0].
-  // parsing is "messy" because we don't insist that environment
-  // variable are in any particular order, or grouped by volume #
-  envvararray deviceDriverNames;
-  envvararray volumeNames;
-  envvararray mountOptions;
-  envvararray containerPaths;
-  envvararray dvdcliPaths;
-  envvararray explicitCreates;
-
-  // Iterate through the environment variables,
-  // looking for the ones we need.
-  foreach (const Environment_Variable &variable,
-           executorInfo.command().environment().variables()) {
+  if (!applyIoLimits(containerId)) {
+    return Failure("isolate() failed to apply I/O limits");
+  }
 
-    if (strings::startsWith(variable.name(), VOL_NAME_ENV_VAR_NAME)) {
-      if (!parseEnvVar(variable, VOL_NAME_ENV_VAR_NAME, volumeNames, true)) {
-        return Failure("prepare() failed due to illegal VOL_NAME_ENV_VAR_NAME");
-      }
-    } else if (strings::startsWith(variable.name(), VOL_DRIVER_ENV_VAR_NAME)) {
-      if (!parseEnvVar(
-          variable,
-          VOL_DRIVER_ENV_VAR_NAME,
-          deviceDriverNames,
-          true)) {
-        return Failure("prepare() failed due to illegal VOL_DRIVER_ENV_VAR_NAME");
-      }
-    } else if (strings::startsWith(variable.name(), VOL_OPTS_ENV_VAR_NAME)) {
-      if (!parseEnvVar(variable, VOL_OPTS_ENV_VAR_NAME, mountOptions, true)) {
-        return Failure("prepare() failed due to illegal VOL_OPTS_ENV_VAR_NAME");
-      }
-    } else if (strings::startsWith(variable.name(), VOL_CPATH_ENV_VAR_NAME)) {
-      if (!parseEnvVar(
-          variable,
-          VOL_CPATH_ENV_VAR_NAME,
-          containerPaths,
-          false)) {
-        return Failure("prepare() failed due to illegal VOL_CPATH_ENV_VAR_NAME");
-      }
-    } else if (strings::startsWith(variable.name(), VOL_DVDCLI_ENV_VAR_NAME)) {
-      if (!parseEnvVar(variable, VOL_DVDCLI_ENV_VAR_NAME, dvdcliPaths, false)) {
-        return Failure("prepare() failed due to illegal VOL_DVDCLI_ENV_VAR_NAME");
-      }
-    } else if (strings::startsWith(variable.name(), VOL_EXPLICIT_ENV_VAR_NAME)) {
-      if (!parseEnvVar(variable, VOL_EXPLICIT_ENV_VAR_NAME, explicitCreates, true)) {
-        return Failure("prepare() failed due to illegal VOL_EXPLICIT_ENV_VAR_NAME");
+  foreach (const process::Owned<ExternalMount>& mount,
+           infos.get(containerId)) {
+    if (mount->idmap() && !mount->container_path().empty()) {
+      idmapped.push_back(*mount);
+    }
+  }
+
+  if (idmapped.empty()) {
+    return Nothing();
+  }
+
+  // Blocks on the volumes' filesystems like containerize().
+  return fsWorkers[idleWorker()]->run<Nothing>([=]() -> Try<Nothing> {
+    foreach (const ExternalMount& em, idmapped) {
+      Try<Nothing> mounted = idmapMount(hostPath(em), em.container_path(), pid);
+      if (mounted.isError()) {
+        return Error("isolate() failed: " + mounted.error());
       }
+
+      LOG(INFO) << "Mounted " << em.volumedriver() << "/" << em.volumename()
+                << " idmapped at " << em.container_path()
+                << " for container " << containerId;
     }
+    return Nothing();
+  })
+  .after(fsTimeout, [=](const Future<Nothing>&) -> Future<Nothing> {
+    return Failure("isolate() timed out on an idmapped mount");
+  });
+}
+
+Future<Nothing> DockerVolumeDriverIsolator::cleanup(
+    const ContainerID& containerId)
+{
+  //    1. Get driver name and volume list from infos.
+  //    2. Iterate list and detach the volumes no other container holds.
+
+  {
+    JSON::Object event;
+    event.values["container"] = JSON::String(containerId.value());
+    trace("cleanup", event);
   }
 
-  // requestedExternalMounts is all mounts requested by container.
-  std::vector<process::Owned<ExternalMount>> requestedExternalMounts;
+  // The cgroup, and with it the I/O limits, goes away with the container.
+  allocated.erase(containerId);
+  pids.erase(containerId);
+  throttled.erase(containerId);
+
+  // With defer_attach the container can be destroyed before its mounts
+  // complete. Those already mounted are released here, the others once
+  // their mount returns.
+  attaching.erase(containerId);
+  if (os::exists(bindsDir(containerId))) {
+    os::rmdir(bindsDir(containerId));
+  }
+  if (pending.contains(containerId)) {
+    revertMountlist("container destroy", containerId);
+  }
+
+  if (!infos.contains(containerId)) {
+    return Nothing();
+  }
+
+  list<process::Owned<ExternalMount>> mountsList =
+      infos.get(containerId);
+  // mountList now contains all the mounts used by this container.
 
-  // unconnectedExternalMounts is the subset of those not already
-  // in use by another container.
-  std::vector<process::Owned<ExternalMount>> unconnectedExternalMounts;
+  // Remove all this container's mounts from infos first, so the
+  // remaining holders of each volume can be counted.
+  infos.remove(containerId);
 
-  // prevConnectedExternalMounts is the subset of those that are
-  // in use by another container.
-  std::vector<process::Owned<ExternalMount>> prevConnectedExternalMounts;
+  // Note: it is possible that some of these mounts are
+  // also used by other tasks.
+  foreach(const process::Owned<ExternalMount> &mountFromThisContainer,
+          mountsList) {
+    lastUsed.put(getExternalMountId(*mountFromThisContainer),
+                 process::Clock::now());
 
-  // Not using iterator because we access all 4 arrays using common index.
-  for (size_t i = 0; i < volumeNames.size(); i++) {
+    // Queued on the volume's shard ahead of a detach released below.
+    unpublish(*mountFromThisContainer);
 
-    if (volumeNames[i].empty()) {
-      continue;
+    // The overlay went away with the container's mount namespace.
+    discardOverlay(*mountFromThisContainer);
+    protectOverlayLower(*mountFromThisContainer);
+
+    if (holders(*mountFromThisContainer) == 0) {
+      // This container was the only, or last, user of this mount.
+      // The unmount runs on the volume's shard after cleanup() returns,
+      // so the container's resources are released right away.
+      release(*mountFromThisContainer, "cleanup()");
     }
+  }
+
+  checkpointInfos();
+  checkInvariants("cleanup()");
+
+  return Nothing();
+}
+
+void DockerVolumeDriverIsolator::reconcile()
+{
+  Try<fs::MountInfoTable> table = fs::MountInfoTable::read();
+  if (table.isError()) {
+    LOG(WARNING) << "reconcile() failed to read the host mount table: "
+                 << table.error();
+    return;
+  }
 
-    LOG(INFO) << "Validating mount name " << volumeNames[i];
+  hashset<string> hostMountpoints;
+  foreach (const fs::MountInfoTable::Entry& entry, table.get().entries) {
+    hostMountpoints.insert(entry.target);
+  }
 
-    if (deviceDriverNames[i].empty()) {
-      deviceDriverNames[i] = VOL_DRIVER_DEFAULT;
+  hashset<ExternalMountID> referenced;
+  foreachpair (const ContainerID& containerId,
+               const process::Owned<ExternalMount>& mount,
+               infos) {
+    referenced.insert(getExternalMountId(*mount));
+
+    if (!isHostMounted(hostMountpoints, mount->mountpoint())) {
+      LOG(WARNING) << "reconcile() found " << mount->volumedriver() << "/"
+                   << mount->volumename() << " held by container "
+                   << containerId << " but " << mount->mountpoint()
+                   << " is not in the host mount table";
     }
-    if (dvdcliPaths[i].empty()) {
-      dvdcliPaths[i] = DEFAULT_DVDCLI_BIN;
+  }
+
+  // Volumes being prepared, mounted or detached are busy, not leaked.
+  foreachvalue (const process::Owned<ExternalMount>& mount, pending) {
+    referenced.insert(getExternalMountId(*mount));
+  }
+  foreachkey (const ExternalMountID& id, mounting) {
+    referenced.insert(id);
+  }
+  foreachkey (const ExternalMountID& id, unmounting) {
+    referenced.insert(id);
+  }
+  foreachkey (const ExternalMountID& id, detaching) {
+    referenced.insert(id);
+  }
+
+  // Claimed volumes that no container holds. Volumes mounted by the
+  // Docker containerizer or by hand are never claimed unless one of
+  // our containers adopted them, and a claimed volume that left the
+  // host mount table is no longer ours to unmount.
+  hashmap<ExternalMountID, process::Owned<ExternalMount>> unreferenced;
+  bool forgotten = false;
+  foreach (const ExternalMountID& id, claimed.keys()) {
+    if (referenced.contains(id)) {
+      continue;
     }
-    if (explicitCreates[i].empty()) {
-      explicitCreates[i] = "false";
+
+    const process::Owned<ExternalMount> mount = claimed.at(id);
+    if (mount->mountpoint().empty() ||
+        !isHostMounted(hostMountpoints, mount->mountpoint())) {
+      claimed.erase(id);
+      forgotten = true;
+      continue;
     }
 
-    // TODO consider not filling container path if it is empty.
-    // Empty container path would mean leaving do not engage isolation on mount
-    // resulting in mount exposure across all containers.
-    if (!containerPaths[i].empty()) {
-      if (!strings::startsWith(containerPaths[i], "/")) {
-        return Failure("prepare() failed, containerpaths must start with /");
-      }
-      if (!os::exists(containerPaths[i]) &&
-          !strings::startsWith(containerPaths[i], "/tmp/")) {
-        return Failure(
-          "prepare() failed, containerpaths must pre-exist, or be under /tmp");
-      }
+    unreferenced.put(id, mount);
+  }
+
+  if (forgotten) {
+    checkpointInfos();
+  }
+
+  // Forget volumes that were picked up again or went away on their own.
+  foreach (const ExternalMountID& id, unreferencedSince.keys()) {
+    if (!unreferenced.contains(id)) {
+      unreferencedSince.erase(id);
     }
+  }
 
-    // note: mountpoint is not set yet, because we haven't mounted yet
-    process::Owned<ExternalMount> requestedMount(
-      Builder().setContainerId(stringify(containerId))
-               .setVolumeDriver(deviceDriverNames[i])
-               .setVolumeName(volumeNames[i])
-               .setOptions(mountOptions[i])
-               .setContainerPath(containerPaths[i])
-               .setDvdcliPath(dvdcliPaths[i])
-               .setExplicitCreate(
-                 (strings::lower(strings::trim(explicitCreates[i])).compare("true")==0)
-               )
-               .build()
-      );
-
-    // Check for duplicates in environment.
-    bool duplicateInEnv = false;
-    foreach (const process::Owned<ExternalMount> &mount,
-             requestedExternalMounts) {
+  const process::Time now = process::Clock::now();
+
+  foreachpair (const ExternalMountID& id,
+               const process::Owned<ExternalMount>& mount,
+               unreferenced) {
+    // A draining agent detaches them without waiting, and through the
+    // checkpointed detach path so an interrupted drain picks them up.
+    if (draining) {
+      unreferencedSince.erase(id);
+      release(*mount, "reconcile()-drain");
+      checkpointInfos();
+      continue;
+    }
 
-      if (getExternalMountId(*(mount.get())) ==
-              getExternalMountId(*(requestedMount.get())) ) {
-        duplicateInEnv = true;
-        break;
-      }
+    if (!unreferencedSince.contains(id)) {
+      LOG(WARNING) << "reconcile() found " << mount->volumedriver() << "/"
+                   << mount->volumename() << " mounted at "
+                   << mount->mountpoint() << " but held by no container, "
+                   << "it will be unmounted if still unreferenced after "
+                   << reconcileGracePeriod;
+      unreferencedSince.put(id, now);
+      continue;
     }
 
-    if (duplicateInEnv) {
-      if (!containerPaths[i].empty()) {
-        return Failure("prepare() failed, duplicated mount with containerpath");
-      }
-      LOG(INFO) << "Duplicate mount request("
-                << requestedMount->volumedriver()
-                << "/" << requestedMount->volumename()
-                << ") in environment will be ignored";
+    if (now - unreferencedSince.at(id) < reconcileGracePeriod) {
       continue;
     }
 
-    requestedExternalMounts.push_back(requestedMount);
+    // Registered in unmounting so a prepare() of the same volume waits
+    // for the unmount.
+    Future<Nothing> unmounted = dispatch(
+        shard(*mount),
+        &DockerVolumeDriverShard::unmount,
+        *mount,
+        string("reconcile()"),
+        Option<TunedDevice>::none());
 
-    // Now check if another container is already using this same mount.
-    bool mountInUse = false;
-    foreachvalue (const process::Owned<ExternalMount> &mount, infos) {
+    unmounting.put(id, unmounted);
 
-      if (getExternalMountId(*(mount.get())) ==
-            getExternalMountId(*(requestedMount.get())) ) {
-        mountInUse = true;
-        requestedMount->set_mountpoint(mount->mountpoint());
-        prevConnectedExternalMounts.push_back(requestedMount);
-        LOG(INFO) << "Requested mount(" << requestedMount->volumedriver() << "/"
-                  << requestedMount->volumename()
-                  << ") is already mounted by another container";
-        if (!containerPaths[i].empty()) {
-          return Failure(
-                  "prepare() failed, containerpath request on existing mount");
-        }
-        break;
+    unmounted.onAny(defer(self(), [=](const Future<Nothing>& future) {
+      if (unmounting.contains(id) && unmounting.at(id) == future) {
+        unmounting.erase(id);
       }
-    }
 
-    if (!mountInUse) {
-      unconnectedExternalMounts.push_back(requestedMount);
-      if (!containerPaths[i].empty() &&
-          !os::exists(containerPaths[i])) {
-        Try<Nothing> mkdir = os::mkdir(containerPaths[i]);
-        if (mkdir.isError()) {
-          return Failure(
-            "DockerVolumeDriverIsolator could not create container path dir: " +
-            containerPaths[i]);
-        }
+      // Retried at the next reconcile() otherwise.
+      if (future.isReady()) {
+        unreferencedSince.erase(id);
+        claimed.erase(id);
+        checkpointInfos();
       }
-    }
-
+    }));
   }
+}
 
-  // As we connect mounts we will build a list of successful mounts.
-  // We need this because, if there is a failure, we need to unmount these.
-  // The goal is we mount either ALL or NONE.
-  std::vector<process::Owned<ExternalMount>> successfulExternalMounts;
-  foreach (const process::Owned<ExternalMount> &newMount,
-           unconnectedExternalMounts) {
-    string mountpoint = mount(*newMount, "prepare()");
+Future<string> DockerVolumeDriverShard::mount(const ExternalMount& em)
+{
+  const process::Time started = Clock::now();
+  string mountpoint = isolator->mount(em, "prepare()");
 
-    if (!mountpoint.empty()) {
-      // Need to construct a newExternalMount because we just
-      // learned the mountpoint.
-      newMount->set_mountpoint(mountpoint);
-      successfulExternalMounts.push_back(newMount);
-    } else {
-      // Once any mount attempt fails, give up on whole list
-      // and attempt to undo the mounts we already made.
-      return revertMountlist("mount",successfulExternalMounts);
-    }
+  {
+    JSON::Object event;
+    event.values["command"] = JSON::String("mount");
+    event.values["driver"] = JSON::String(em.volumedriver());
+    event.values["volume"] = JSON::String(em.volumename());
+    event.values["latency"] = JSON::Number((Clock::now() - started).secs());
+    event.values["ok"] = JSON::Boolean(!mountpoint.empty());
+    DockerVolumeDriverIsolator::trace("driver", event);
   }
 
-  foreach (const process::Owned<ExternalMount> &prevMount,
-           prevConnectedExternalMounts) {
+  dispatch(PID<DockerVolumeDriverIsolator>(isolator),
+           &DockerVolumeDriverIsolator::invalidateCatalog,
+           em);
 
-    LOG(INFO) << "mount " << prevMount->mountpoint()
-              << " was previously connected";
-    // Note: infos has a record for each mount associated with this container
-    // even if the mount is also used by another container.
-    infos.put(containerId, prevMount);
+  if (mountpoint.empty()) {
+    return Failure("prepare() failed during mount attempt");
   }
 
-  foreach (const process::Owned<ExternalMount> &newMount,
-         successfulExternalMounts) {
-    infos.put(containerId, newMount);
+  // An uncached volume is still usable, just slower.
+  if (em.cache()) {
+    Try<Nothing> cached = isolator->attachCache(em, mountpoint);
+    if (cached.isError()) {
+      LOG(WARNING) << em.volumedriver() << "/" << em.volumename()
+                   << " is mounted without a cache: " << cached.error();
+    }
+  }
 
-    if (newMount->container_path().empty()) {
-      continue; // empty container path means skip containerization
+  if (!em.tuning().empty()) {
+    Option<TunedDevice> tuned = isolator->tune(em, mountpoint);
+    // Recorded before the isolator sees the mountpoint returned below.
+    if (tuned.isSome()) {
+      dispatch(PID<DockerVolumeDriverIsolator>(isolator),
+               &DockerVolumeDriverIsolator::recordTuning,
+               em,
+               tuned.get());
     }
+  }
 
-    string containerPath = newMount->container_path();
-    string mountPoint = newMount->mountpoint();
+  return mountpoint;
+}
 
-    // Set the ownership and permissions to match the container path
-    // as these are inherited from host path on bind mount.
-    struct stat stat;
-    if (::stat(containerPath.c_str(), &stat) < 0) {
-      LOG(ERROR) << "Failed to get permissions on " << containerPath
-                 << " stat returned " << strerror(errno);
-      return revertMountlist("stat",successfulExternalMounts);
-    }
+Future<Nothing> DockerVolumeDriverShard::unmount(
+    const ExternalMount& em,
+    const string&   callerLabelForLogging,
+    const Option<TunedDevice>& tuned)
+{
+  // The disk may go away with the unmount, so restore it first.
+  if (tuned.isSome()) {
+    isolator->restoreTuning(tuned.get());
+  }
 
-    Try<Nothing> chmod = os::chmod(mountPoint, stat.st_mode);
-    if (chmod.isError()) {
-      LOG(ERROR) << "Failed to get permissions on " << containerPath
-                 << " chmod returned " << chmod.error();
-      return revertMountlist("chmod",successfulExternalMounts);
-    }
+  // The cache is checked for every volume, em.cache() is not recorded
+  // for orphans left behind by a reconciler or an older version.
+  Try<Nothing> uncached = isolator->detachCache(em);
+  if (uncached.isError()) {
+    return Failure(callerLabelForLogging + " failed to remove the cache of " +
+                   em.volumedriver() + "/" + em.volumename() + ": " +
+                   uncached.error());
+  }
 
-    Try<Nothing> chown = os::chown(stat.st_uid, stat.st_gid, mountPoint, false);
-    if (chown.isError()) {
-      LOG(ERROR) << "Failed to get permissions on " << containerPath
-                 << " chown returned " << chown.error();
-      return revertMountlist("chown",successfulExternalMounts);
-    }
+  const process::Time started = Clock::now();
+  const bool unmounted = isolator->unmount(em, callerLabelForLogging);
 
-    LOG(INFO) << "queueing mount -n --rbind " << mountPoint
-              << " " << containerPath;
+  {
+    JSON::Object event;
+    event.values["command"] = JSON::String("unmount");
+    event.values["driver"] = JSON::String(em.volumedriver());
+    event.values["volume"] = JSON::String(em.volumename());
+    event.values["latency"] = JSON::Number((Clock::now() - started).secs());
+    event.values["ok"] = JSON::Boolean(unmounted);
+    DockerVolumeDriverIsolator::trace("driver", event);
+  }
 
-#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
-    // -n means don't write to /etc/mtab
-    commands.push_back(
-            "mount -n --rbind " + mountPoint + " " + containerPath);
-#elif MESOS_VERSION_INT <= 200
-    prepareInfo.add_pre_exec_commands()->set_value(
-        "mount -n --rbind " + mountPoint + " " + containerPath);
-#else
-    prepareInfo.add_commands()->set_value(
-            "mount -n --rbind " + mountPoint + " " + containerPath);
-#endif
+  dispatch(PID<DockerVolumeDriverIsolator>(isolator),
+           &DockerVolumeDriverIsolator::invalidateCatalog,
+           em);
+
+  if (!unmounted) {
+    return Failure(callerLabelForLogging + " failed during unmount attempt");
   }
+  return Nothing();
+}
 
-  // Create ExternalMountList protobuf message to checkpoint
-  ExternalMountList inUseMountsProtobuf;
-  foreachvalue( const process::Owned<ExternalMount> &mount, infos) {
-    ExternalMount* mountptr = inUseMountsProtobuf.add_mount();
-    mountptr->CopyFrom(*(mount.get()));
+Future<Nothing> DockerVolumeDriverShard::unpublish(const ExternalMount& em)
+{
+  if (!isolator->unpublishCsi(em)) {
+    return Failure("Failed to unpublish " + em.volumename() +
+                   " for container " + em.containerid());
   }
-  mesos::internal::slave::state::checkpoint(mountPbFilename,
-    inUseMountsProtobuf);
+  return Nothing();
+}
 
-#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
-  CommandInfo command;
-  command.set_value(strings::join(" && ", commands));
+Future<Nothing> DockerVolumeDriverShard::publish(const ExternalMount& em)
+{
+  Try<Nothing> publish = isolator->publishCsi(em);
+  if (publish.isError()) {
+    LOG(ERROR) << "Failed to publish CSI volume " << em.volumename()
+               << " to " << isolator->csiTargetPath(em) << ": "
+               << publish.error();
+    return Failure("prepare() failed during publish attempt");
+  }
+  return Nothing();
+}
 
-  return command;
-#else
-  return prepareInfo;
-#endif
+DockerVolumeDriverFsWorker::DockerVolumeDriverFsWorker(
+    const Duration& _stopTimeout)
+  : stopTimeout(_stopTimeout),
+    state(new State())
+{
+  thread = std::thread(&DockerVolumeDriverFsWorker::loop, state);
 }
 
-#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
-Future<Limitation> DockerVolumeDriverIsolator::watch(
-    const ContainerID& containerId)
+DockerVolumeDriverFsWorker::~DockerVolumeDriverFsWorker()
 {
-  // No-op, for now.
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->stopping = true;
+  state->wakeup.notify_one();
+
+  // A call stuck on a dead mount must not hang the agent's shutdown.
+  const bool drained = state->idle.wait_for(
+      lock,
+      std::chrono::nanoseconds(stopTimeout.ns()),
+      [this]() { return state->calls.empty() && !state->running; });
+
+  if (!drained) {
+    LOG(WARNING) << "Leaving a filesystem worker stuck for more than "
+                 << stopTimeout << " behind, dropping its "
+                 << state->calls.size() << " queued calls";
+    state->calls.clear();
+    lock.unlock();
+    thread.detach();
+    return;
+  }
 
-  return Future<Limitation>();
+  lock.unlock();
+  thread.join();
 }
-#else
-Future<ContainerLimitation> DockerVolumeDriverIsolator::watch(
-    const ContainerID& containerId)
+
+void DockerVolumeDriverFsWorker::post(const std::function<void()>& call)
 {
-  // No-op, for now.
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->calls.push_back(call);
+  }
+  state->wakeup.notify_one();
+}
 
-  return Future<ContainerLimitation>();
+size_t DockerVolumeDriverFsWorker::load() const
+{
+  std::lock_guard<std::mutex> lock(state->mutex);
+  return state->calls.size() + (state->running ? 1 : 0);
 }
-#endif
 
-Future<Nothing> DockerVolumeDriverIsolator::update(
-    const ContainerID& containerId,
-    const Resources& resources)
+void DockerVolumeDriverFsWorker::loop(std::shared_ptr<State> state)
 {
-  // No-op, nothing enforced.
+  std::unique_lock<std::mutex> lock(state->mutex);
+  while (true) {
+    state->wakeup.wait(lock, [&state]() {
+      return state->stopping || !state->calls.empty();
+    });
+    if (state->calls.empty()) {
+      return;
+    }
 
-  return Nothing();
+    std::function<void()> call = state->calls.front();
+    state->calls.pop_front();
+    state->running = true;
+
+    lock.unlock();
+    call();
+    call = nullptr;
+    lock.lock();
+
+    state->running = false;
+    state->idle.notify_all();
+  }
+}
+
+void DockerVolumeDriverReconciler::initialize()
+{
+  delay(interval, self(), &DockerVolumeDriverReconciler::reconcile);
 }
 
+void DockerVolumeDriverReconciler::reconcile()
+{
+  dispatch(PID<DockerVolumeDriverIsolator>(isolator),
+           &DockerVolumeDriverIsolator::reconcile);
 
-Future<ResourceStatistics> DockerVolumeDriverIsolator::usage(
-    const ContainerID& containerId)
+  delay(interval, self(), &DockerVolumeDriverReconciler::reconcile);
+}
+
+void DockerVolumeDriverDetacher::initialize()
 {
-  // No-op, no usage gathered.
+  delay(interval, self(), &DockerVolumeDriverDetacher::retry);
+}
 
-  return ResourceStatistics();
+void DockerVolumeDriverDetacher::retry()
+{
+  dispatch(PID<DockerVolumeDriverIsolator>(isolator),
+           &DockerVolumeDriverIsolator::retryDetaches);
+
+  delay(interval, self(), &DockerVolumeDriverDetacher::retry);
 }
 
-Future<Nothing> DockerVolumeDriverIsolator::isolate(
-    const ContainerID& containerId,
-    pid_t pid)
+void DockerVolumeDriverDetacher::detachOrphans()
 {
-  // No-op, isolation happens when mounting/unmounting in prepare/cleanup
-  return Nothing();
+  dispatch(PID<DockerVolumeDriverIsolator>(isolator),
+           &DockerVolumeDriverIsolator::detachOrphans);
 }
 
-Future<Nothing> DockerVolumeDriverIsolator::cleanup(
-    const ContainerID& containerId)
+void DockerVolumeDriverEndpoints::initialize()
 {
-  //    1. Get driver name and volume list from infos.
-  //    2. Iterate list and perform unmounts.
+  route(INVENTORY_ENDPOINT, None(), &DockerVolumeDriverEndpoints::volumes);
 
-  if (!infos.contains(containerId)) {
-    return Nothing();
+  // Anyone who can reach the agent could otherwise stop it from
+  // launching tasks and detach its volumes.
+  if (drainEnabled) {
+    route(DRAIN_ENDPOINT, None(), &DockerVolumeDriverEndpoints::drain);
   }
+}
 
-  list<process::Owned<ExternalMount>> mountsList =
-      infos.get(containerId);
-  // mountList now contains all the mounts used by this container.
+static http::Response ok(const JSON::Object& object)
+{
+  return http::OK(object);
+}
 
-  // Note: it is possible that some of these mounts are
-  // also used by other tasks.
-  foreach(const process::Owned<ExternalMount> &mountFromThisContainer,
-          mountsList) {
-    size_t mountCount = 0;
+Future<http::Response> DockerVolumeDriverEndpoints::drain(
+    const http::Request& request)
+{
+  const PID<DockerVolumeDriverIsolator> pid(isolator);
+
+  if (request.method == "POST") {
+    return dispatch(pid, &DockerVolumeDriverIsolator::drain).then(&ok);
+  } else if (request.method == "DELETE") {
+    return dispatch(pid, &DockerVolumeDriverIsolator::resume).then(&ok);
+  } else if (request.method == "GET") {
+    return dispatch(pid, &DockerVolumeDriverIsolator::drainStatus).then(&ok);
+  }
 
-    foreachvalue (const process::Owned<ExternalMount> &mount, infos) {
-      // elem.second is ExternalMount.
+  return http::BadRequest("Expecting a GET, POST or DELETE request\n");
+}
 
-      if (getExternalMountId(*mountFromThisContainer) ==
-              getExternalMountId(*(mount.get()))) {
-        if( ++mountCount > 1) {
-          break; // As soon as we find two users we can quit.
-        }
-      }
-    }
+Future<http::Response> DockerVolumeDriverEndpoints::volumes(
+    const http::Request& request)
+{
+  if (request.method != "GET") {
+    return http::BadRequest("Expecting a GET request\n");
+  }
 
-    if (1 == mountCount) {
-      // This container was the only, or last, user of this mount.
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 270
+  const Option<string> since = request.query.get("since");
+#else
+  const Option<string> since = request.url.query.get("since");
+#endif
 
-      if (!unmount(*mountFromThisContainer, "cleanup()")) {
-        return Failure("cleanup() failed during unmount attempt");
-      }
-    }
-  }
+  return dispatch(PID<DockerVolumeDriverIsolator>(isolator),
+                  &DockerVolumeDriverIsolator::inventory,
+                  since)
+    .then(&ok);
+}
 
-  // Remove all this container's mounts from infos.
-  infos.remove(containerId);
+void DockerVolumeDriverProber::initialize()
+{
+  probe();
+}
 
-  // Create ExternalMountList protobuf message to checkpoint
-  ExternalMountList inUseMountsProtobuf;
-  foreachvalue( const process::Owned<ExternalMount> &mount, infos) {
-    ExternalMount* mountptr = inUseMountsProtobuf.add_mount();
-    mountptr->CopyFrom(*(mount.get()));
-  }
-  mesos::internal::slave::state::checkpoint(mountPbFilename,
-    inUseMountsProtobuf);
+void DockerVolumeDriverProber::probe()
+{
+  isolator->probeDrivers();
 
-  return Nothing();
+  delay(interval, self(), &DockerVolumeDriverProber::probe);
+}
+
+void DockerVolumeDriverCataloger::initialize()
+{
+  refresh();
+}
+
+void DockerVolumeDriverCataloger::refresh()
+{
+  isolator->refreshCatalogs();
+
+  delay(interval, self(), &DockerVolumeDriverCataloger::refresh);
 }
 
 static Isolator* createDockerVolumeDriverIsolator(const Parameters& parameters)
@@ -19,22 +19,42 @@
 
 #ifndef SRC_DOCKER_VOLUME_DRIVER_ISOLATOR_HPP_
 #define SRC_DOCKER_VOLUME_DRIVER_ISOLATOR_HPP_
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <boost/functional/hash.hpp>
 #include <boost/algorithm/string.hpp>
 #include <mesos/mesos.hpp>
 
 #include <process/future.hpp>
+#include <process/http.hpp>
+#include <process/id.hpp>
+#include <process/metrics/gauge.hpp>
 #include <process/owned.hpp>
 #include <process/process.hpp>
+#include <process/time.hpp>
 
+#include <stout/duration.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/json.hpp>
 #include <stout/multihashmap.hpp>
 #include <stout/protobuf.hpp>
 #include <stout/try.hpp>
 
 #include <slave/flags.hpp>
 #include <mesos/slave/isolator.hpp>
+#if MESOS_VERSION_INT >= 240 && MESOS_VERSION_INT < 280
+#include <slave/containerizer/isolator.hpp>
+#elif MESOS_VERSION_INT < 200 || MESOS_VERSION_INT >= 280
+#include <slave/containerizer/mesos/isolator.hpp>
+#endif
 
+#include "dvdi_core.hpp"
 #include "interface.hpp"
 using namespace emccode::isolator::mount;
 
@@ -42,32 +62,111 @@ using namespace emccode::isolator::mount;
 namespace mesos {
 namespace slave {
 
+using namespace dvdi;
+
 static constexpr char DVDI_MOUNTLIST_PATH[]       = "/var/run/mesos/isolators/mesos-module-dvdi/";
 static constexpr char REXRAY_MOUNT_PREFIX[]       = "/var/lib/rexray/volumes/";
-static constexpr char DVDCLI_MOUNT_CMD[]          = "mount";
-static constexpr char DVDCLI_UNMOUNT_CMD[]        = "unmount";
+// CSI volumes are staged once per node and published for each container,
+// through the csc command line client of the node plugin's gRPC socket.
+static constexpr char DEFAULT_CSC_BIN[]           = "/usr/bin/csc";
+static constexpr char CSI_ACCESS_MODE[]           = "SINGLE_NODE_WRITER";
 
-static constexpr char VOL_NAME_CMD_OPTION[]       = "--volumename=";
-static constexpr char VOL_DRIVER_CMD_OPTION[]     = "--volumedriver=";
-static constexpr char VOL_OPTS_CMD_OPTION[]       = "--volumeopts=";
-static constexpr char VOL_DRIVER_DEFAULT[]        = "rexray";
+// Scalar resources that limit the I/O of a container to each of its
+// volumes that does not set DVDI_VOLUME_IOPS/DVDI_VOLUME_BPS itself.
+static constexpr char IOPS_RESOURCE_NAME[]        = "dvdi_iops";
+static constexpr char BPS_RESOURCE_NAME[]         = "dvdi_bps";
+static constexpr char CGROUP_ROOT[]               = "/sys/fs/cgroup";
 
-static constexpr char VOL_NAME_ENV_VAR_NAME[]     = "DVDI_VOLUME_NAME";
-static constexpr char VOL_DRIVER_ENV_VAR_NAME[]   = "DVDI_VOLUME_DRIVER";
-static constexpr char VOL_OPTS_ENV_VAR_NAME[]     = "DVDI_VOLUME_OPTS";
-static constexpr char VOL_CPATH_ENV_VAR_NAME[]    = "DVDI_VOLUME_CONTAINERPATH";
-static constexpr char VOL_DVDCLI_ENV_VAR_NAME[]   = "DVDI_VOLUME_DVDCLI";
-static constexpr char VOL_EXPLICIT_ENV_VAR_NAME[]  = "DVDI_VOLUME_EXPLICITCREATE";
+static constexpr char XFS_QUOTA_BIN[]             = "/usr/sbin/xfs_quota";
 
 static constexpr char DVDI_MOUNTLIST_FILENAME[]   = "dvdimounts.pb";
+// Below the state_dir, holds the bind mount sources of containers
+// whose prepare() returned before their volumes were mounted.
+static constexpr char DVDI_BINDS_DIRNAME[]        = "binds";
+// Below the state_dir, holds the staging and publish target paths
+// of CSI volumes.
+static constexpr char DVDI_CSI_DIRNAME[]          = "csi";
+// Below a container's sandbox, holds the upper and work directories of
+// its overlays on volumes with DVDI_VOLUME_OVERLAY.
+static constexpr char DVDI_OVERLAYS_DIRNAME[]     = ".dvdi-overlays";
 static constexpr char DVDI_WORKDIR_PARAM_NAME[]   = "work_dir";
 static constexpr char DEFAULT_WORKING_DIR[]       = "/tmp/mesos";
-static constexpr char DEFAULT_DVDCLI_BIN[]        = "/usr/bin/dvdcli";
+// Holds the checkpoint, defaults to DVDI_MOUNTLIST_PATH.
+static constexpr char STATE_DIR_PARAM_NAME[]      = "state_dir";
+
+static constexpr char RECONCILE_INTERVAL_PARAM_NAME[] = "reconcile_interval";
+static constexpr char RECONCILE_GRACE_PARAM_NAME[]    = "reconcile_grace_period";
+static constexpr char RECONCILE_ROOTS_PARAM_NAME[]    = "reconcile_mount_roots";
+static constexpr char DEFAULT_RECONCILE_GRACE[]       = "10mins";
+static constexpr char VERIFY_INVARIANTS_PARAM_NAME[]  = "verify_invariants";
+static constexpr char VOLUME_SHARDS_PARAM_NAME[]      = "volume_shards";
+static constexpr size_t DEFAULT_VOLUME_SHARDS         = 4;
+static constexpr char FS_WORKERS_PARAM_NAME[]         = "fs_workers";
+static constexpr size_t DEFAULT_FS_WORKERS            = 4;
+static constexpr char FS_TIMEOUT_PARAM_NAME[]         = "fs_timeout";
+static constexpr char DEFAULT_FS_TIMEOUT[]            = "30secs";
+static constexpr char PROBE_INTERVAL_PARAM_NAME[]     = "driver_probe_interval";
+static constexpr char PROBE_TIMEOUT_PARAM_NAME[]      = "driver_probe_timeout";
+static constexpr char DEFAULT_PROBE_TIMEOUT[]         = "30secs";
+static constexpr char PROBE_DRIVERS_PARAM_NAME[]      = "driver_probe_drivers";
+static constexpr char PROBE_VOLUME_PARAM_NAME[]       = "driver_probe_volume";
+static constexpr char DEFAULT_PROBE_VOLUME[]          = "dvdi-probe";
+// driver_probe_dvdcli.<driver> is the dvdcli binary probing <driver>.
+static constexpr char PROBE_DVDCLI_PARAM_PREFIX[]     = "driver_probe_dvdcli.";
+static constexpr char INVENTORY_FILE_PARAM_NAME[]     = "inventory_file";
+// volume_catalog.<driver> is the command listing the volumes of <driver>.
+static constexpr char CATALOG_PARAM_PREFIX[]          = "volume_catalog.";
+static constexpr char CATALOG_INTERVAL_PARAM_NAME[]   = "volume_catalog_interval";
+static constexpr char DEFAULT_CATALOG_INTERVAL[]      = "30secs";
+static constexpr char CATALOG_TTL_PARAM_NAME[]        = "volume_catalog_ttl";
+static constexpr char DEFAULT_CATALOG_TTL[]           = "2mins";
+// Attachment states reported by catalog commands.
+static constexpr char CATALOG_ATTACHED[]              = "attached";
+static constexpr char CATALOG_AVAILABLE[]             = "available";
+static constexpr char CATALOG_UNAVAILABLE[]           = "unavailable";
+static constexpr char TRACE_FILE_PARAM_NAME[]         = "trace_file";
+// Endpoints are served at /<ENDPOINTS_PROCESS_ID>/<endpoint>.
+static constexpr char ENDPOINTS_PROCESS_ID[]          = "dvdi";
+static constexpr char INVENTORY_ENDPOINT[]            = "/volumes";
+static constexpr char DRAIN_ENDPOINT[]                = "/drain";
+static constexpr char DRAIN_ENDPOINT_PARAM_NAME[]     = "drain_endpoint";
+static constexpr char DEFER_ATTACH_PARAM_NAME[]       = "defer_attach";
+static constexpr char ATTACH_SLOTS_PARAM_NAME[]       = "attach_slots";
+static constexpr char ATTACH_SLOTS_FREE_METRIC[]      = "dvdi/attach_slots_free";
+static constexpr char DETACH_RETRY_PARAM_NAME[]       = "detach_retry_interval";
+static constexpr char DEFAULT_DETACH_RETRY[]          = "30secs";
+static constexpr char ORPHAN_DETACH_DELAY_PARAM_NAME[] = "orphan_detach_delay";
+static constexpr char DEFAULT_ORPHAN_DETACH_DELAY[]   = "1mins";
+// tuning_profile.<name> defines the tuning profile <name>.
+static constexpr char TUNING_PROFILE_PARAM_PREFIX[]   = "tuning_profile.";
+static constexpr char SNAPSHOT_OPTION_PARAM_NAME[]    = "snapshot_volume_option";
+static constexpr char DEFAULT_SNAPSHOT_OPTION[]       = "snapshot";
+static constexpr char CSC_PATH_PARAM_NAME[]           = "csc_path";
+static constexpr char CSI_FS_TYPE_PARAM_NAME[]        = "csi_fs_type";
+static constexpr char DEFAULT_CSI_FS_TYPE[]           = "ext4";
+static constexpr char LOCAL_POOL_PARAM_NAME[]         = "local_pool";
+static constexpr char CACHE_POOL_PARAM_NAME[]         = "cache_pool";
+static constexpr char CACHE_SIZE_PARAM_NAME[]         = "cache_size";
+static constexpr char DEFAULT_CACHE_SIZE[]            = "10GB";
+static constexpr char CACHE_DEVICE_PREFIX[]           = "dvdi-cache-";
 
+class DockerVolumeDriverCataloger;
+class DockerVolumeDriverDetacher;
+class DockerVolumeDriverEndpoints;
+class DockerVolumeDriverFsWorker;
+class DockerVolumeDriverProber;
+class DockerVolumeDriverReconciler;
+class DockerVolumeDriverShard;
+
+// The isolator is an actor, wrapped by create() in the Isolator the
+// agent calls, which dispatches every call to it. All of its volume state
+// is only touched on this actor: future callbacks are deferred to it, and
+// the shards and periodic actors dispatch to it.
 #if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
 class DockerVolumeDriverIsolator: public mesos::slave::IsolatorProcess
 #else
-class DockerVolumeDriverIsolator: public mesos::slave::Isolator
+class DockerVolumeDriverIsolator
+  : public mesos::internal::slave::MesosIsolatorProcess
 #endif
 {
 public:
@@ -75,6 +174,12 @@ public:
 
   virtual ~DockerVolumeDriverIsolator();
 
+#if MESOS_VERSION_INT >= 110 && MESOS_VERSION_INT < 200
+  // The containers of a task group (pod) are nested in the executor's
+  // container, and get their volumes from their own task.
+  virtual bool supportsNesting() { return true; }
+#endif
+
   // Slave recovery is a feature of Mesos that allows task/executors
   // to keep running if a slave process goes down, AND
   // allows the slave process to reconnect with already running
@@ -124,7 +229,8 @@ public:
     const ContainerConfig& containerConfig);
 #endif
 
-  // Nothing will be done at task start
+  // Applies the I/O limits of the container's volumes to its cgroup.
+  // With defer_attach, first waits for the mounts started by prepare().
   virtual process::Future<Nothing> isolate(
     const ContainerID& containerId,
       pid_t pid);
@@ -138,7 +244,7 @@ public:
     const ContainerID& containerId);
 #endif
 
-  // no-op, nothing enforced
+  // Re-applies the I/O limits derived from the new resources
   virtual process::Future<Nothing> update(
     const ContainerID& containerId,
     const Resources& resources);
@@ -150,27 +256,93 @@ public:
   // will (possibly) unmount here
   // 1. Get mount root path by looking up based on ContainerId
   // 2. Start counting tasks using this same mount. Quit counted after count == 2
-  // 3. If count was exactly 1, Unmount the volume
-  //     dvdcli unmount defined in DVDCLI_UNMOUNT_CMD below
+  // 3. If count was exactly 1, move the volume to detaching
+  //     and checkpoint it, the dvdcli unmount (DVDCLI_UNMOUNT_CMD below)
+  //     runs in the background without delaying the container teardown
   // 4. Remove the listing for this task's mount from hashmap
   virtual process::Future<Nothing> cleanup(
     const ContainerID& containerId);
 
+  // Compares infos with the host mount table, reports drift and unmounts
+  // volumes below a reconcile root that no live container holds once they
+  // have been unreferenced for longer than the grace period.
+  // Called periodically by DockerVolumeDriverReconciler.
+  void reconcile();
+
+  // Restarts the unmount of every detaching volume whose previous
+  // attempt failed. Called periodically by DockerVolumeDriverDetacher.
+  void retryDetaches();
+
+  // Starts unmounting the orphans left by recover() that no task has
+  // reclaimed. Called by DockerVolumeDriverDetacher orphanDetachDelay
+  // after recover(), or right away by drain().
+  void detachOrphans();
+
+  // Asks every probed driver for the path of the probe volume, which also
+  // warms up its session, and has recordProbe() note which drivers did
+  // not answer. Runs on DockerVolumeDriverProber, right after the module
+  // is loaded and then periodically.
+  void probeDrivers();
+
+  // Runs the catalog command of every driver that has one and has
+  // recordCatalog() replace its catalog with the volumes listed. A
+  // catalog that could not be read is kept, and ignored by prepare() once
+  // older than catalogTtl. Runs on DockerVolumeDriverCataloger, right
+  // after the module is loaded and then periodically.
+  void refreshCatalogs();
+
+  // Returns the volumes attached to the agent, see volumesJson(). If since
+  // is the current generation, only the generation is returned, so that
+  // pollers can tell cheaply that nothing changed.
+  JSON::Object inventory(const Option<std::string>& since);
+
+  // Puts the agent into drain mode: prepare() is rejected, and every
+  // volume no container holds is detached right away. Volumes held by
+  // containers are detached by their cleanup() as usual. Calling it again
+  // retries the detaches that failed. Returns drainStatus().
+  JSON::Object drain();
+
+  // Leaves drain mode, returns drainStatus().
+  JSON::Object resume();
+
+  // Reports whether the agent is draining and how many volumes are still
+  // held, detaching, waiting for a retry or leaked.
+  JSON::Object drainStatus();
+
+  // When verifyInvariants is set, checks that infos is self-consistent,
+  // matches the checkpoint file and the host mount table, and logs every
+  // violation found. Returns the number of violations. Intended for
+  // stress and fault-injection runs, see dvdi-stress.
+  size_t checkInvariants(const std::string& callerLabelForLogging);
+
+  // Parses the parameters like create(), but returns the actor itself,
+  // for dvdi-stress to dispatch checkInvariants() and drainStatus() to.
+  // It is not spawned, see create().
+  static Try<DockerVolumeDriverIsolator*> createProcess(
+      const Parameters& parameters);
+
+protected:
+  virtual void initialize();
+
 private:
+  friend class DockerVolumeDriverShard;
+
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
+  using PrepareResult = Option<CommandInfo>;
+#elif MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 270
+  using PrepareResult = Option<ContainerPrepareInfo>;
+#else
+  using PrepareResult = Option<ContainerLaunchInfo>;
+#endif
 
   DockerVolumeDriverIsolator(const Parameters& parameters);
 
   const Parameters parameters;
 
-  using ExternalMountID = size_t;
+  using ExternalMountID = VolumeID;
 
-  ExternalMountID getExternalMountId(ExternalMount& em) const {
-    size_t seed = 0;
-    std::string s1(boost::to_lower_copy(em.volumedriver()));
-    std::string s2(boost::to_lower_copy(em.volumename()));
-    boost::hash_combine(seed, s1);
-    boost::hash_combine(seed, s2);
-    return seed;
+  ExternalMountID getExternalMountId(const ExternalMount& em) const {
+    return volumeId(em);
   }
 
   // Attempts to unmount specified external mount, returns true on success
@@ -184,43 +356,678 @@ private:
     const ExternalMount& em,
     const std::string&   callerLabelForLogging) const;
 
-  // Returns true if string contains at least one prohibited character
-  // as defined in the list below.
-  // This is intended as a tool to detect injection attack attempts.
-  bool containsProhibitedChars(const std::string& s) const;
+  // Applies the XFS project quota requested for a subpath mount to the
+  // subpath directory, returns true on success
+  bool applySubpathQuota(
+    const ExternalMount& em,
+    const std::string&   subpathDir) const;
+
+  // Limits dir to quota (e.g. 10GB) with an XFS project quota on the
+  // filesystem mounted at filesystem, returns true on success
+  bool applyProjectQuota(
+    const std::string&   quota,
+    const std::string&   dir,
+    const std::string&   filesystem,
+    uint32_t             projectId) const;
+
+  // mount() and unmount() of LOCAL_VOLUME_DRIVER volumes. The size=
+  // volume option becomes a project quota on the volume directory.
+  // A new volume with from_snapshot starts as a copy of the directory
+  // of that name in the local pool.
+  std::string mountLocal(const ExternalMount& em) const;
+  bool unmountLocal(const ExternalMount& em) const;
+
+  // Returns the directory of the given name in the local pool. Fails
+  // unless it resolves to a directory directly below the pool, so a
+  // name or symlink cannot point mountLocal() or unmountLocal() at the
+  // pool itself or outside of it.
+  static Try<std::string> localPoolDir(const std::string& name);
+
+  // mount() and unmount() of CSI volumes: NodeStageVolume at, and
+  // NodeUnstageVolume of, the volume's staging path. unstageCsi() first
+  // unpublishes the targets of containers that were not cleaned up.
+  std::string stageCsi(const ExternalMount& em) const;
+  bool unstageCsi(const ExternalMount& em) const;
+
+  // NodePublishVolume and NodeUnpublishVolume of the container's own
+  // target path of a staged CSI volume.
+  Try<Nothing> publishCsi(const ExternalMount& em) const;
+  bool unpublishCsi(const ExternalMount& em) const;
+
+  // Unpublishes the container's target of a CSI volume on its shard,
+  // ahead of any unmount of the volume. No-op for other volumes.
+  void unpublish(const ExternalMount& em);
+
+  // Removes the upper and work directories of the container's overlay on
+  // its overlayWorker(). No-op for volumes without an overlay.
+  void discardOverlay(const ExternalMount& em);
+
+  // Staging path of a CSI volume, and target path of the container
+  // that em belongs to. Both include a hash of the plugin's endpoint.
+  static std::string csiStagingPath(const ExternalMount& em);
+  static std::string csiTargetPath(const ExternalMount& em);
+
+  // A volume as listed by the catalog command of its driver.
+  struct CatalogEntry
+  {
+    Option<Bytes> size;
+    std::string attachment;
+  };
+
+  // The volumes of a driver, keyed by lower case name, as of refreshed.
+  // changed holds the volumes this agent mounted or unmounted since,
+  // whose entries are out of date until the next refresh.
+  struct VolumeCatalog
+  {
+    process::Time refreshed;
+    hashmap<std::string, CatalogEntry> volumes;
+    hashmap<std::string, process::Time> changed;
+  };
+
+  // Parses the JSON array printed by a catalog command.
+  static Try<hashmap<std::string, CatalogEntry>> parseCatalog(
+    const std::string& output);
+
+  // Returns why the driver's catalog rules out mounting the volume: it
+  // does not exist and is not to be created, or it is attached to
+  // another node. None if the catalog allows it or cannot tell, because
+  // it is missing, expired, or the volume was changed by this agent.
+  Option<std::string> catalogRejection(const ExternalMount& em) const;
+
+  // Marks the volume as changed in the catalog of its driver after this
+  // agent mounted or unmounted it.
+  void invalidateCatalog(const ExternalMount& em);
+
+  // Records the outcome of the probe of a driver, None if it answered.
+  void recordProbe(
+      const std::string& driver,
+      const Option<std::string>& failure);
+
+  // Replaces the catalog of a driver with the volumes its catalog
+  // command listed after started.
+  void recordCatalog(
+      const std::string& driver,
+      const process::Time& started,
+      const hashmap<std::string, CatalogEntry>& volumes);
+
+  // Block device queue attributes and per-mount options applied to the
+  // volumes that name the profile in DVDI_VOLUME_TUNING.
+  struct TuningProfile
+  {
+    Option<std::string> readAheadKb;
+    Option<std::string> scheduler;
+    Option<std::string> nrRequests;
+    Option<std::string> mountOptions;
+  };
+
+  // Parses <attribute>=<value>;... as read from a tuning_profile parameter.
+  static Try<TuningProfile> parseTuningProfile(const std::string& value);
+
+  // Applies the tuning profile of the volume mounted at mountpoint.
+  // Returns the original queue attributes of its disk, if any were changed.
+  // Failures are logged, tuning never fails the mount.
+  Option<TunedDevice> tune(
+    const ExternalMount& em,
+    const std::string&   mountpoint) const;
+
+  // Writes back the original queue attributes saved by tune().
+  void restoreTuning(const TunedDevice& tuned) const;
+
+  // Remembers the original queue attributes of a tuned volume until it
+  // is detached.
+  void recordTuning(const ExternalMount& em, const TunedDevice& tuned);
+
+  // Puts a writethrough dm-cache device, with metadata and cache blocks in
+  // loop devices backed by files in the cache pool, in front of the device
+  // mounted at mountpoint, and mounts it there instead. A volume that is
+  // already cached is left alone. On failure, the original mount is put
+  // back.
+  Try<Nothing> attachCache(
+    const ExternalMount& em,
+    const std::string&   mountpoint) const;
+
+  // Flushes and tears down the cache of a volume and mounts its own
+  // device at its mountpoint again, so that dvdcli can unmount it.
+  // Does nothing if the volume is not cached.
+  Try<Nothing> detachCache(const ExternalMount& em) const;
+
+  // Throttles the I/O of the container to the block device backing each
+  // of its volumes, in the blkio (cgroup v1) or io (cgroup v2) controller
+  // of its cgroup. Only uses the devices recorded by prepare(), so it
+  // never touches the volumes themselves. Returns false if a limit could
+  // not be applied.
+  bool applyIoLimits(const ContainerID& containerId);
+
+  // Writes the mounts held in infos, and the volumes still detaching,
+  // to the checkpoint file. Also calls updateInventory().
+  void checkpointInfos();
+
+  // Starts a new inventory generation and writes the inventory file, if
+  // there is one.
+  void updateInventory();
+
+  // Appends an event of the given kind to the trace file, stamped with
+  // the current time. Does nothing unless traceFile is set.
+  static void trace(const std::string& event, JSON::Object fields);
+
+  // Describes every volume held by, or being prepared for, a container
+  // and every released volume that is still attached: driver, name,
+  // number of holders, state (mounting, mounted, warm or detaching) and
+  // when a container last started or stopped using it.
+  JSON::Object volumesJson() const;
+
+  // Creates the container path if it is under /tmp, and the subpath of
+  // the mount, and copies the ownership and permissions of the container
+  // path onto the host path. Returns the bind mount command to run in the
+  // container, empty for idmapped volumes, which isolate() mounts. Blocks
+  // on the volume's filesystem, so it only runs on the filesystem workers,
+  // see containerizeOnWorker().
+  Try<std::string> containerize(const ExternalMount& em) const;
+
+  // Runs containerize() on the idleWorker(). Fails after fsTimeout,
+  // even though the call itself cannot be interrupted. Overlays go to
+  // overlayWorker() instead.
+  process::Future<std::string> containerizeOnWorker(const ExternalMount& em);
+
+  // Looks up the block device of the volume's mountpoint on the
+  // idleWorker(), for applyIoLimits(). Empty if the volume is not on a
+  // block device, or its filesystem did not answer within fsTimeout.
+  process::Future<std::string> deviceOnWorker(const ExternalMount& em);
+
+  // The filesystem worker with the fewest calls queued, so a worker
+  // stuck on a hung mountpoint is passed over.
+  size_t idleWorker() const;
+
+  // The filesystem worker creating and discarding the directories of the
+  // overlay of em, so discardOverlay() runs after containerize().
+  size_t overlayWorker(const ExternalMount& em) const;
+
+  // Remounts the mount of the volume read-only while a container holds
+  // it with an overlay, and writable again after the last one, unless
+  // the driver mounted it read-only. Volumes that are not a mount of
+  // their own are left alone. The remount runs on a filesystem worker.
+  void protectOverlayLower(const ExternalMount& em);
 
-  using envvararray = std::array<std::string, 10>;
+  // Continuations of prepare(), run once the volume mounts and then the
+  // bind mount preparations and device lookups of the container have
+  // completed.
+  process::Future<std::list<std::string>> _prepare(
+    const ContainerID&                                 containerId,
+    const std::vector<process::Owned<ExternalMount>>&  requested,
+    const std::list<process::Future<std::string>>&     mountpoints);
 
-  // Helper function for parsing environement variables into arrays of string
-  // Returns true if environment variable name and value are valid
-  bool parseEnvVar(
-    const Environment_Variable&  envvar,
-    const char*                  expectedName,
-    envvararray                  (&insertTarget),
-    bool                         limitCharset) const;
+  process::Future<std::list<std::string>> __prepare(
+    const ContainerID&                                 containerId,
+    const std::vector<process::Owned<ExternalMount>>&  requested,
+    const std::list<process::Future<std::string>>&     binds,
+    const std::list<process::Future<std::string>>&     devices);
+
+  // Wraps the bind mount commands of a container in the launch info
+  // returned by prepare(). None if there are no commands, so containers
+  // without container path volumes get no mount namespace. Empty commands
+  // stand for idmapped volumes, which only need the namespace.
+  static PrepareResult launchInfo(const std::list<std::string>& commands);
+
+  // isolate() once the volumes of the container are mounted. Makes the
+  // idmapped mounts of the container on a filesystem worker.
+  process::Future<Nothing> _isolate(
+    const ContainerID& containerId,
+    pid_t pid);
+
+  // Directory holding the bind mount sources of a container whose
+  // volumes are attached in the background, see deferAttach.
+  static std::string bindsDir(const ContainerID& containerId);
+
+  // Returns the command that binds source at the container path of em,
+  // run in the container's mount namespace before the task starts.
+  static std::string bindCommand(
+    const ExternalMount& em,
+    const std::string&   source);
+
+  // Returns the directory of the volume to bind mount at its container
+  // path: its subpath if it has one, otherwise its mountpoint, or its
+  // publish target path for CSI volumes.
+  static std::string hostPath(const ExternalMount& em);
 
   // helper function to "unroll" mounts when a list is submitted
   // and a munt fails. Goal is do all mounts or none.
+  // Releases every pending mount of the container and unmounts the
+  // volumes no other container holds.
   process::Failure revertMountlist(
     const char*                                      operation,
-    const std::vector<process::Owned<ExternalMount>> mounts) const;
+    const ContainerID&                               containerId);
+
+  // Moves a volume no container holds any more to detaching and starts
+  // unmounting it. The caller checkpoints.
+  void release(
+    const ExternalMount& em,
+    const std::string&   callerLabelForLogging);
+
+  // Unmounts a detaching volume on its shard and tracks it in unmounting
+  // until done. The volume leaves detaching once the unmount succeeds.
+  void detach(
+    const ExternalMount& em,
+    const std::string&   callerLabelForLogging);
+
+  // Returns the number of containers, prepared or still preparing,
+  // holding the volume.
+  size_t holders(const ExternalMount& em) const;
 
+  // Returns true if a container outside the pod of containerId, i.e. with
+  // another top-level container, holds the volume or is preparing it.
+  bool heldOutsidePod(
+    const ExternalMount& em,
+    const ContainerID&   containerId) const;
+
+  // Returns true if a container holds the volume, or is preparing it, at
+  // a container path with an overlay while em asks for none, or the other
+  // way around.
+  bool heldInOtherMode(const ExternalMount& em) const;
+
+  // Returns the top-level container of a possibly nested container.
+  static ContainerID topLevel(const ContainerID& containerId);
+
+  // Returns the mountpoint of the volume if a container holds it mounted.
+  Option<std::string> heldMountpoint(const ExternalMount& em) const;
+
+  // Returns the volumes occupying an attach slot of the node: held or
+  // being mounted by a container, detaching, or found mounted by the
+  // reconciler without a holder. Local volumes take no slot.
+  hashset<ExternalMountID> attachedVolumes() const;
+
+  double freeAttachSlots();
+
+  // Returns the mount target of the volume if it is mounted on the host
+  // below the reconcile root of its driver. The host mount table is
+  // indexed once and only read again after it has changed.
+  Option<std::string> hostMountpoint(const ExternalMount& em);
+
+  // Returns the shard responsible for the volume.
+  process::PID<DockerVolumeDriverShard> shard(const ExternalMount& em) const;
+
+  // The mounts held by each container, the refcount of every volume.
+  // Not dvdi::VolumeTable, which only backs the dvdi tool and knows
+  // nothing of the pending, mounting and detaching volumes below.
   using containermountmap =
     multihashmap<ContainerID, process::Owned<ExternalMount>>;
   containermountmap infos;
 
-  // compiler had issues with the autodetecting size of following array,
-  // thus a constant is defined
+  // Mounts of containers whose prepare() has not completed yet. They count
+  // as holders of their volumes but are not checkpointed.
+  containermountmap pending;
+
+  // In-flight mounts and unmounts by volume, so that prepare() and
+  // cleanup() calls for the same volume wait for each other.
+  hashmap<ExternalMountID, process::Future<std::string>> mounting;
+  hashmap<ExternalMountID, process::Future<Nothing>> unmounting;
+
+  // Detaching volumes found orphaned by recover() whose unmount has not
+  // been started yet, so that relaunched tasks can reclaim them.
+  hashset<ExternalMountID> orphaned;
+
+  // Volumes remounted read-only by protectOverlayLower(). Not
+  // checkpointed, after a restart they stay read-only until unmounted.
+  // Updated by the filesystem workers, under their own mutex.
+  hashset<ExternalMountID> readOnlyLowers;
+  std::mutex readOnlyLowersMutex;
+
+  // Volumes released by their last container that still have to be
+  // unmounted. Checkpointed, so the unmount is retried after a restart.
+  // prepare() of a detaching volume cancels the detach.
+  hashmap<ExternalMountID, process::Owned<ExternalMount>> detaching;
+
+  // Original queue attributes of the disks of tuned volumes. Checkpointed.
+  hashmap<ExternalMountID, TunedDevice> tunedDevices;
+
+  // Actors that run the blocking per-volume driver calls (dvdcli, csc),
+  // so driver calls for unrelated volumes run in parallel. They hold no
+  // volume state of their own.
+  std::vector<process::Owned<DockerVolumeDriverShard>> shards;
+
+  // Threads that run the mkdir/stat/chmod/chown calls on container paths
+  // and mounted volumes.
+  std::vector<process::Owned<DockerVolumeDriverFsWorker>> fsWorkers;
+
+  // Volumes this agent mounted, adopted or held since their last
+  // successful detach, as they were recorded when first held, so an
+  // unmount by reconcile() goes through the same driver and dvdcli.
+  // Checkpointed.
+  hashmap<ExternalMountID, process::Owned<ExternalMount>> claimed;
+
+  // Claimed volumes still in the host mount table but not held by any
+  // container, with the time they were first seen that way.
+  hashmap<ExternalMountID, process::Time> unreferencedSince;
+
+  // Index of the volumes mounted below a reconcile root, used by
+  // hostMountpoint(), and the /proc/self/mounts descriptor that signals
+  // changes to the host mount table. -1 until the index is built.
+  hashmap<ExternalMountID, std::string> hostMounts;
+  int hostMountsFd;
+
+  process::Owned<DockerVolumeDriverReconciler> reconciler;
+
+  process::Owned<DockerVolumeDriverDetacher> detacher;
+
+  process::Owned<DockerVolumeDriverProber> prober;
+
+  process::Owned<DockerVolumeDriverCataloger> cataloger;
 
-  static constexpr size_t NUM_PROHIBITED = 26;
-  static const char prohibitedchars[NUM_PROHIBITED]; /*  = {
-  '%', '/', ':', ';', '\0',
-  '<', '>', '|', '`', '$', '\'',
-  '?', '^', '&', ' ', '{', '\"',
-  '}', '[', ']', '\n', '\t', '\v', '\b', '\r', '\\' };*/
+  // Driver name -> its volumes, see refreshCatalogs().
+  hashmap<std::string, VolumeCatalog> catalogs;
 
+  process::Owned<DockerVolumeDriverEndpoints> endpoints;
+
+  // Set by drain(), checkpointed so it survives an agent restart.
+  bool draining;
+
+  // Incremented whenever the volume set changes.
+  uint64_t inventoryGeneration;
+
+  // When a container last started or stopped using each volume.
+  hashmap<ExternalMountID, process::Time> lastUsed;
+
+  // Drivers whose last probe failed, with the reason. prepare() fails at
+  // once instead of mounting their volumes.
+  hashmap<std::string, std::string> unhealthyDrivers;
+
+  // With deferAttach, the mounts of containers that prepare() returned
+  // for but isolate() has not waited for yet.
+  hashmap<ContainerID, process::Future<Nothing>> attaching;
+
+  // Reports the attach slots not taken by attachedVolumes(), as
+  // returned by freeAttachSlots().
+  Option<process::metrics::Gauge> attachSlotsFree;
+
+  // Resources and pid of each container holding volumes, used to find
+  // its I/O limits and its cgroup.
+  hashmap<ContainerID, Resources> allocated;
+  hashmap<ContainerID, pid_t> pids;
+
+  // Containers whose cgroup has been given I/O limits, so that limits
+  // removed by update() are cleared again.
+  hashset<ContainerID> throttled;
+
+  // Directory of the checkpoint and of the bind and CSI directories.
+  static std::string stateDir;
   static std::string mountPbFilename;
   static std::string mesosWorkingDir;
+
+  // Zero disables the reconciler.
+  static Duration reconcileInterval;
+  static Duration reconcileGracePeriod;
+
+  // Volume driver name -> host directory below which it mounts volumes.
+  static hashmap<std::string, std::string> reconcileMountRoots;
+
+  static bool verifyInvariants;
+
+  static size_t volumeShards;
+
+  static size_t fsWorkerCount;
+  static Duration fsTimeout;
+
+  static Duration detachRetryInterval;
+  static Duration orphanDetachDelay;
+
+  // Rewritten on every change of the volume set, empty for none.
+  static std::string inventoryFile;
+
+  // prepare(), cleanup(), recover() and driver calls are appended here,
+  // one JSON object per line, for dvdi-replay. Empty disables tracing.
+  static std::string traceFile;
+
+  // Zero disables probing.
+  static Duration probeInterval;
+  static Duration probeTimeout;
+  static std::vector<std::string> probeDriverNames;
+  static std::string probeVolume;
+
+  // Driver name -> dvdcli binary probing it, DEFAULT_DVDCLI_BIN if unset.
+  static hashmap<std::string, std::string> probeDvdclis;
+
+  // Driver name -> command printing its volumes as a JSON array.
+  static hashmap<std::string, std::string> catalogCommands;
+  static Duration catalogInterval;
+  static Duration catalogTtl;
+
+  // prepare() returns as soon as the mounts are started, and isolate()
+  // waits for them, so attaching overlaps with fetching and provisioning.
+  static bool deferAttach;
+
+  // The drain endpoint is not authenticated, so it is only served when
+  // enabled.
+  static bool drainEndpoint;
+
+  // Number of volumes the node can have attached, zero for no limit.
+  static size_t attachSlots;
+
+  static hashmap<std::string, TuningProfile> tuningProfiles;
+
+  // Volume option that passes DVDI_VOLUME_FROM_SNAPSHOT to the driver.
+  static std::string snapshotVolumeOption;
+
+  // csc binary, and filesystem CSI volumes are staged with.
+  static std::string cscPath;
+  static std::string csiFsType;
+
+  // Directory holding the local volumes, empty when they are disabled.
+  static std::string localPool;
+
+  // Directory holding the cache files, empty when caching is disabled.
+  static std::string cachePool;
+  static Bytes cacheSize;
+};
+
+// Runs the blocking driver calls for the volumes routed to it by
+// DockerVolumeDriverIsolator::shard(). Only calls the isolator's const
+// driver helpers, the results are recorded by the isolator's actor.
+class DockerVolumeDriverShard
+  : public process::Process<DockerVolumeDriverShard>
+{
+public:
+  explicit DockerVolumeDriverShard(
+      DockerVolumeDriverIsolator* _isolator)
+    : ProcessBase(process::ID::generate("dvdi-shard")),
+      isolator(_isolator) {}
+
+  // Returns the mountpoint of the volume, after putting the cache in front
+  // of it and applying its tuning profile.
+  process::Future<std::string> mount(const ExternalMount& em);
+
+  // Restores the original queue attributes of a tuned volume, if any,
+  // and removes its cache before unmounting it.
+  process::Future<Nothing> unmount(
+      const ExternalMount& em,
+      const std::string&   callerLabelForLogging,
+      const Option<TunedDevice>& tuned);
+
+  // Publishes a CSI volume to the target path of its container, see
+  // DockerVolumeDriverIsolator::publishCsi().
+  process::Future<Nothing> publish(const ExternalMount& em);
+
+  process::Future<Nothing> unpublish(const ExternalMount& em);
+
+private:
+  DockerVolumeDriverIsolator* isolator;
+};
+
+// Runs blocking filesystem calls, in the order they are queued, on a
+// thread of its own. A call stuck in uninterruptible sleep on a hung mount
+// only holds up this worker, not a libprocess thread shared with the
+// agent. When destroyed, waits up to stopTimeout for the queued calls,
+// then drops them and leaves a thread that is still stuck behind.
+class DockerVolumeDriverFsWorker
+{
+public:
+  explicit DockerVolumeDriverFsWorker(const Duration& _stopTimeout);
+  ~DockerVolumeDriverFsWorker();
+
+  // Queues a call whose result is returned through the future.
+  template <typename T>
+  process::Future<T> run(const std::function<Try<T>()>& call)
+  {
+    std::shared_ptr<process::Promise<T>> promise(new process::Promise<T>());
+    post([=]() {
+      Try<T> result = call();
+      if (result.isError()) {
+        promise->fail(result.error());
+      } else {
+        promise->set(result.get());
+      }
+    });
+    return promise->future();
+  }
+
+  // Queues a call nobody waits for.
+  void post(const std::function<void()>& call);
+
+  // Number of calls queued or running.
+  size_t load() const;
+
+private:
+  // Shared with the thread, which may outlive the worker.
+  struct State
+  {
+    State() : running(false), stopping(false) {}
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable idle;
+    std::deque<std::function<void()>> calls;
+    bool running;
+    bool stopping;
+  };
+
+  static void loop(std::shared_ptr<State> state);
+
+  const Duration stopTimeout;
+  std::shared_ptr<State> state;
+  std::thread thread;
+};
+
+// Periodically invokes DockerVolumeDriverIsolator::reconcile() so leaked
+// mounts are reclaimed without waiting for an agent restart.
+class DockerVolumeDriverReconciler
+  : public process::Process<DockerVolumeDriverReconciler>
+{
+public:
+  DockerVolumeDriverReconciler(
+      DockerVolumeDriverIsolator* _isolator,
+      const Duration& _interval)
+    : ProcessBase(process::ID::generate("dvdi-reconciler")),
+      isolator(_isolator),
+      interval(_interval) {}
+
+protected:
+  virtual void initialize();
+
+private:
+  void reconcile();
+
+  DockerVolumeDriverIsolator* isolator;
+  const Duration interval;
+};
+
+// Periodically invokes DockerVolumeDriverIsolator::retryDetaches() so a
+// failed unmount does not leave the volume mounted until the next restart,
+// and detachOrphans() once recover() has given tasks time to reclaim them.
+class DockerVolumeDriverDetacher
+  : public process::Process<DockerVolumeDriverDetacher>
+{
+public:
+  DockerVolumeDriverDetacher(
+      DockerVolumeDriverIsolator* _isolator,
+      const Duration& _interval)
+    : ProcessBase(process::ID::generate("dvdi-detacher")),
+      isolator(_isolator),
+      interval(_interval) {}
+
+  void detachOrphans();
+
+protected:
+  virtual void initialize();
+
+private:
+  void retry();
+
+  DockerVolumeDriverIsolator* isolator;
+  const Duration interval;
+};
+
+// Periodically invokes DockerVolumeDriverIsolator::probeDrivers(), starting
+// right away so the drivers are warmed up before the first task arrives.
+class DockerVolumeDriverProber
+  : public process::Process<DockerVolumeDriverProber>
+{
+public:
+  DockerVolumeDriverProber(
+      DockerVolumeDriverIsolator* _isolator,
+      const Duration& _interval)
+    : ProcessBase(process::ID::generate("dvdi-prober")),
+      isolator(_isolator),
+      interval(_interval) {}
+
+protected:
+  virtual void initialize();
+
+private:
+  void probe();
+
+  DockerVolumeDriverIsolator* isolator;
+  const Duration interval;
+};
+
+// Periodically invokes DockerVolumeDriverIsolator::refreshCatalogs().
+class DockerVolumeDriverCataloger
+  : public process::Process<DockerVolumeDriverCataloger>
+{
+public:
+  DockerVolumeDriverCataloger(
+      DockerVolumeDriverIsolator* _isolator,
+      const Duration& _interval)
+    : ProcessBase(process::ID::generate("dvdi-cataloger")),
+      isolator(_isolator),
+      interval(_interval) {}
+
+protected:
+  virtual void initialize();
+
+private:
+  void refresh();
+
+  DockerVolumeDriverIsolator* isolator;
+  const Duration interval;
+};
+
+// Serves DockerVolumeDriverIsolator::inventory(), so schedulers can place
+// tasks where their volumes are already attached, and drains the agent's
+// volumes for maintenance.
+class DockerVolumeDriverEndpoints
+  : public process::Process<DockerVolumeDriverEndpoints>
+{
+public:
+  DockerVolumeDriverEndpoints(
+      DockerVolumeDriverIsolator* _isolator,
+      bool _drainEnabled)
+    : ProcessBase(ENDPOINTS_PROCESS_ID),
+      isolator(_isolator),
+      drainEnabled(_drainEnabled) {}
+
+protected:
+  virtual void initialize();
+
+private:
+  // GET with an optional since=<generation> query parameter.
+  process::Future<process::http::Response> volumes(
+      const process::http::Request& request);
+
+  // POST starts or retries the drain, GET reports its progress and
+  // DELETE ends it. Only routed with drainEnabled.
+  process::Future<process::http::Response> drain(
+      const process::http::Request& request);
+
+  DockerVolumeDriverIsolator* isolator;
+  const bool drainEnabled;
 };
 
 } /* namespace slave */
@@ -0,0 +1,284 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// dvdi runs the volume handling of the isolator without a Mesos agent,
+// on a state file of its own. Usage:
+//
+//   dvdi parse [DVDI_VOLUME_...=<value> ...]
+//   dvdi mount --state=<file> --container=<id> [--snapshot_option=<name>]
+//              [DVDI_VOLUME_...=<value> ...]
+//   dvdi unmount --state=<file> --container=<id>
+//   dvdi list --state=<file>
+//
+// Volumes are requested with the same variables as in a task's
+// environment and mounted with dvdcli. A volume is unmounted when the
+// last container holding it is. Results are printed as JSON.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/json.hpp>
+#include <stout/os.hpp>
+#include <stout/path.hpp>
+#include <stout/stringify.hpp>
+#include <stout/strings.hpp>
+
+#include "dvdi_core.hpp"
+
+using namespace dvdi;
+
+using std::string;
+using std::vector;
+
+static constexpr char DEFAULT_SNAPSHOT_OPTION[] = "snapshot";
+
+static void usage(const char* argv0)
+{
+  std::cerr << "Usage: " << argv0 << " parse [KEY=VALUE ...]\n"
+            << "       " << argv0 << " mount --state=<file> --container=<id>"
+            << " [--snapshot_option=<name>] [KEY=VALUE ...]\n"
+            << "       " << argv0
+            << " unmount --state=<file> --container=<id>\n"
+            << "       " << argv0 << " list --state=<file>" << std::endl;
+}
+
+static JSON::Object volumeJson(const ExternalMount& em)
+{
+  JSON::Object volume;
+  volume.values["container"] = JSON::String(em.containerid());
+  volume.values["driver"] = JSON::String(em.volumedriver());
+  volume.values["name"] = JSON::String(em.volumename());
+  volume.values["options"] = JSON::String(em.options());
+  volume.values["container_path"] = JSON::String(em.container_path());
+  volume.values["dvdcli"] = JSON::String(em.dvdcli_path());
+  volume.values["explicit_create"] = JSON::Boolean(em.explicit_create());
+  if (!em.mountpoint().empty()) {
+    volume.values["mountpoint"] = JSON::String(em.mountpoint());
+  }
+  return volume;
+}
+
+static JSON::Array volumesJson(const vector<ExternalMount>& mounts)
+{
+  JSON::Array volumes;
+  foreach (const ExternalMount& em, mounts) {
+    volumes.values.push_back(volumeJson(em));
+  }
+  return volumes;
+}
+
+// Serializes concurrent runs on the same state file. Held until exit.
+static Try<Nothing> lock(const string& state)
+{
+  Try<Nothing> mkdir = os::mkdir(Path(state).dirname());
+  if (mkdir.isError()) {
+    return Error(mkdir.error());
+  }
+
+  const string path = state + ".lock";
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0 || ::flock(fd, LOCK_EX) != 0) {
+    return ErrnoError("Failed to lock " + path);
+  }
+  return Nothing();
+}
+
+static Try<VolumeTable> load(const string& state)
+{
+  Result<ExternalMountList> mountlist = readMountList(state);
+  if (mountlist.isError()) {
+    return Error(mountlist.error());
+  }
+  if (mountlist.isNone()) {
+    return VolumeTable();
+  }
+  return VolumeTable(mountlist.get());
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const string command = argv[1];
+  hashmap<string, string> flags;
+  vector<std::pair<string, string>> environment;
+
+  for (int i = 2; i < argc; i++) {
+    const string arg = argv[i];
+    const size_t equals = arg.find('=');
+    if (equals == string::npos) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    if (strings::startsWith(arg, "--")) {
+      flags[arg.substr(2, equals - 2)] = arg.substr(equals + 1);
+    } else {
+      environment.push_back(
+          std::make_pair(arg.substr(0, equals), arg.substr(equals + 1)));
+    }
+  }
+
+  const string state = flags.get("state").getOrElse("");
+  const string container = flags.get("container").getOrElse("");
+
+  if (command == "parse") {
+    Try<vector<ExternalMount>> specs =
+      parseVolumeSpecs(container, environment, SpecPolicy());
+    if (specs.isError()) {
+      std::cerr << specs.error() << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    std::cout << stringify(volumesJson(specs.get())) << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  if (state.empty() ||
+      (command != "list" && container.empty()) ||
+      (command != "mount" && !environment.empty())) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Try<Nothing> locked = lock(state);
+  if (locked.isError()) {
+    std::cerr << locked.error() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Try<VolumeTable> loaded = load(state);
+  if (loaded.isError()) {
+    std::cerr << loaded.error() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  VolumeTable table = loaded.get();
+
+  if (command == "list") {
+    std::cout << stringify(volumesJson(table.mounts())) << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  if (command == "mount") {
+    foreach (const ExternalMount& em, table.mounts()) {
+      if (em.containerid() == container) {
+        std::cerr << "Container " << container << " already holds volumes"
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    Try<vector<ExternalMount>> specs =
+      parseVolumeSpecs(container, environment, SpecPolicy());
+    if (specs.isError()) {
+      std::cerr << specs.error() << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    const string snapshotOption =
+      flags.get("snapshot_option").getOrElse(DEFAULT_SNAPSHOT_OPTION);
+
+    // Volumes mounted by this run, unmounted again if a later one fails.
+    vector<ExternalMount> mounted;
+    vector<ExternalMount> held;
+    Option<string> failure;
+
+    foreach (ExternalMount em, specs.get()) {
+      if (!em.csi_endpoint().empty()) {
+        failure = em.volumename() + ": CSI volumes need the isolator";
+        break;
+      }
+
+      Option<string> mountpoint = table.mountpoint(em);
+      if (mountpoint.isNone()) {
+        Try<string> result = dvdcliMount(em, snapshotOption);
+        if (result.isError()) {
+          failure = em.volumename() + ": " + result.error();
+          break;
+        }
+        mountpoint = result.get();
+        mounted.push_back(em);
+      }
+
+      em.set_mountpoint(mountpoint.get());
+      held.push_back(em);
+    }
+
+    if (failure.isSome()) {
+      foreach (const ExternalMount& em, mounted) {
+        Try<Nothing> unmounted = dvdcliUnmount(em);
+        if (unmounted.isError()) {
+          std::cerr << "Failed to roll back " << em.volumename() << ": "
+                    << unmounted.error() << std::endl;
+        }
+      }
+
+      std::cerr << "Failed to mount " << failure.get() << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    foreach (const ExternalMount& em, held) {
+      table.add(em);
+    }
+
+    Try<Nothing> written = writeMountList(state, table.mountList());
+    if (written.isError()) {
+      std::cerr << written.error() << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    std::cout << stringify(volumesJson(held)) << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  if (command == "unmount") {
+    const vector<ExternalMount> unused = table.remove(container);
+
+    // As in the isolator, a volume that fails to unmount is assumed to
+    // have been unmounted by hand, and is forgotten.
+    foreach (const ExternalMount& em, unused) {
+      Try<Nothing> unmounted = dvdcliUnmount(em);
+      if (unmounted.isError()) {
+        std::cerr << "Failed to unmount " << em.volumename() << ": "
+                  << unmounted.error() << std::endl;
+      }
+    }
+
+    Try<Nothing> written = writeMountList(state, table.mountList());
+    if (written.isError()) {
+      std::cerr << written.error() << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    std::cout << stringify(volumesJson(unused)) << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  usage(argv[0]);
+  return EXIT_FAILURE;
+}
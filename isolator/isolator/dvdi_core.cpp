@@ -0,0 +1,565 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include <array>
+#include <memory>
+#include <sstream>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/functional/hash.hpp>
+
+#include <glog/logging.h>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/numify.hpp>
+#include <stout/os.hpp>
+#include <stout/path.hpp>
+#include <stout/protobuf.hpp>
+#include <stout/stringify.hpp>
+#include <stout/strings.hpp>
+
+#include "dvdi_core.hpp"
+
+using std::string;
+using std::vector;
+
+namespace dvdi {
+
+// compiler had issues with the autodetecting size of following array,
+// thus a constant is defined
+static constexpr size_t NUM_PROHIBITED = 26;
+static const char prohibitedchars[NUM_PROHIBITED] =
+{
+  '%', '/', ':', ';', '\0',
+  '<', '>', '|', '`', '$', '\'',
+  '?', '^', '&', ' ', '{', '\"',
+  '}', '[', ']', '\n', '\t', '\v', '\b', '\r', '\\'
+};
+
+VolumeID volumeId(const ExternalMount& em)
+{
+  size_t seed = 0;
+  boost::hash_combine(seed, boost::to_lower_copy(em.volumedriver()));
+  boost::hash_combine(seed, boost::to_lower_copy(em.volumename()));
+  return seed;
+}
+
+bool containsProhibitedChars(const string& s)
+{
+  return (string::npos != s.find_first_of(prohibitedchars, 0, NUM_PROHIBITED));
+}
+
+bool containsShellChars(const string& s)
+{
+  return string::npos != s.find_first_of(" \t\n'\"`$;&|<>\\(){}*?[]~#!");
+}
+
+// We accept <environment-var-name>#, where # can be 1-9, saved in array[#].
+// We also accept <environment-var-name>, saved in array[0].
+using envvararray = std::array<string, 10>;
+
+// Returns true if environment variable name and value are valid.
+static bool parseEnvVar(
+  const string&  name,
+  const string&  value,
+  const char*    expectedName,
+  envvararray    (&insertTarget),
+  bool           limitCharset)
+{
+  const size_t prefixLength = strlen(expectedName);
+  if (!strings::startsWith(name, expectedName) ||
+      name.length() > (prefixLength+1) ) {
+    LOG(ERROR) << "Environment variable " << name
+               << " rejected because it's name is invalid.";
+    return false;
+  }
+  if (limitCharset && containsProhibitedChars(value)) {
+    LOG(ERROR) << "Environment variable " << name
+               << " rejected because it's value contains "
+               << "prohibited characters";
+    return false;
+  }
+
+  size_t index = 0;
+  if (name.length() == (prefixLength+1)) {
+    char digit = name.data()[prefixLength];
+
+    if (!isdigit(digit)) {
+      LOG(ERROR) << "Environment variable " << name
+                 << " rejected because it doesn't end with a digit.";
+      return false;
+    }
+    index = std::atoi(name.substr(prefixLength).c_str());
+  }
+
+  insertTarget[index] = value;
+  LOG(INFO) << name  << "(" << value << ") parsed from environment";
+  return true;
+}
+
+Try<vector<ExternalMount>> parseVolumeSpecs(
+    const string& containerId,
+    const vector<std::pair<string, string>>& environment,
+    const SpecPolicy& policy)
+{
+  // parsing is "messy" because we don't insist that environment
+  // variable are in any particular order, or grouped by volume #
+  envvararray deviceDriverNames;
+  envvararray volumeNames;
+  envvararray mountOptions;
+  envvararray containerPaths;
+  envvararray dvdcliPaths;
+  envvararray explicitCreates;
+  envvararray subpaths;
+  envvararray quotas;
+  envvararray iopsLimits;
+  envvararray bpsLimits;
+  envvararray tunings;
+  envvararray caches;
+  envvararray snapshots;
+  envvararray csiEndpoints;
+  envvararray idmaps;
+  envvararray overlays;
+
+  // Longer names first where one is a prefix of another.
+  const struct {
+    const char* name;
+    envvararray* target;
+    bool limitCharset;
+  } variables[] = {
+    {VOL_NAME_ENV_VAR_NAME, &volumeNames, true},
+    {VOL_DRIVER_ENV_VAR_NAME, &deviceDriverNames, true},
+    {VOL_OPTS_ENV_VAR_NAME, &mountOptions, true},
+    {VOL_CPATH_ENV_VAR_NAME, &containerPaths, false},
+    {VOL_DVDCLI_ENV_VAR_NAME, &dvdcliPaths, false},
+    {VOL_EXPLICIT_ENV_VAR_NAME, &explicitCreates, true},
+    {VOL_SUBPATH_ENV_VAR_NAME, &subpaths, true},
+    {VOL_QUOTA_ENV_VAR_NAME, &quotas, true},
+    {VOL_IOPS_ENV_VAR_NAME, &iopsLimits, true},
+    {VOL_BPS_ENV_VAR_NAME, &bpsLimits, true},
+    {VOL_TUNING_ENV_VAR_NAME, &tunings, true},
+    {VOL_CACHE_ENV_VAR_NAME, &caches, true},
+    {VOL_SNAPSHOT_ENV_VAR_NAME, &snapshots, true},
+    {VOL_CSI_ENV_VAR_NAME, &csiEndpoints, false},
+    {VOL_IDMAP_ENV_VAR_NAME, &idmaps, true},
+    {VOL_OVERLAY_ENV_VAR_NAME, &overlays, true},
+  };
+
+  // Iterate through the environment variables,
+  // looking for the ones we need.
+  foreach (const auto& variable, environment) {
+    foreach (const auto& expected, variables) {
+      if (strings::startsWith(variable.first, expected.name)) {
+        if (!parseEnvVar(variable.first, variable.second, expected.name,
+                         *expected.target, expected.limitCharset)) {
+          return Error("illegal " + string(expected.name));
+        }
+        break;
+      }
+    }
+  }
+
+  vector<ExternalMount> requested;
+
+  // Not using iterator because we access all arrays using common index.
+  for (size_t i = 0; i < volumeNames.size(); i++) {
+
+    if (volumeNames[i].empty()) {
+      continue;
+    }
+
+    LOG(INFO) << "Validating mount name " << volumeNames[i];
+
+    if (deviceDriverNames[i].empty()) {
+      deviceDriverNames[i] = VOL_DRIVER_DEFAULT;
+    }
+    if (dvdcliPaths[i].empty()) {
+      dvdcliPaths[i] = DEFAULT_DVDCLI_BIN;
+    }
+    if (explicitCreates[i].empty()) {
+      explicitCreates[i] = "false";
+    }
+
+    // TODO consider not filling container path if it is empty.
+    // Empty container path would mean leaving do not engage isolation on mount
+    // resulting in mount exposure across all containers.
+    if (!containerPaths[i].empty()) {
+      if (!strings::startsWith(containerPaths[i], "/")) {
+        return Error("containerpaths must start with /");
+      }
+    }
+
+    // A subpath is a single directory below the mountpoint. Slashes are
+    // already rejected by parseEnvVar(), so only the dot entries remain.
+    if (!subpaths[i].empty()) {
+      if (containerPaths[i].empty()) {
+        return Error("subpath requires a containerpath");
+      }
+      if (subpaths[i] == "." || subpaths[i] == "..") {
+        return Error("subpath must name a directory");
+      }
+    }
+    if (!quotas[i].empty() && subpaths[i].empty()) {
+      return Error("quota requires a subpath");
+    }
+
+    // Unset I/O limits fall back to the container's resources.
+    Try<uint64_t> iops = numify<uint64_t>(
+        iopsLimits[i].empty() ? "0" : iopsLimits[i]);
+    Try<uint64_t> bps = numify<uint64_t>(
+        bpsLimits[i].empty() ? "0" : bpsLimits[i]);
+    if (iops.isError() || bps.isError()) {
+      return Error("I/O limits must be integers");
+    }
+
+    if (!tunings[i].empty() && !policy.tuningProfiles.contains(tunings[i])) {
+      return Error("unknown tuning profile " + tunings[i]);
+    }
+
+    const bool cache =
+      strings::lower(strings::trim(caches[i])).compare("true") == 0;
+    if (deviceDriverNames[i] == LOCAL_VOLUME_DRIVER) {
+      if (!policy.localVolumes) {
+        return Error("local volumes require a local_pool");
+      }
+      // A local volume is a directory of its name in the local pool.
+      if (volumeNames[i] == "." || volumeNames[i] == "..") {
+        return Error("local volume names must name a directory");
+      }
+      if (snapshots[i] == "." || snapshots[i] == "..") {
+        return Error("local snapshots must name a directory");
+      }
+    }
+
+    if (cache && !policy.cacheTier) {
+      return Error("caching requires a cache_pool");
+    }
+
+    const bool explicitCreate =
+      strings::lower(strings::trim(explicitCreates[i])).compare("true") == 0;
+
+    const bool idmap =
+      strings::lower(strings::trim(idmaps[i])).compare("true") == 0;
+    if (idmap && containerPaths[i].empty()) {
+      return Error("idmap requires a containerpath");
+    }
+
+    // Writes go to the overlay, the volume is only read.
+    const bool overlay =
+      strings::lower(strings::trim(overlays[i])).compare("true") == 0;
+    if (overlay) {
+      if (containerPaths[i].empty()) {
+        return Error("overlay requires a containerpath");
+      }
+      if (idmap) {
+        return Error("overlay cannot be combined with idmap");
+      }
+      if (!quotas[i].empty()) {
+        return Error("overlay cannot be combined with a quota");
+      }
+    }
+
+    if (!csiEndpoints[i].empty()) {
+      if (!strings::startsWith(csiEndpoints[i], "/")) {
+        return Error("CSI endpoints must start with /");
+      }
+      // Passed to csc on its command line.
+      if (containsShellChars(csiEndpoints[i])) {
+        return Error("CSI endpoints must not contain shell characters");
+      }
+      if (deviceDriverNames[i] == LOCAL_VOLUME_DRIVER) {
+        return Error("local volumes cannot use CSI");
+      }
+      // Creating volumes is the job of the CSI controller service.
+      if (!snapshots[i].empty() || explicitCreate) {
+        return Error("CSI volumes cannot be created by the isolator");
+      }
+    }
+
+    // note: mountpoint is not set yet, because we haven't mounted yet
+    std::unique_ptr<ExternalMount> requestedMount(
+      Builder().setContainerId(containerId)
+               .setVolumeDriver(deviceDriverNames[i])
+               .setVolumeName(volumeNames[i])
+               .setOptions(mountOptions[i])
+               .setContainerPath(containerPaths[i])
+               .setDvdcliPath(dvdcliPaths[i])
+               .setExplicitCreate(explicitCreate)
+               .setSubpath(subpaths[i])
+               .setSubpathQuota(quotas[i])
+               .setIops(iops.get())
+               .setBps(bps.get())
+               .setTuning(tunings[i])
+               .setCache(cache)
+               .setFromSnapshot(snapshots[i])
+               .setCsiEndpoint(csiEndpoints[i])
+               .setIdmap(idmap)
+               .setOverlay(overlay)
+               .build()
+      );
+
+    // Check for duplicates in environment.
+    bool duplicateInEnv = false;
+    foreach (const ExternalMount& mount, requested) {
+      if (volumeId(mount) == volumeId(*requestedMount)) {
+        duplicateInEnv = true;
+        break;
+      }
+    }
+
+    // A container holds a volume once, at a single container path.
+    if (duplicateInEnv) {
+      if (!containerPaths[i].empty()) {
+        return Error("duplicated mount with containerpath, a volume can "
+                     "only be used at one path per container");
+      }
+      LOG(INFO) << "Duplicate mount request("
+                << requestedMount->volumedriver()
+                << "/" << requestedMount->volumename()
+                << ") in environment will be ignored";
+      continue;
+    }
+
+    requested.push_back(*requestedMount);
+  }
+
+  return requested;
+}
+
+Try<string> runCommand(const string& command)
+{
+  LOG(INFO) << "Invoking " << command;
+
+  FILE* file = ::popen(command.c_str(), "r");
+  if (file == NULL) {
+    return ErrnoError("Failed to run '" + command + "'");
+  }
+
+  string output;
+  char buffer[4096];
+  size_t length;
+  while ((length = ::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    output.append(buffer, length);
+  }
+
+  const int status = ::pclose(file);
+  if (status == -1) {
+    return ErrnoError("Failed to wait for '" + command + "'");
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return Error("'" + command + "' returned errorcode " +
+                 stringify(WIFEXITED(status) ? WEXITSTATUS(status) : status));
+  }
+
+  return output;
+}
+
+string formatOptions(const string& options)
+{
+  std::stringstream buf;
+  std::size_t i = 0, j = options.find(",");
+
+  while (j != std::string::npos) {
+    if (j > i) {
+      buf << " " << VOL_OPTS_CMD_OPTION << options.substr(i, j-i);
+    }
+    i = j+1;
+    j = options.find(",", i);
+  }
+  if (i < options.size()) {
+      buf << " " << VOL_OPTS_CMD_OPTION << options.substr(i);
+  }
+
+  return buf.str();
+}
+
+Try<string> dvdcliMount(const ExternalMount& em, const string& snapshotOption)
+{
+  string options = formatOptions(em.options());
+
+  // Drivers only use the snapshot when they create the volume, so it is
+  // safe to pass on every mount, including retries.
+  if (!em.from_snapshot().empty()) {
+    options += string(" ") + VOL_OPTS_CMD_OPTION + snapshotOption +
+               "=" + em.from_snapshot();
+  }
+
+  Try<string> output = runCommand(
+      em.dvdcli_path() + " " + DVDCLI_MOUNT_CMD + " " +
+      VOL_DRIVER_CMD_OPTION + em.volumedriver() + " " +
+      VOL_NAME_CMD_OPTION + em.volumename() + options +
+      (em.explicit_create() ? " --explicitCreate=true" : ""));
+  if (output.isError()) {
+    return Error(output.error());
+  }
+
+  const string mountpoint = strings::trim(output.get());
+  if (mountpoint.empty()) {
+    return Error("returned an empty mountpoint name");
+  }
+
+  return mountpoint;
+}
+
+Try<Nothing> dvdcliUnmount(const ExternalMount& em)
+{
+  Try<string> output = runCommand(
+      em.dvdcli_path() + " " + DVDCLI_UNMOUNT_CMD + " " +
+      VOL_DRIVER_CMD_OPTION + em.volumedriver() + " " +
+      VOL_NAME_CMD_OPTION + em.volumename());
+  if (output.isError()) {
+    return Error(output.error());
+  }
+
+  return Nothing();
+}
+
+Try<Nothing> writeMountList(
+    const string&            path,
+    const ExternalMountList& mountlist)
+{
+  Try<Nothing> mkdir = os::mkdir(Path(path).dirname());
+  if (mkdir.isError()) {
+    return Error("Failed to create the directory of " + path + ": " +
+                 mkdir.error());
+  }
+
+  const string temporary = path + ".tmp";
+  Try<Nothing> write = ::protobuf::write(temporary, mountlist);
+  if (write.isError()) {
+    return Error("Failed to write " + temporary + ": " + write.error());
+  }
+
+  return os::rename(temporary, path);
+}
+
+Result<ExternalMountList> readMountList(const string& path)
+{
+  if (!os::exists(path)) {
+    return None();
+  }
+
+  Try<string> contents = os::read(path);
+  if (contents.isError()) {
+    return Error("Failed to read " + path + ": " + contents.error());
+  }
+
+  if (contents.get().empty()) {
+    return None();
+  }
+
+  // ::protobuf::write() puts the size of the message in front of it, as
+  // a native uint32_t. Older checkpoints hold the bare message, which
+  // starts with the tag and length of a non-empty field, so read as a
+  // uint32_t its first bytes are never below 16MiB.
+  uint32_t size = 0;
+  if (contents.get().size() >= sizeof(size)) {
+    memcpy(&size, contents.get().data(), sizeof(size));
+  }
+
+  ExternalMountList mountlist;
+  if (contents.get().size() >= sizeof(size) && size < (1u << 24)) {
+    if (size != contents.get().size() - sizeof(size)) {
+      return Error("Truncated protobuf data contained within " + path);
+    }
+    if (!mountlist.ParseFromString(contents.get().substr(sizeof(size)))) {
+      return Error("Invalid protobuf data contained within " + path);
+    }
+    return mountlist;
+  }
+
+  if (!mountlist.ParseFromString(contents.get())) {
+    return Error("Invalid protobuf data contained within " + path);
+  }
+  return mountlist;
+}
+
+VolumeTable::VolumeTable(const ExternalMountList& mountlist)
+{
+  for (int i = 0; i < mountlist.mount_size(); i++) {
+    held.push_back(mountlist.mount(i));
+  }
+}
+
+bool VolumeTable::add(const ExternalMount& em)
+{
+  const bool first = holders(em) == 0;
+  held.push_back(em);
+  return first;
+}
+
+vector<ExternalMount> VolumeTable::remove(const string& containerId)
+{
+  vector<ExternalMount> released;
+  vector<ExternalMount> kept;
+  foreach (const ExternalMount& mount, held) {
+    if (mount.containerid() == containerId) {
+      released.push_back(mount);
+    } else {
+      kept.push_back(mount);
+    }
+  }
+  held = kept;
+
+  vector<ExternalMount> unused;
+  foreach (const ExternalMount& mount, released) {
+    if (holders(mount) == 0) {
+      unused.push_back(mount);
+    }
+  }
+  return unused;
+}
+
+size_t VolumeTable::holders(const ExternalMount& em) const
+{
+  size_t count = 0;
+  foreach (const ExternalMount& mount, held) {
+    if (volumeId(mount) == volumeId(em)) {
+      count++;
+    }
+  }
+  return count;
+}
+
+Option<string> VolumeTable::mountpoint(const ExternalMount& em) const
+{
+  foreach (const ExternalMount& mount, held) {
+    if (volumeId(mount) == volumeId(em) && !mount.mountpoint().empty()) {
+      return mount.mountpoint();
+    }
+  }
+  return None();
+}
+
+ExternalMountList VolumeTable::mountList() const
+{
+  ExternalMountList mountlist;
+  foreach (const ExternalMount& mount, held) {
+    mountlist.add_mount()->CopyFrom(mount);
+  }
+  return mountlist;
+}
+
+} // namespace dvdi {
@@ -0,0 +1,173 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_DVDI_CORE_HPP_
+#define SRC_DVDI_CORE_HPP_
+
+// The parts of the isolator that do not need a Mesos agent: parsing the
+// volume requests in a task's environment, the mount checkpoint and the
+// dvdcli calls. Built as libdvdi-core, which the isolator module and the
+// dvdi command line tool link against. The volume refcount table is only
+// the dvdi tool's, see VolumeTable. Nothing here depends on libprocess,
+// the agent or MESOS_VERSION_INT.
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stout/hashset.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/result.hpp>
+#include <stout/try.hpp>
+
+#include "interface.hpp"
+
+namespace dvdi {
+
+static constexpr char DVDCLI_MOUNT_CMD[]          = "mount";
+static constexpr char DVDCLI_UNMOUNT_CMD[]        = "unmount";
+static constexpr char DVDCLI_PATH_CMD[]           = "path";
+
+static constexpr char VOL_NAME_CMD_OPTION[]       = "--volumename=";
+static constexpr char VOL_DRIVER_CMD_OPTION[]     = "--volumedriver=";
+static constexpr char VOL_OPTS_CMD_OPTION[]       = "--volumeopts=";
+static constexpr char VOL_DRIVER_DEFAULT[]        = "rexray";
+static constexpr char DEFAULT_DVDCLI_BIN[]        = "/usr/bin/dvdcli";
+
+// Volumes of this driver are directories in the local pool, created and
+// removed in-process without dvdcli. They do not outlive their last user.
+static constexpr char LOCAL_VOLUME_DRIVER[]       = "local";
+
+static constexpr char VOL_NAME_ENV_VAR_NAME[]     = "DVDI_VOLUME_NAME";
+static constexpr char VOL_DRIVER_ENV_VAR_NAME[]   = "DVDI_VOLUME_DRIVER";
+static constexpr char VOL_OPTS_ENV_VAR_NAME[]     = "DVDI_VOLUME_OPTS";
+static constexpr char VOL_CPATH_ENV_VAR_NAME[]    = "DVDI_VOLUME_CONTAINERPATH";
+static constexpr char VOL_DVDCLI_ENV_VAR_NAME[]   = "DVDI_VOLUME_DVDCLI";
+static constexpr char VOL_EXPLICIT_ENV_VAR_NAME[]  = "DVDI_VOLUME_EXPLICITCREATE";
+static constexpr char VOL_SUBPATH_ENV_VAR_NAME[]  = "DVDI_VOLUME_SUBPATH";
+static constexpr char VOL_QUOTA_ENV_VAR_NAME[]    = "DVDI_VOLUME_QUOTA";
+static constexpr char VOL_IOPS_ENV_VAR_NAME[]     = "DVDI_VOLUME_IOPS";
+static constexpr char VOL_BPS_ENV_VAR_NAME[]      = "DVDI_VOLUME_BPS";
+static constexpr char VOL_TUNING_ENV_VAR_NAME[]   = "DVDI_VOLUME_TUNING";
+static constexpr char VOL_CACHE_ENV_VAR_NAME[]    = "DVDI_VOLUME_CACHE";
+static constexpr char VOL_SNAPSHOT_ENV_VAR_NAME[] = "DVDI_VOLUME_FROM_SNAPSHOT";
+static constexpr char VOL_CSI_ENV_VAR_NAME[]      = "DVDI_VOLUME_CSI_ENDPOINT";
+static constexpr char VOL_IDMAP_ENV_VAR_NAME[]    = "DVDI_VOLUME_IDMAP";
+static constexpr char VOL_OVERLAY_ENV_VAR_NAME[]  = "DVDI_VOLUME_OVERLAY";
+
+// Identifies a volume by driver and name, case insensitively.
+using VolumeID = size_t;
+
+VolumeID volumeId(const ExternalMount& em);
+
+// Returns true if the string contains a character that could be used to
+// inject shell commands or escape a path. Volume drivers and names with
+// one are rejected.
+bool containsProhibitedChars(const std::string& s);
+
+// Returns true if the string contains a shell metacharacter. Used for
+// values that are paths, and so may contain slashes, but still end up on
+// a command line.
+bool containsShellChars(const std::string& s);
+
+// What the agent is configured for, as far as validating requests goes.
+struct SpecPolicy
+{
+  SpecPolicy() : localVolumes(false), cacheTier(false) {}
+
+  hashset<std::string> tuningProfiles;
+  bool localVolumes;
+  bool cacheTier;
+};
+
+// Returns the volumes requested by the DVDI_* variables of a task's
+// environment, in the order of their index (the optional digit suffix),
+// with defaults filled in. Volumes requested twice without a container
+// path are listed once, and a volume requested again with a container
+// path is an error, so a container holds each volume only once. The
+// mountpoint is not set.
+Try<std::vector<ExternalMount>> parseVolumeSpecs(
+    const std::string& containerId,
+    const std::vector<std::pair<std::string, std::string>>& environment,
+    const SpecPolicy& policy);
+
+// Runs the command in a shell and returns its standard output. Fails if
+// it cannot be started or exits with a non-zero status.
+Try<std::string> runCommand(const std::string& command);
+
+// Turns comma separated volume options into --volumeopts= arguments.
+std::string formatOptions(const std::string& options);
+
+// Mounts the volume with dvdcli and returns its mountpoint. A volume
+// created from a snapshot gets the snapshot passed as the snapshotOption
+// volume option.
+Try<std::string> dvdcliMount(
+    const ExternalMount& em,
+    const std::string&   snapshotOption);
+
+Try<Nothing> dvdcliUnmount(const ExternalMount& em);
+
+// Writes the mount checkpoint aside and renames it into place, so that
+// readers never see a partial file.
+Try<Nothing> writeMountList(
+    const std::string&       path,
+    const ExternalMountList& mountlist);
+
+// Reads the mount checkpoint. None if there is none. Checkpoints written
+// without a length prefix are read too, a truncated one is an error.
+Result<ExternalMountList> readMountList(const std::string& path);
+
+// The volumes held by each container, by container id. A volume is
+// mounted while at least one container holds it.
+//
+// Only the dvdi tool uses it. It is not the isolator's refcount: the
+// isolator counts holders in its infos, together with the volumes that
+// are pending, mounting, detaching or orphaned, none of which exist
+// here. Changes to one are not reflected in the other.
+class VolumeTable
+{
+public:
+  VolumeTable() {}
+  explicit VolumeTable(const ExternalMountList& mountlist);
+
+  // Records that the container of em holds the volume. Returns true if
+  // no container held it before, i.e. it still has to be mounted.
+  bool add(const ExternalMount& em);
+
+  // Releases the volumes held by the container. Returns those that no
+  // container holds any more, i.e. that have to be unmounted.
+  std::vector<ExternalMount> remove(const std::string& containerId);
+
+  size_t holders(const ExternalMount& em) const;
+
+  // Returns the mountpoint of the volume if a container holds it mounted.
+  Option<std::string> mountpoint(const ExternalMount& em) const;
+
+  const std::vector<ExternalMount>& mounts() const { return held; }
+
+  // The table as a checkpoint, see writeMountList().
+  ExternalMountList mountList() const;
+
+private:
+  std::vector<ExternalMount> held;
+};
+
+} // namespace dvdi {
+
+#endif // SRC_DVDI_CORE_HPP_
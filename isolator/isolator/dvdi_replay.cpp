@@ -0,0 +1,453 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// dvdi-replay feeds a trace recorded with the trace_file parameter back
+// into the isolator, against a fake volume driver that takes as long as
+// the real one did. Usage:
+//
+//   dvdi-replay --trace=<file> [--speed=<factor>] [--dvdcli=<fake>]
+//               [--work_dir=<dir>] [--state_dir=<dir>]
+//               [--<isolator parameter>=<value> ...]
+//
+// --speed=2 replays twice as fast, --speed=0 as fast as possible. Other
+// flags are passed to the isolator as module parameters. The isolator
+// keeps its checkpoint in <work_dir>/state unless --state_dir is given,
+// and never in the agent's state directory.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <fstream>
+#include <iostream>
+#include <mutex>
+
+#include <mesos/mesos.hpp>
+#include <mesos/slave/isolator.hpp>
+#include "docker_volume_driver_isolator.hpp"
+
+#include <process/clock.hpp>
+#include <process/future.hpp>
+#include <process/process.hpp>
+
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/json.hpp>
+#include <stout/numify.hpp>
+#include <stout/os.hpp>
+#include <stout/path.hpp>
+#include <stout/strings.hpp>
+
+using namespace mesos;
+using namespace mesos::slave;
+using namespace process;
+
+using std::list;
+using std::string;
+using std::vector;
+
+#ifndef DVDI_PKGLIBEXECDIR
+#define DVDI_PKGLIBEXECDIR "/usr/local/libexec/dvdi-modules"
+#endif
+
+static constexpr char DEFAULT_FAKE_DVDCLI[] =
+  DVDI_PKGLIBEXECDIR "/dvdi-fake-dvdcli";
+
+// Read by the fake driver, see dvdi-fake-dvdcli.
+static constexpr char REPLAY_ROOT_ENV_VAR_NAME[] = "DVDI_REPLAY_ROOT";
+
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
+using Prepared = Future<Option<CommandInfo>>;
+#elif MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 270
+using Prepared = Future<Option<ContainerPrepareInfo>>;
+#else
+using Prepared = Future<Option<ContainerLaunchInfo>>;
+#endif
+
+// JSON::Number's accessors differ between stout versions, its output
+// does not.
+static double number(const JSON::Object& object, const string& key)
+{
+  Result<JSON::Number> value = object.find<JSON::Number>(key);
+  if (!value.isSome()) {
+    return 0;
+  }
+
+  Try<double> parsed = numify<double>(stringify(value.get()));
+  return parsed.isSome() ? parsed.get() : 0;
+}
+
+static string text(const JSON::Object& object, const string& key)
+{
+  Result<JSON::String> value = object.find<JSON::String>(key);
+  return value.isSome() ? value.get().value : string();
+}
+
+// Replayed latencies of one kind of event, next to the recorded ones
+// where the trace has them.
+struct Summary
+{
+  Summary()
+    : count(0), failed(0), latency(0), recordedCount(0), recorded(0) {}
+
+  size_t count;
+  size_t failed;
+  double latency;
+  size_t recordedCount;
+  double recorded;
+};
+
+static std::mutex reportMutex;
+
+static void report(
+    Summary*      summary,
+    const string& event,
+    const string& container,
+    const Time&   started,
+    const Option<double>& recorded,
+    bool          ok)
+{
+  const double latency = (Clock::now() - started).secs();
+
+  JSON::Object result;
+  result.values["event"] = JSON::String(event);
+  result.values["container"] = JSON::String(container);
+  result.values["latency"] = JSON::Number(latency);
+  if (recorded.isSome()) {
+    result.values["recorded_latency"] = JSON::Number(recorded.get());
+  }
+  result.values["ok"] = JSON::Boolean(ok);
+
+  std::lock_guard<std::mutex> lock(reportMutex);
+
+  summary->count++;
+  summary->failed += ok ? 0 : 1;
+  summary->latency += latency;
+  if (recorded.isSome()) {
+    summary->recordedCount++;
+    summary->recorded += recorded.get();
+  }
+
+  std::cout << stringify(result) << std::endl;
+}
+
+static JSON::Object summarize(const Summary& summary)
+{
+  JSON::Object object;
+  object.values["count"] = JSON::Number(summary.count);
+  object.values["failed"] = JSON::Number(summary.failed);
+  object.values["mean_latency"] = JSON::Number(
+      summary.count > 0 ? summary.latency / summary.count : 0);
+  if (summary.recordedCount > 0) {
+    object.values["mean_recorded_latency"] =
+      JSON::Number(summary.recorded / summary.recordedCount);
+  }
+  return object;
+}
+
+static void usage(const char* argv0)
+{
+  std::cerr << "Usage: " << argv0 << " --trace=<file> [--speed=<factor>]"
+            << " [--dvdcli=<fake>] [--work_dir=<dir>] [--state_dir=<dir>]"
+            << " [--<isolator parameter>=<value> ...]" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  string traceFile;
+  string dvdcli = DEFAULT_FAKE_DVDCLI;
+  double speed = 1;
+  Option<string> workDir;
+  Option<string> stateDir;
+  Parameters parameters;
+
+  for (int i = 1; i < argc; i++) {
+    const string arg = argv[i];
+    const size_t equals = arg.find('=');
+    if (!strings::startsWith(arg, "--") || equals == string::npos) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    const string key = arg.substr(2, equals - 2);
+    const string value = arg.substr(equals + 1);
+
+    if (key == "trace") {
+      traceFile = value;
+    } else if (key == "dvdcli") {
+      dvdcli = value;
+    } else if (key == "speed") {
+      Try<double> parsed = numify<double>(value);
+      if (parsed.isError() || parsed.get() < 0) {
+        std::cerr << "Invalid speed " << value << std::endl;
+        return EXIT_FAILURE;
+      }
+      speed = parsed.get();
+    } else {
+      if (key == DVDI_WORKDIR_PARAM_NAME) {
+        workDir = value;
+      } else if (key == STATE_DIR_PARAM_NAME) {
+        stateDir = value;
+      }
+      Parameter* parameter = parameters.add_parameter();
+      parameter->set_key(key);
+      parameter->set_value(value);
+    }
+  }
+
+  if (traceFile.empty()) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Try<string> trace = os::read(traceFile);
+  if (trace.isError()) {
+    std::cerr << "Failed to read " << traceFile << ": " << trace.error()
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  vector<JSON::Object> events;
+  foreach (const string& line, strings::tokenize(trace.get(), "\n")) {
+    Try<JSON::Object> event = JSON::parse<JSON::Object>(line);
+    if (event.isError()) {
+      std::cerr << "Skipping malformed trace line: " << event.error()
+                << std::endl;
+      continue;
+    }
+    events.push_back(event.get());
+  }
+
+  if (events.empty()) {
+    std::cerr << traceFile << " holds no events" << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  // The replay starts from an empty agent, its checkpoint and the fake
+  // volumes are kept apart from any real ones.
+  if (workDir.isNone()) {
+    Try<string> temporary = os::mkdtemp("/tmp/dvdi-replay-XXXXXX");
+    if (temporary.isError()) {
+      std::cerr << "Failed to create a work directory: "
+                << temporary.error() << std::endl;
+      return EXIT_FAILURE;
+    }
+    workDir = temporary.get();
+
+    Parameter* parameter = parameters.add_parameter();
+    parameter->set_key(DVDI_WORKDIR_PARAM_NAME);
+    parameter->set_value(workDir.get());
+  }
+
+  // Never the agent's own checkpoint, which recover() would read and
+  // every prepare() and cleanup() overwrite.
+  if (stateDir.isNone()) {
+    stateDir = path::join(workDir.get(), "state");
+
+    Parameter* parameter = parameters.add_parameter();
+    parameter->set_key(STATE_DIR_PARAM_NAME);
+    parameter->set_value(stateDir.get());
+  }
+
+  Result<string> resolved = os::realpath(stateDir.get());
+  if (path::join(stateDir.get(), "") == DVDI_MOUNTLIST_PATH ||
+      (resolved.isSome() &&
+       path::join(resolved.get(), "") == DVDI_MOUNTLIST_PATH)) {
+    std::cerr << "Refusing to replay against the agent's state in "
+              << DVDI_MOUNTLIST_PATH << ", pass another --"
+              << STATE_DIR_PARAM_NAME << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const string root = path::join(workDir.get(), "replay");
+
+  // The fake driver sleeps for the mean recorded latency of each call.
+  hashmap<string, double> driverLatencies;
+  hashmap<string, size_t> driverCalls;
+  hashmap<string, double> prepareLatencies;
+  foreach (const JSON::Object& event, events) {
+    if (text(event, "event") == "driver") {
+      const string file = path::join(
+          root, "latency", text(event, "driver"),
+          text(event, "volume") + "." + text(event, "command"));
+      driverLatencies[file] += number(event, "latency");
+      driverCalls[file]++;
+    } else if (text(event, "event") == "prepared") {
+      prepareLatencies[text(event, "container")] = number(event, "latency");
+    }
+  }
+
+  foreachpair (const string& file, double latency, driverLatencies) {
+    const double seconds =
+      speed > 0 ? latency / driverCalls[file] / speed : 0;
+
+    Try<Nothing> written = os::mkdir(Path(file).dirname());
+    if (written.isSome()) {
+      written = os::write(file, stringify(seconds));
+    }
+    if (written.isError()) {
+      std::cerr << "Failed to write " << file << ": " << written.error()
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  ::setenv(REPLAY_ROOT_ENV_VAR_NAME, root.c_str(), 1);
+
+  process::initialize();
+
+  Try<Isolator*> created = DockerVolumeDriverIsolator::create(parameters);
+  if (created.isError()) {
+    std::cerr << "Failed to create the isolator: " << created.error()
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  Isolator* isolator = created.get();
+
+  isolator->recover({}, hashset<ContainerID>()).await();
+
+  Summary prepares;
+  Summary cleanups;
+  hashmap<string, Prepared> prepared;
+  list<Future<Nothing>> cleaned;
+
+  const double firstTs = number(events.front(), "ts");
+  const Time start = Clock::now();
+
+  foreach (const JSON::Object& event, events) {
+    const string kind = text(event, "event");
+    if (kind != "prepare" && kind != "cleanup") {
+      continue;
+    }
+
+    if (speed > 0) {
+      const Duration due =
+        Nanoseconds((number(event, "ts") - firstTs) / speed * 1e9);
+      const Duration elapsed = Clock::now() - start;
+      if (due > elapsed) {
+        os::sleep(due - elapsed);
+      }
+    }
+
+    ContainerID containerId;
+    containerId.set_value(text(event, "container"));
+
+    const Time started = Clock::now();
+
+    if (kind == "prepare") {
+      ExecutorInfo executorInfo;
+      Environment* environment =
+        executorInfo.mutable_command()->mutable_environment();
+
+      Result<JSON::Object> recorded = event.find<JSON::Object>("environment");
+      if (recorded.isSome()) {
+        foreachpair (const string& name,
+                     const JSON::Value& value,
+                     recorded.get().values) {
+          // Every volume goes to the fake driver, CSI ones included.
+          if (strings::startsWith(name, VOL_DVDCLI_ENV_VAR_NAME) ||
+              strings::startsWith(name, VOL_CSI_ENV_VAR_NAME)) {
+            continue;
+          }
+
+          Environment::Variable* variable = environment->add_variables();
+          variable->set_name(name);
+          variable->set_value(value.as<JSON::String>().value);
+
+          if (strings::startsWith(name, VOL_NAME_ENV_VAR_NAME)) {
+            Environment::Variable* fake = environment->add_variables();
+            fake->set_name(
+                VOL_DVDCLI_ENV_VAR_NAME +
+                name.substr(strlen(VOL_NAME_ENV_VAR_NAME)));
+            fake->set_value(dvdcli);
+          }
+        }
+      }
+
+      const string directory =
+        path::join(workDir.get(), "sandboxes", containerId.value());
+      os::mkdir(directory);
+
+      // Nested containers are replayed as top-level ones.
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
+      Prepared future = isolator->prepare(
+          containerId, executorInfo, directory, None(), None());
+#elif MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 270
+      Prepared future = isolator->prepare(
+          containerId, executorInfo, directory, None());
+#else
+      ContainerConfig containerConfig;
+#if MESOS_VERSION_INT >= 270 && MESOS_VERSION_INT < 280
+      containerConfig.mutable_executorinfo()->CopyFrom(executorInfo);
+#else
+      containerConfig.mutable_executor_info()->CopyFrom(executorInfo);
+#endif
+      containerConfig.set_directory(directory);
+
+      Prepared future = isolator->prepare(containerId, containerConfig);
+#endif
+
+      Option<double> recordedLatency = None();
+      if (prepareLatencies.contains(containerId.value())) {
+        recordedLatency = prepareLatencies[containerId.value()];
+      }
+
+      future.onAny([=, &prepares](const Prepared& result) {
+        report(&prepares, "prepare", containerId.value(), started,
+               recordedLatency, result.isReady());
+      });
+
+      prepared[containerId.value()] = future;
+    } else {
+      // As on an agent, a container is not destroyed while preparing.
+      if (prepared.contains(containerId.value())) {
+        prepared[containerId.value()].await();
+      }
+
+      Future<Nothing> future = isolator->cleanup(containerId);
+      future.onAny([=, &cleanups](const Future<Nothing>& result) {
+        report(&cleanups, "cleanup", containerId.value(), started,
+               None(), result.isReady());
+      });
+
+      cleaned.push_back(future);
+    }
+  }
+
+  foreachvalue (const Prepared& future, prepared) {
+    future.await();
+  }
+  foreach (const Future<Nothing>& future, cleaned) {
+    future.await();
+  }
+
+  JSON::Object summary;
+  summary.values["prepare"] = summarize(prepares);
+  summary.values["cleanup"] = summarize(cleanups);
+  summary.values["duration"] = JSON::Number((Clock::now() - start).secs());
+  summary.values["recorded_duration"] =
+    JSON::Number(number(events.back(), "ts") - firstTs);
+
+  {
+    std::lock_guard<std::mutex> lock(reportMutex);
+    std::cout << stringify(summary) << std::endl;
+  }
+
+  delete isolator;
+
+  return prepares.failed + cleanups.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
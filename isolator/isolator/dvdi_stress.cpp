@@ -0,0 +1,459 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// dvdi-stress drives the isolator with random, overlapping prepare(),
+// cleanup() and agent restarts against dvdi-fake-dvdcli, which is made to
+// add latency, fail and hang, and checks the isolator's invariants after
+// every step. Usage:
+//
+//   dvdi-stress [--steps=<n>] [--seed=<n>] [--volumes=<n>]
+//               [--dvdcli=<fake>] [--work_dir=<dir>]
+//               [--<isolator parameter>=<value> ...]
+//
+// The faults are set with the DVDI_FAKE_* variables of dvdi-fake-dvdcli,
+// which default to a few percent of failing and hanging calls. Exits
+// non-zero if any invariant was violated. Run by make check.
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+
+#include <mesos/mesos.hpp>
+#include <mesos/slave/isolator.hpp>
+#include "docker_volume_driver_isolator.hpp"
+
+#include <process/clock.hpp>
+#include <process/dispatch.hpp>
+#include <process/future.hpp>
+#include <process/owned.hpp>
+#include <process/pid.hpp>
+#include <process/process.hpp>
+
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/json.hpp>
+#include <stout/numify.hpp>
+#include <stout/os.hpp>
+#include <stout/path.hpp>
+#include <stout/stringify.hpp>
+#include <stout/strings.hpp>
+
+using namespace mesos;
+using namespace mesos::slave;
+using namespace process;
+
+#if MESOS_VERSION_INT < 200 || MESOS_VERSION_INT >= 240
+using mesos::internal::slave::MesosIsolator;
+using mesos::internal::slave::MesosIsolatorProcess;
+#endif
+
+using std::list;
+using std::string;
+using std::vector;
+
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 240
+int main(int argc, char** argv)
+{
+  // The 0.23 isolator is wrapped by create(), its invariants cannot be
+  // checked from here.
+  std::cerr << "dvdi-stress needs Mesos 0.24 or later" << std::endl;
+  return 77;
+}
+#else
+#ifndef DVDI_PKGLIBEXECDIR
+#define DVDI_PKGLIBEXECDIR "/usr/local/libexec/dvdi-modules"
+#endif
+
+static constexpr char DEFAULT_FAKE_DVDCLI[] =
+  DVDI_PKGLIBEXECDIR "/dvdi-fake-dvdcli";
+static constexpr char FAKE_DRIVER[] = "fake";
+
+// Read by the fake driver, see dvdi-fake-dvdcli.
+static constexpr char REPLAY_ROOT_ENV_VAR_NAME[] = "DVDI_REPLAY_ROOT";
+
+// Faults injected unless set in the environment.
+static const struct {
+  const char* name;
+  const char* value;
+} DEFAULT_FAULTS[] = {
+  {"DVDI_FAKE_LATENCY_MS", "50"},
+  {"DVDI_FAKE_FAIL_PERCENT", "10"},
+  {"DVDI_FAKE_HANG_PERCENT", "2"},
+  {"DVDI_FAKE_HANG_SECS", "2"},
+};
+
+// How long in-flight unmounts may take before a restart gives up on them.
+static const Duration QUIESCE_TIMEOUT = Seconds(60);
+
+#if MESOS_VERSION_INT < 270
+using Prepared = Future<Option<ContainerPrepareInfo>>;
+#else
+using Prepared = Future<Option<ContainerLaunchInfo>>;
+#endif
+
+static void usage(const char* argv0)
+{
+  std::cerr << "Usage: " << argv0 << " [--steps=<n>] [--seed=<n>]"
+            << " [--volumes=<n>] [--dvdcli=<fake>] [--work_dir=<dir>]"
+            << " [--<isolator parameter>=<value> ...]" << std::endl;
+}
+
+// A container the stress run prepared and has not cleaned up yet.
+struct Container
+{
+  ContainerID id;
+  string directory;
+  Prepared prepared;
+};
+
+// The isolator wrapped the way the agent wraps it, and its actor, for
+// checkInvariants() and drainStatus() which the agent does not call.
+struct Stressed
+{
+  Isolator* isolator;
+  PID<DockerVolumeDriverIsolator> process;
+};
+
+static Try<Stressed> create(const Parameters& parameters)
+{
+  Try<DockerVolumeDriverIsolator*> created =
+    DockerVolumeDriverIsolator::createProcess(parameters);
+  if (created.isError()) {
+    return Error(created.error());
+  }
+
+  Stressed stressed;
+  stressed.process = PID<DockerVolumeDriverIsolator>(created.get());
+  stressed.isolator = new MesosIsolator(
+      Owned<MesosIsolatorProcess>(created.get()));
+  return stressed;
+}
+
+static size_t checkInvariants(const Stressed& stressed, const string& label)
+{
+  return dispatch(
+      stressed.process,
+      &DockerVolumeDriverIsolator::checkInvariants,
+      label).get();
+}
+
+static JSON::Object drainStatus(const Stressed& stressed)
+{
+  return dispatch(
+      stressed.process,
+      &DockerVolumeDriverIsolator::drainStatus).get();
+}
+
+static Prepared prepare(
+    Isolator* isolator,
+    const Container& container,
+    const vector<string>& volumes,
+    const string& dvdcli)
+{
+  ExecutorInfo executorInfo;
+  Environment* environment =
+    executorInfo.mutable_command()->mutable_environment();
+
+  for (size_t i = 0; i < volumes.size(); i++) {
+    const string suffix = i == 0 ? "" : stringify(i);
+    const struct {
+      const char* name;
+      string value;
+    } variables[] = {
+      {VOL_NAME_ENV_VAR_NAME, volumes[i]},
+      {VOL_DRIVER_ENV_VAR_NAME, FAKE_DRIVER},
+      {VOL_DVDCLI_ENV_VAR_NAME, dvdcli},
+    };
+
+    foreach (const auto& variable, variables) {
+      Environment::Variable* added = environment->add_variables();
+      added->set_name(variable.name + suffix);
+      added->set_value(variable.value);
+    }
+  }
+
+#if MESOS_VERSION_INT > 200 && MESOS_VERSION_INT < 270
+  return isolator->prepare(
+      container.id, executorInfo, container.directory, None());
+#else
+  ContainerConfig containerConfig;
+#if MESOS_VERSION_INT >= 270 && MESOS_VERSION_INT < 280
+  containerConfig.mutable_executorinfo()->CopyFrom(executorInfo);
+#else
+  containerConfig.mutable_executor_info()->CopyFrom(executorInfo);
+#endif
+  containerConfig.set_directory(container.directory);
+
+  return isolator->prepare(container.id, containerConfig);
+#endif
+}
+
+// Waits until no unmount is running, so the isolator can be destroyed
+// without callbacks outliving it.
+static bool quiesce(const Stressed& stressed)
+{
+  const Time deadline = Clock::now() + QUIESCE_TIMEOUT;
+  while (Clock::now() < deadline) {
+    JSON::Object status = drainStatus(stressed);
+    Result<JSON::Number> detaching = status.find<JSON::Number>("detaching");
+    Try<double> count = detaching.isSome()
+      ? numify<double>(stringify(detaching.get()))
+      : Try<double>(Error("missing"));
+    if (count.isSome() && count.get() == 0) {
+      return true;
+    }
+    os::sleep(Milliseconds(50));
+  }
+  return false;
+}
+
+int main(int argc, char** argv)
+{
+  size_t steps = 300;
+  size_t volumeCount = 4;
+  unsigned seed = static_cast<unsigned>(::time(NULL));
+  string dvdcli = DEFAULT_FAKE_DVDCLI;
+  Option<string> workDir;
+  Parameters parameters;
+
+  for (int i = 1; i < argc; i++) {
+    const string arg = argv[i];
+    const size_t equals = arg.find('=');
+    if (!strings::startsWith(arg, "--") || equals == string::npos) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    const string key = arg.substr(2, equals - 2);
+    const string value = arg.substr(equals + 1);
+
+    if (key == "steps" || key == "volumes" || key == "seed") {
+      Try<size_t> parsed = numify<size_t>(value);
+      if (parsed.isError() || parsed.get() == 0) {
+        std::cerr << "Invalid " << key << " " << value << std::endl;
+        return EXIT_FAILURE;
+      }
+      if (key == "steps") {
+        steps = parsed.get();
+      } else if (key == "volumes") {
+        volumeCount = parsed.get();
+      } else {
+        seed = static_cast<unsigned>(parsed.get());
+      }
+    } else if (key == "dvdcli") {
+      dvdcli = value;
+    } else if (key == DVDI_WORKDIR_PARAM_NAME) {
+      workDir = value;
+    } else {
+      Parameter* parameter = parameters.add_parameter();
+      parameter->set_key(key);
+      parameter->set_value(value);
+    }
+  }
+
+  // The fake volumes are plain directories, which only pass the host
+  // mount table invariant below a mountpoint, so a tmpfs is preferred.
+  if (workDir.isNone()) {
+    const string base = os::exists("/dev/shm") ? "/dev/shm" : "/tmp";
+    Try<string> temporary = os::mkdtemp(path::join(base, "dvdi-stress-XXXXXX"));
+    if (temporary.isError()) {
+      std::cerr << "Failed to create a work directory: "
+                << temporary.error() << std::endl;
+      return EXIT_FAILURE;
+    }
+    workDir = temporary.get();
+  }
+
+  const string agentDir = path::join(workDir.get(), "agent");
+  const string root = path::join(workDir.get(), "fake");
+  if (os::mkdir(agentDir).isError() || os::mkdir(root).isError()) {
+    std::cerr << "Failed to set up " << workDir.get() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const struct {
+    const char* key;
+    string value;
+  } defaults[] = {
+    {DVDI_WORKDIR_PARAM_NAME, agentDir},
+    {STATE_DIR_PARAM_NAME, path::join(workDir.get(), "state")},
+    {VERIFY_INVARIANTS_PARAM_NAME, "true"},
+    {DETACH_RETRY_PARAM_NAME, "200ms"},
+    {ORPHAN_DETACH_DELAY_PARAM_NAME, "500ms"},
+  };
+  foreach (const auto& parameter, defaults) {
+    Parameter* added = parameters.add_parameter();
+    added->set_key(parameter.key);
+    added->set_value(parameter.value);
+  }
+
+  ::setenv(REPLAY_ROOT_ENV_VAR_NAME, root.c_str(), 1);
+  foreach (const auto& fault, DEFAULT_FAULTS) {
+    ::setenv(fault.name, fault.value, 0);
+  }
+
+  std::cout << "dvdi-stress seed " << seed << " in " << workDir.get()
+            << std::endl;
+
+  std::mt19937 random(seed);
+
+  process::initialize();
+
+  Try<Stressed> created = create(parameters);
+  if (created.isError()) {
+    std::cerr << "Failed to create the isolator: " << created.error()
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  Stressed stressed = created.get();
+  Isolator* isolator = stressed.isolator;
+  isolator->recover({}, hashset<ContainerID>()).await();
+
+  vector<Container> live;
+  list<Future<Nothing>> cleaned;
+  size_t prepares = 0;
+  size_t cleanups = 0;
+  size_t restarts = 0;
+  size_t violations = 0;
+
+  for (size_t step = 0; step < steps; step++) {
+    const unsigned action = random() % 10;
+    string label;
+
+    if (action < 5 || live.empty()) {
+      // Prepares a container using one to three distinct volumes, so
+      // containers keep sharing, and racing for, the same few volumes.
+      Container container;
+      container.id.set_value("stress-" + stringify(step));
+      container.directory =
+        path::join(workDir.get(), "sandboxes", container.id.value());
+      os::mkdir(container.directory);
+
+      vector<string> volumes;
+      const size_t count = 1 + random() % std::min<size_t>(3, volumeCount);
+      while (volumes.size() < count) {
+        const string volume = "vol" + stringify(random() % volumeCount);
+        if (std::find(volumes.begin(), volumes.end(), volume) ==
+            volumes.end()) {
+          volumes.push_back(volume);
+        }
+      }
+
+      container.prepared = prepare(isolator, container, volumes, dvdcli);
+      live.push_back(container);
+      prepares++;
+      label = "prepare() of " + container.id.value();
+    } else if (action < 9) {
+      // An agent may destroy a container that is still being prepared.
+      const size_t index = random() % live.size();
+      const Container container = live[index];
+      live.erase(live.begin() + index);
+
+      if (random() % 2 == 0) {
+        container.prepared.await();
+      }
+
+      cleaned.push_back(isolator->cleanup(container.id));
+      cleanups++;
+      label = "cleanup() of " + container.id.value();
+    } else {
+      // Restarts the agent. About half of the containers survive, the
+      // volumes of the others are left to recover() as orphans.
+      foreach (const Container& container, live) {
+        container.prepared.await();
+      }
+      foreach (const Future<Nothing>& future, cleaned) {
+        future.await();
+      }
+      cleaned.clear();
+
+      if (!quiesce(stressed)) {
+        std::cerr << "Unmounts did not finish within " << QUIESCE_TIMEOUT
+                  << ", giving up" << std::endl;
+        return EXIT_FAILURE;
+      }
+
+      delete isolator;
+
+      created = create(parameters);
+      if (created.isError()) {
+        std::cerr << "Failed to create the isolator: " << created.error()
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+      stressed = created.get();
+      isolator = stressed.isolator;
+
+      list<ContainerState> states;
+      vector<Container> survivors;
+      foreach (const Container& container, live) {
+        if (container.prepared.isReady() && random() % 2 == 0) {
+          ContainerState state;
+          state.mutable_container_id()->set_value(container.id.value());
+          state.set_pid(0);
+          state.set_directory(container.directory);
+          states.push_back(state);
+          survivors.push_back(container);
+        }
+      }
+      live = survivors;
+
+      isolator->recover(states, hashset<ContainerID>()).await();
+      restarts++;
+      label = "restart " + stringify(restarts);
+    }
+
+    violations += checkInvariants(
+        stressed, "step " + stringify(step) + ", " + label);
+  }
+
+  // Everything is cleaned up in the end, and every volume detached.
+  foreach (const Container& container, live) {
+    cleaned.push_back(isolator->cleanup(container.id));
+    cleanups++;
+  }
+  foreach (const Future<Nothing>& future, cleaned) {
+    future.await();
+  }
+
+  const bool quiet = quiesce(stressed);
+  violations += checkInvariants(stressed, "final cleanup()");
+
+  JSON::Object summary;
+  summary.values["seed"] = JSON::Number(seed);
+  summary.values["prepares"] = JSON::Number(prepares);
+  summary.values["cleanups"] = JSON::Number(cleanups);
+  summary.values["restarts"] = JSON::Number(restarts);
+  summary.values["violations"] = JSON::Number(violations);
+  summary.values["status"] = drainStatus(stressed);
+  std::cout << stringify(summary) << std::endl;
+
+  delete isolator;
+
+  if (!quiet) {
+    std::cerr << "Unmounts did not finish within " << QUIESCE_TIMEOUT
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return violations > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -18,11 +18,21 @@ private:
   std::string containerPath;
   std::string dvdcliPath;
   bool        explicitCreate;
+  std::string subpath;
+  std::string subpathQuota;
+  uint64_t    iops;
+  uint64_t    bps;
+  std::string tuning;
+  bool        cache;
+  std::string fromSnapshot;
+  std::string csiEndpoint;
+  bool        idmap;
+  bool        overlay;
 
 public:
   // create Builder with default values assigned
   // (in C++11 they can be simply assigned above on declaration instead)
-  Builder() {}
+  Builder() : iops(0), bps(0), cache(false), idmap(false), overlay(false) {}
 
   // sets custom values for Product creation
   // returns Builder for shorthand inline usage (same way as cout <<)
@@ -67,6 +77,57 @@ public:
     return *this;
   }
 
+  Builder& setSubpath( const std::string _subpath )
+  {
+    this->subpath = _subpath;
+    return *this;
+  }
+  Builder& setSubpathQuota( const std::string _subpathQuota )
+  {
+    this->subpathQuota = _subpathQuota;
+    return *this;
+  }
+  Builder& setIops( const uint64_t _iops )
+  {
+    this->iops = _iops;
+    return *this;
+  }
+  Builder& setBps( const uint64_t _bps )
+  {
+    this->bps = _bps;
+    return *this;
+  }
+  Builder& setTuning( const std::string _tuning )
+  {
+    this->tuning = _tuning;
+    return *this;
+  }
+  Builder& setCache( const bool _cache )
+  {
+    this->cache = _cache;
+    return *this;
+  }
+  Builder& setFromSnapshot( const std::string _fromSnapshot )
+  {
+    this->fromSnapshot = _fromSnapshot;
+    return *this;
+  }
+  Builder& setCsiEndpoint( const std::string _csiEndpoint )
+  {
+    this->csiEndpoint = _csiEndpoint;
+    return *this;
+  }
+  Builder& setIdmap( const bool _idmap )
+  {
+    this->idmap = _idmap;
+    return *this;
+  }
+  Builder& setOverlay( const bool _overlay )
+  {
+    this->overlay = _overlay;
+    return *this;
+  }
+
   ExternalMount* build()
   {
     ExternalMount* mount = new ExternalMount();
@@ -78,6 +139,16 @@ public:
     mount->set_container_path(containerPath);
     mount->set_dvdcli_path(dvdcliPath);
     mount->set_explicit_create(explicitCreate);
+    mount->set_subpath(subpath);
+    mount->set_subpath_quota(subpathQuota);
+    mount->set_iops(iops);
+    mount->set_bps(bps);
+    mount->set_tuning(tuning);
+    mount->set_cache(cache);
+    mount->set_from_snapshot(fromSnapshot);
+    mount->set_csi_endpoint(csiEndpoint);
+    mount->set_idmap(idmap);
+    mount->set_overlay(overlay);
     return mount;
   }
 };
@@ -0,0 +1,103 @@
+#!/bin/bash
+# Mounts a volume on a loop device with per-mount and filesystem options,
+# has dvdi-replay put a cache under it and take it away again, and checks
+# that both remounts kept the options dvdcli mounted the volume with.
+# Skipped unless run as root with losetup, mkfs.ext4 and dm-cache.
+set -u
+
+REPLAY="${REPLAY:-./dvdi-replay}"
+
+if [ "$(id -u)" != 0 ]; then
+  echo "SKIP: needs root"
+  exit 77
+fi
+for tool in losetup mkfs.ext4 dmsetup findmnt blockdev; do
+  if ! command -v "$tool" > /dev/null; then
+    echo "SKIP: $tool not found"
+    exit 77
+  fi
+done
+modprobe dm-cache > /dev/null 2>&1
+if ! dmsetup targets | grep -q '^cache'; then
+  echo "SKIP: dm-cache is not available"
+  exit 77
+fi
+
+tmp="$(mktemp -d)"
+device=
+cleanup() {
+  umount "$tmp/mnt" > /dev/null 2>&1
+  [ -n "$device" ] && losetup -d "$device"
+  rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+truncate -s 128M "$tmp/disk.img"
+mkfs.ext4 -q "$tmp/disk.img" || fail "mkfs.ext4 failed"
+device="$(losetup -f --show "$tmp/disk.img")" || fail "losetup failed"
+mkdir -p "$tmp/mnt" "$tmp/pool"
+
+# vol1 is the loop device, mounted with options a plain mount would not
+# use. Mounting vol2 records how vol1 is mounted under its cache, and
+# unmounting vol1 how it was mounted again without one.
+cat > "$tmp/dvdcli" <<FAKE
+#!/bin/bash
+for arg in "\$@"; do
+  case "\$arg" in
+    --volumename=*) volume="\${arg#*=}" ;;
+  esac
+done
+options() {
+  findmnt -n -o SOURCE,VFS-OPTIONS,FS-OPTIONS --mountpoint "$tmp/mnt"
+}
+case "\$1:\$volume" in
+  mount:vol1)
+    mount -o nosuid,nodev,noexec,commit=17 "$device" "$tmp/mnt" || exit 1
+    echo "$tmp/mnt"
+    ;;
+  unmount:vol1)
+    options > "$tmp/uncached"
+    umount "$tmp/mnt"
+    ;;
+  mount:vol2)
+    options > "$tmp/cached"
+    mkdir -p "$tmp/vol2"
+    echo "$tmp/vol2"
+    ;;
+esac
+FAKE
+chmod +x "$tmp/dvdcli"
+
+cat > "$tmp/trace" <<'TRACE'
+{"ts":100.0,"event":"prepare","container":"c1","environment":{"DVDI_VOLUME_NAME":"vol1","DVDI_VOLUME_DRIVER":"fake","DVDI_VOLUME_CACHE":"true"}}
+{"ts":103.0,"event":"prepare","container":"c2","environment":{"DVDI_VOLUME_NAME":"vol2","DVDI_VOLUME_DRIVER":"fake"}}
+{"ts":104.0,"event":"cleanup","container":"c1"}
+{"ts":105.0,"event":"cleanup","container":"c2"}
+TRACE
+
+"$REPLAY" --trace="$tmp/trace" --dvdcli="$tmp/dvdcli" \
+  --work_dir="$tmp/work" --cache_pool="$tmp/pool" --cache_size=64MB \
+  > "$tmp/out" 2> "$tmp/err" ||
+  fail "the replay failed: $(cat "$tmp/err")"
+
+[ -f "$tmp/cached" ] && [ -f "$tmp/uncached" ] ||
+  fail "the fake driver was not called"
+
+grep -q '^/dev/mapper/' "$tmp/cached" ||
+  fail "vol1 was not mounted through a cache: $(cat "$tmp/cached")"
+grep -q "^$device " "$tmp/uncached" ||
+  fail "vol1 was not mounted from $device again: $(cat "$tmp/uncached")"
+
+for mounted in cached uncached; do
+  for option in nosuid nodev noexec commit=17; do
+    grep -Eq "[ ,]$option(,| |$)" "$tmp/$mounted" ||
+      fail "the $mounted mount lost $option: $(cat "$tmp/$mounted")"
+  done
+done
+
+echo "PASS"
@@ -0,0 +1,53 @@
+#!/bin/bash
+# Runs the csc command lines the isolator builds in stageCsi(),
+# publishCsi(), unpublishCsi() and unstageCsi() against the mock node
+# plugin of gocsi. Skipped unless csc and the mock plugin are installed,
+# see https://github.com/rexray/gocsi.
+set -u
+
+CSC="${CSC:-csc}"
+MOCK="${MOCK:-mock}"
+
+if ! command -v "$CSC" > /dev/null || ! command -v "$MOCK" > /dev/null; then
+  echo "SKIP: $CSC or $MOCK not found"
+  exit 77
+fi
+
+tmp="$(mktemp -d)"
+mock=
+trap '[ -n "$mock" ] && kill "$mock"; rm -rf "$tmp"' EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+endpoint="$tmp/csi.sock"
+CSI_ENDPOINT="unix://$endpoint" "$MOCK" > "$tmp/mock.log" 2>&1 &
+mock=$!
+
+for i in $(seq 50); do
+  [ -S "$endpoint" ] && break
+  sleep 0.1
+done
+[ -S "$endpoint" ] || fail "the mock plugin did not create $endpoint"
+
+# The mock plugin starts out with volumes 1 to 3.
+volume=1
+# Laid out like csiStagingPath() and csiTargetPath(), with a fixed plugin
+# key instead of the hash of the endpoint.
+staging="$tmp/csi/staging/0123456789abcdef/$volume"
+target="$tmp/csi/publish/container/0123456789abcdef/$volume"
+cap="SINGLE_NODE_WRITER,mount,ext4"
+node="$CSC node --endpoint unix://$endpoint"
+
+mkdir -p "$staging" "$(dirname "$target")"
+
+$node stage --staging-target-path "$staging" --cap "$cap" "$volume" ||
+  fail "stage"
+$node publish --staging-target-path "$staging" --target-path "$target" \
+  --cap "$cap" "$volume" || fail "publish"
+$node unpublish --target-path "$target" "$volume" || fail "unpublish"
+$node unstage --staging-target-path "$staging" "$volume" || fail "unstage"
+
+echo "PASS"
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Checks that DVDI_VOLUME_CSI_ENDPOINT values that could inject shell
+# commands into the csc command line are rejected by parseVolumeSpecs().
+set -u
+
+DVDI="${DVDI:-./dvdi}"
+
+tmp="$(mktemp -d)"
+trap 'rm -rf "$tmp"' EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+for endpoint in \
+    "/run/csi.sock;touch $tmp/injected" \
+    "/run/csi.sock && touch $tmp/injected" \
+    "/run/\$(touch $tmp/injected)" \
+    "/run/\`touch $tmp/injected\`" \
+    "/run/csi.sock|touch $tmp/injected" \
+    "/run/csi sock"; do
+  if "$DVDI" parse DVDI_VOLUME_NAME=v \
+       "DVDI_VOLUME_CSI_ENDPOINT=$endpoint" > /dev/null 2>&1; then
+    fail "endpoint '$endpoint' was accepted"
+  fi
+done
+
+[ -e "$tmp/injected" ] && fail "an endpoint ran a command"
+
+"$DVDI" parse DVDI_VOLUME_NAME=v \
+  DVDI_VOLUME_CSI_ENDPOINT=/var/lib/kubelet/plugins/ebs.csi.aws.com/csi.sock \
+  > /dev/null 2>&1 || fail "a plain endpoint was rejected"
+
+"$DVDI" parse DVDI_VOLUME_NAME=v DVDI_VOLUME_CSI_ENDPOINT=run/csi.sock \
+  > /dev/null 2>&1 && fail "a relative endpoint was accepted"
+
+echo "PASS"
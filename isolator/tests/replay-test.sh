@@ -0,0 +1,59 @@
+#!/bin/bash
+# Replays a short trace against dvdi-fake-dvdcli and checks that the
+# replay kept its checkpoint and volumes in its own work directory, and
+# that it refuses to run against the agent's state directory.
+set -u
+
+REPLAY="${REPLAY:-./dvdi-replay}"
+FAKE="${FAKE:-${srcdir:-.}/dvdi-fake-dvdcli}"
+
+tmp="$(mktemp -d)"
+trap 'rm -rf "$tmp"' EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+# Two containers share vol1, the second one also uses vol2.
+cat > "$tmp/trace" <<'TRACE'
+{"ts":100.0,"event":"prepare","container":"c1","environment":{"DVDI_VOLUME_NAME":"vol1","DVDI_VOLUME_DRIVER":"fake"}}
+{"ts":100.1,"event":"driver","command":"mount","driver":"fake","volume":"vol1","latency":0.2,"ok":true}
+{"ts":100.3,"event":"prepared","container":"c1","latency":0.3}
+{"ts":101.0,"event":"prepare","container":"c2","environment":{"DVDI_VOLUME_NAME":"vol1","DVDI_VOLUME_DRIVER":"fake","DVDI_VOLUME_NAME1":"vol2","DVDI_VOLUME_DRIVER1":"fake"}}
+{"ts":101.1,"event":"driver","command":"mount","driver":"fake","volume":"vol2","latency":0.1,"ok":true}
+{"ts":102.0,"event":"cleanup","container":"c1"}
+{"ts":103.0,"event":"cleanup","container":"c2"}
+{"ts":103.1,"event":"driver","command":"unmount","driver":"fake","volume":"vol1","latency":0.1,"ok":true}
+TRACE
+
+"$REPLAY" --trace="$tmp/trace" --speed=0 --dvdcli="$FAKE" \
+  --work_dir="$tmp/work" > "$tmp/out" 2> "$tmp/err" ||
+  fail "the replay failed: $(cat "$tmp/err")"
+
+summary="$(tail -n 1 "$tmp/out")"
+for event in prepare cleanup; do
+  echo "$summary" |
+    grep -Eq "\"$event\":\{\"count\":2(\.0)?,\"failed\":0(\.0)?," ||
+    fail "unexpected summary $summary"
+done
+
+# The fake driver ran, and with the recorded latency.
+for volume in vol1 vol2; do
+  [ -d "$tmp/work/replay/volumes/fake/$volume" ] ||
+    fail "$volume was not mounted by the fake driver"
+done
+[ "$(cat "$tmp/work/replay/latency/fake/vol1.mount")" = 0 ] ||
+  fail "--speed=0 did not drop the recorded latency"
+
+[ -f "$tmp/work/state/dvdimounts.pb" ] ||
+  fail "the checkpoint is not in the replay's state directory"
+
+if "$REPLAY" --trace="$tmp/trace" --speed=0 --dvdcli="$FAKE" \
+     --work_dir="$tmp/work2" \
+     --state_dir=/var/run/mesos/isolators/mesos-module-dvdi \
+     > /dev/null 2>&1; then
+  fail "the replay ran against the agent's state directory"
+fi
+
+echo "PASS"
@@ -0,0 +1,14 @@
+#!/bin/bash
+# Runs dvdi-stress with the fake driver of the source tree. The seed is
+# printed first, pass it as STRESS_SEED to repeat a failed run.
+set -u
+
+STRESS="${STRESS:-./dvdi-stress}"
+FAKE="${FAKE:-${srcdir:-.}/dvdi-fake-dvdcli}"
+
+args=(--steps="${STRESS_STEPS:-200}" --dvdcli="$FAKE")
+if [ -n "${STRESS_SEED:-}" ]; then
+  args+=(--seed="$STRESS_SEED")
+fi
+
+exec "$STRESS" "${args[@]}"